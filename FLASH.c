@@ -1,639 +1,8244 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <pwd.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 
-#define MAXCOM 1000 // max number of letters to be supported
-#define MAXLIST 100 // max number of commands to be supported
-#define MAX_ENV_VARS 15 // maximum number of environment variables
-#define MAX_ENV_VAR_LEN 17 // maximum length of environment variable name
-#define MAX_ENV_VAL_LEN 241 // maximum length of environment variable value
-#define HASH_TABLE_SIZE 20 // size of the hash table
+#define INPUT_BUFFER_SIZE (1024 * 1024) // stdio buffer used when reading commands from a pipe or file
+#define HASH_TABLE_MIN_SIZE 16 // initial number of slots in the variable table, always a power of two
+#define PATH_CACHE_SIZE 256 // number of buckets in the command path cache
+#define DEFAULT_PATH "/bin:/usr/bin" // search path used when PATH is unset, as execvp() does
+#define ARENA_CHUNK_SIZE (64 * 1024) // default size of a per-line arena chunk
+#define ARENA_RETAIN_SIZE (1024 * 1024) // arena memory kept across lines, larger chunks are freed on reset
+#define ARENA_ALIGN 16 // alignment of every arena allocation
+#define DEFAULT_PROMPT "%u@%h:%w$ " // prompt format used when PROMPT is not set
+#define PID_MAP_MIN_SIZE 64 // initial number of slots in the pid-to-job map, always a power of two
+#define DONE_JOBS_MAX 1024 // finished jobs remembered for 'wait'/'jobs' before the oldest are dropped
+#define BUILTIN_TABLE_SIZE 128 // slots of the builtin lookup table, see builtinHash()
+#define PARSE_CACHE_SIZE 8192 // buckets of the parsed line cache, a power of two, and the most lines it holds
+#define PARSE_CACHE_LIMIT (4 * 1024 * 1024) // parsed line memory kept before the cache is flushed
+#define JOB_OUTPUT_SIZE (64 * 1024) // output kept per background job; older bytes are dropped first
+#define EVENT_BATCH 64 // events handled per epoll_wait() call
+#define TRACE_BUFFER_SIZE (64 * 1024) // trace events gathered before one write() to the trace file
+#define TRACE_ARG_MAX 256 // bytes of a command name or text kept in a trace event
+#define HISTORY_LOAD_MAX (16 * 1024 * 1024) // bytes at the end of the history file that are loaded (FLASH_HISTORY_LOAD)
+#define TRIGRAM_BUCKETS 65536 // buckets of the history search index, a power of two
+#define COPY_CHUNK_SIZE (1 << 30) // bytes asked of copy_file_range(), sendfile() and splice() per call
+#define COPY_PIPE_SIZE (1024 * 1024) // capacity asked for the private pipes of 'tee'
+#define COPY_BUFFER_SIZE (1024 * 1024) // buffer of the read()/write() fallback of 'cat', 'tee' and 'cp'
+// errno values with which the kernel refuses a zero-copy call for a pair of descriptors
+#define COPY_FALLBACK(err) ((err) == EINVAL || (err) == EXDEV || (err) == ENOSYS || (err) == EOPNOTSUPP)
+#define LINE_LIST_MAX 100 // completion candidates listed by a second Tab; the rest are only counted
+#define GLOB_CACHE_SIZE 256 // buckets of the directory listing cache used by glob expansion
+#define GLOB_READ_SIZE (1024 * 1024) // getdents64() buffer, so a large directory is read in a few calls
 
-int processString(char* str, char** parsed, char** parsedpipe, int* background);
-void parseSpace(char* str, char** parsed);
+// Process launch engines, selected at runtime with FLASH_LAUNCH=spawn|fork|zygote
+#define LAUNCH_SPAWN 0 // posix_spawn(), which glibc implements with clone(CLONE_VM|CLONE_VFORK)
+#define LAUNCH_FORK 1 // classic fork() + execvp()
+#define LAUNCH_ZYGOTE 2 // a helper process forked at startup, while the shell is still small, forks for it
+#ifndef FLASH_DEFAULT_LAUNCH
+#define FLASH_DEFAULT_LAUNCH LAUNCH_SPAWN // build with -DFLASH_DEFAULT_LAUNCH=1 to default to fork()
+#endif
+#define ZYGOTE_FDS 4 // descriptors sent with every zygote request: working directory, stdin, stdout, stderr
 
-// Environment variable structure
+void reapJobs();
+void notifyJobs();
+int runEventLoop(int timeout);
+void waitForInput();
+
+// Command line in the history. Lines from the file point into its mapping, without their newline.
+typedef struct {
+    const char* text;
+    size_t len;
+}HistoryEntry;
+
+// History: the tail of the history file, mapped read-only, followed by the lines entered since
+typedef struct {
+    int fd; // history file, opened for appending, or -1
+    int opened; // initHistory() has run
+    char* map; // mapped tail of the file
+    size_t mapLen;
+    size_t mapSkip; // bytes of the mapping before its first whole line
+    int split; // the mapped lines have been added to 'entries', done on first use
+    HistoryEntry* entries;
+    size_t count;
+    size_t cap;
+    uint32_t* trigramStart; // TRIGRAM_BUCKETS + 1 offsets into 'trigramEntries', built on the first search
+    uint32_t* trigramEntries; // for each bucket, the entries holding one of its trigrams, in order
+    size_t indexed; // entries covered by the index; later ones are searched one by one
+}History;
+
+// Command run inside the shell. 'run' sets 'last_exit_status' itself.
+typedef struct {
+    const char* name;
+    void (*run)(char** parsed);
+    int pure; // only writes to stdout and sets $?, so "$(...)" can run it without a fork
+    int (*accepts)(char** parsed); // NULL, or returns 0 to leave a command to the program of the same name
+}Builtin;
+
+const Builtin* findBuiltin(const char* name);
+const Builtin* builtinFor(char** parsed);
+
+// Arena chunk, a block of memory handed out by bumping 'used'
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+}ArenaChunk;
+
+// Bump allocator for everything that only lives as long as one command line
+typedef struct {
+    ArenaChunk* head;
+    ArenaChunk* current;
+    size_t bytes; // bytes handed out since the last reset
+    size_t allocations; // allocations since the last reset
+}Arena;
+
+// Position in an arena, to release everything allocated after it
+typedef struct {
+    ArenaChunk* chunk;
+    size_t used;
+    size_t bytes;
+    size_t allocations;
+}ArenaMark;
+
+// Header of a launch request sent to the zygote. It is followed by 'size' bytes of NUL-terminated
+// strings: the path to execute, 'argc' arguments and 'envc' "NAME=VALUE" environment entries.
+typedef struct {
+    uint32_t size;
+    uint32_t argc;
+    uint32_t envc;
+}ZygoteRequest;
+
+// Variable table slot. An empty slot has a NULL name, a deleted one has name == TOMBSTONE.
+typedef struct {
+    char* name;
+    char* value;
+    size_t valueCap; // bytes allocated for 'value', so updates can reuse it
+    unsigned int hash;
+    int exported; // passed to child processes
+}HashSlot;
+
+// Open-addressing hash table for environment variables, with linear probing
+typedef struct {
+    HashSlot* slots;
+    size_t size; // number of slots, always a power of two
+    size_t count; // live variables
+    size_t used; // live variables plus tombstones
+}HashTable;
+
+static char TOMBSTONE[] = "";
+
+HashTable hashTable = {NULL, 0, 0, 0}; // Hash table for environment variables
+
+// Environment of child processes, rebuilt from the exported variables only after one of them changed
+char** childEnv = NULL;
+char* childEnvStrings = NULL; // "NAME=VALUE" strings 'childEnv' points into
+size_t childEnvCount = 0; // entries in 'childEnv'
+size_t childEnvBytes = 0; // bytes used in 'childEnvStrings', terminating NULs included
+int childEnvDirty = 1;
+
+// Scratch buffer the text of a word is built in, while parsing it and while expanding it
+char* expandBuffer = NULL;
+size_t expandBufferCap = 0;
+
+// Arguments gathered while expanding words, used as a stack by nested command substitutions
+char** expandArgs = NULL;
+size_t expandArgCount = 0;
+size_t expandArgCap = 0;
+
+// Output of a builtin run by a command substitution, grown in the line arena
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+}CaptureBuffer;
+
+CaptureBuffer captureBuffer;
+FILE* captureStream = NULL; // stream writing into 'captureBuffer', swapped in for stdout
+char* substBuffer = NULL; // output of other command substitutions, read from a pipe and reused
+size_t substBufferCap = 0;
+
+// Directory entry as returned by getdents64(), which glibc does not declare
 typedef struct {
-    char name[MAX_ENV_VAR_LEN];
-    char value[MAX_ENV_VAL_LEN];
-}envVars;
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+}LinuxDirent64;
 
-// Hash table node
-typedef struct HashNode {
-    char name[MAX_ENV_VAR_LEN];
-    char value[MAX_ENV_VAL_LEN];
-    struct HashNode* next;
-}HashNode;
+// Names in a directory, read once for all the patterns of a command. A directory that cannot be read has none.
+typedef struct GlobDir {
+    const char* path; // as opened, "" for the working directory
+    unsigned int hash;
+    char** names; // without "." and ".."
+    unsigned char* types; // d_type of each name, DT_UNKNOWN when the file system does not say
+    size_t count;
+    struct GlobDir* next; // next listing in the same cache bucket
+}GlobDir;
 
-HashNode* hashTable[HASH_TABLE_SIZE]; // Hash table for environment variables
+GlobDir* globCache[GLOB_CACHE_SIZE]; // listings read since the last command ran, keyed by path
+Arena globArena = {NULL, NULL, 0, 0}; // listings and their names, released by clearGlobCache()
+size_t glob_cache_entries = 0;
+char* globReadBuffer = NULL;
+char** globNames = NULL; // scratch arrays a listing is gathered in before it is copied to 'globArena'
+unsigned char* globTypes = NULL;
+size_t globNameCap = 0;
+size_t globTypeCap = 0;
+
+// Path cache node, mapping a command name to the absolute path it resolved to
+typedef struct PathCacheNode {
+    char* name;
+    char* path;
+    unsigned int hash;
+    unsigned long hits;
+    struct PathCacheNode* next;
+}PathCacheNode;
+
+PathCacheNode* pathCache[PATH_CACHE_SIZE]; // Hash table of resolved command paths
+char* pathCacheKey = NULL; // Value of PATH the cached entries were resolved against
 
 // Global variable to store exit code
 int last_exit_status = 0;
 
-// Hash function
-unsigned int hashFunction(const char* name) {
-    unsigned int hash = 0;
-    while (*name) {
-        hash = (hash << 5) + *name++;
+// Exit codes of every stage of the most recent foreground pipeline
+int* pipe_status = NULL;
+int pipe_status_count = 0;
+int pipe_status_cap = 0;
+
+// Arena holding the tokens, argument lists and pipeline descriptors of the current line
+Arena lineArena = {NULL, NULL, 0, 0};
+int arena_stats = 0; // Report arena usage after every line (FLASH_ARENA_STATS)
+
+// Prompt parts, fetched once and refreshed only when they can have changed
+typedef struct {
+    char* user; // refreshed by "prompt -r"
+    char* host; // refreshed by "prompt -r"
+    char* cwd; // refreshed by changeDirectory() and "prompt -r"
+    char* rendered; // buffer the prompt is rendered into
+    size_t renderedCap;
+}PromptCache;
+
+PromptCache promptCache = {NULL, NULL, NULL, NULL, 0};
+int interactive = 0; // stdin is a terminal, so a prompt is printed before each line
+
+// Background job states
+#define JOB_FREE 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+
+// Output captured from a background job: standard output of its last stage and standard error of
+// every stage, kept in a ring buffer holding the last JOB_OUTPUT_SIZE bytes
+typedef struct {
+    char* data; // allocated when the first byte arrives
+    size_t start; // offset of the oldest byte
+    size_t length; // bytes held
+    size_t dropped; // bytes overwritten before they were dumped
+    int fd; // read end of the capture pipe, -1 once it reached end of file
+    int forward; // write new output straight to stdout, while the job is in the foreground
+}JobOutput;
+
+// Tags of the event loop descriptors that are not capture pipes, whose tag is their job slot
+#define EVENT_SIGCHLD ((uint64_t)-1)
+#define EVENT_INPUT ((uint64_t)-2)
+
+// Background job. Slot i of the job table holds job id i + 1.
+typedef struct {
+    int state;
+    pid_t* pids; // one pid per pipeline stage
+    int npids;
+    int running; // stages not reaped yet
+    int exitCode; // exit code of the last stage
+    char* command;
+    struct timespec start; // CLOCK_MONOTONIC start time
+    JobOutput output;
+    int notified; // finished and reported before the prompt, but kept until its output is dumped
+    int next; // next free slot, or next job in the finished list (-1 terminates both)
+}Job;
+
+// Job table with O(1) insert, lookup by id and removal
+typedef struct {
+    Job* jobs;
+    int size;
+    int freeHead; // free slots, reused before the table grows
+    int doneHead, doneTail; // finished jobs, oldest first
+    int doneCount;
+    int lastId; // most recently started job, used by 'fg' without arguments
+}JobTable;
+
+// Open-addressing map from pid to job slot. Empty keys are 0, deleted keys are -1.
+typedef struct {
+    pid_t* pids;
+    int* slots;
+    size_t size;
+    size_t used;
+}PidMap;
+
+// Parts of a word: literal text, a variable reference ("$NAME" or "${NAME}"), "$?", or a command substitution
+#define PART_TEXT 0
+#define PART_VAR 1
+#define PART_STATUS 2
+#define PART_COMMAND 3 // "$(...)"
+
+struct Command;
+
+// Piece of a word. 'text' is the literal text, the variable name or the source of a command
+// substitution, null-terminated.
+typedef struct {
+    int type;
+    const char* text;
+    size_t len;
+    struct Command* commands; // PART_COMMAND only: the parsed commands to run
+    int ncommands;
+}WordPart;
+
+// Command argument as written. Variables are only looked up when the command runs.
+typedef struct {
+    WordPart* parts;
+    int nparts;
+    int quoted; // contains a quoted section, so it is kept even if it expands to nothing
+    int glob; // contains an unquoted '*', '?' or '[', so it is a pattern; quoted ones are escaped with '\\'
+}Word;
+
+// One stage of a pipeline: the words of a simple command
+typedef struct {
+    Word* words;
+    int nwords;
+}Stage;
+
+// Stages joined with '|'. After "|>", the output of the last stage goes to every branch at once.
+typedef struct Pipeline {
+    Stage* stages;
+    int nstages;
+    int background; // ended with '#'
+    struct Pipeline* branches; // consumers of a "|> (...)" fan-out, or NULL
+    int nbranches;
+}Pipeline;
+
+struct Loop;
+
+// One command of a ',' sequence: a pipeline, several joined with "&&&", or a loop
+typedef struct Command {
+    Pipeline* pipelines;
+    int npipelines;
+    struct Loop* loop; // set for "for" and "repeat" loops, which have no pipelines
+    int timed; // prefixed with the 'time' keyword
+    const char* text; // source text, without the 'time' keyword, for the timing log
+}Command;
+
+// "for NAME in WORDS; do BODY; done" or "repeat COUNT { BODY }", parsed once and run many times
+typedef struct Loop {
+    const char* var; // loop variable, NULL for "repeat"
+    Word* words; // values of the loop variable, or the repeat count
+    int nwords;
+    Command* body;
+    int nbody;
+}Loop;
+
+// Parsed command line, also a parse cache entry. Never modified once built.
+typedef struct CommandLine {
+    Command* commands;
+    int ncommands;
+    const char* source;
+    size_t len;
+    unsigned int hash;
+    struct CommandLine* next; // next entry in the same cache bucket
+}CommandLine;
+
+// Tokens produced by tokenizeLine()
+#define TOKEN_WORD 0
+#define TOKEN_PIPE 1 // |
+#define TOKEN_PARALLEL 2 // &&&
+#define TOKEN_SEQUENCE 3 // , or ;
+#define TOKEN_BACKGROUND 4 // '#' ending a pipeline
+#define TOKEN_FANOUT 5 // "|>" with the '(' that follows it
+#define TOKEN_BRANCH 6 // ',' or ';' between the consumers of a fan-out
+#define TOKEN_FANOUT_END 7 // ')' closing a fan-out
+
+typedef struct {
+    int type;
+    Word word; // TOKEN_WORD only
+    const char* start; // source text of the token
+    const char* end;
+}Token;
+
+int expandPipeline(const Pipeline* pipeline, char**** stages);
+char* expandWord(const Word* word);
+const char* findSubstitutionEnd(const char* c, const char* end);
+void* growScratch(void* array, size_t* cap, size_t count, size_t size);
+void expandArguments(const Word* word);
+int parseSubstitution(const char* src, size_t len);
+void execLoop(const Loop* loop);
+void clearGlobCache();
+GlobDir* readGlobDir(const char* path, size_t len);
+int distributeStream(int in, int* outputs, const char** names, int count, const char* prefix);
+int compareMatches(const void* a, const void* b);
+char* editLine();
+
+JobTable jobTable = {NULL, 0, -1, -1, -1, 0, 0};
+PidMap pidMap = {NULL, NULL, 0, 0};
+int sigchldPipe[2] = {-1, -1}; // self-pipe written by the SIGCHLD handler
+int event_fd = -1; // epoll instance watching the capture pipes and the SIGCHLD self-pipe
+int capture_count = 0; // capture pipes still open; while there are none, waits block in wait4()
+int sigchld_pending = 0; // the event loop drained the self-pipe, so reapJobs() must still reap
+
+// Parsed lines, keyed by the hash of their text, and the arena they are allocated from
+CommandLine* parseCache[PARSE_CACHE_SIZE];
+Arena parseArena = {NULL, NULL, 0, 0};
+size_t parse_cache_entries = 0;
+unsigned long parse_cache_hits = 0;
+unsigned long parse_cache_misses = 0;
+
+// Scratch arrays the parser fills before the parsed line is laid out in the parse arena
+Token* parseTokens = NULL;
+size_t parseTokenCount = 0;
+size_t parseTokenCap = 0;
+WordPart* parseParts = NULL;
+size_t parsePartCount = 0;
+size_t parsePartCap = 0;
+Command* parseCommandStack = NULL; // commands of the lists being parsed, innermost last
+size_t parseCommandCount = 0;
+size_t parseCommandCap = 0;
+int parseFanoutGroup = 0; // tokenizing inside "|> ( ... )", where ')' ends a word
+
+// Maximum number of "&&&" commands running at once (-j N, defaults to the number of CPUs)
+int parallel_limit = 1;
+
+// Resource usage of the children waited for since the last resetUsage(), summed with wait4()
+struct rusage child_usage;
+FILE* time_log = NULL; // Per-command timing log (FLASH_TIMELOG)
+
+History history = {-1, 0, NULL, 0, 0, 0, NULL, 0, 0, NULL, NULL, 0};
+
+// A PATH directory and the executables found in it when its modification time was 'mtime'
+typedef struct {
+    char* path;
+    struct timespec mtime;
+    int scanned;
+    char** names;
+    size_t count;
+}PathDir;
+
+// Sorted names of the executables on PATH, for command completion, kept up to date by refreshExecIndex()
+typedef struct {
+    char* key; // PATH the directories were taken from
+    PathDir* dirs;
+    size_t ndirs;
+    char** names; // sorted and unique, pointing into the directories' names
+    size_t count;
+}ExecIndex;
+
+ExecIndex execIndex = {NULL, NULL, 0, NULL, 0};
+
+// Completion candidate: a name and its d_type, to tell directories apart
+typedef struct {
+    const char* name;
+    unsigned char type;
+}Completion;
+
+Completion* completions = NULL;
+size_t completionCount = 0;
+size_t completionCap = 0;
+
+// Line editor: the line being edited, the terminal settings to restore, and bytes read but not handled yet
+typedef struct {
+    char* buf;
+    size_t len;
+    size_t cap;
+    size_t pos; // cursor
+    struct termios saved;
+    size_t browse; // history entry shown by Up and Down, or -1 for the line being typed
+    char* draft; // line being typed, kept while browsing the history
+    size_t draftLen;
+    size_t draftCap;
+    int lastTab; // the previous key was Tab, so another one lists the candidates
+    char input[256];
+    size_t inputLen;
+    size_t inputPos;
+    char* out; // output gathered for one write()
+    size_t outLen;
+    size_t outCap;
+}LineEditor;
+
+LineEditor editor;
+
+// Execution trace in Chrome trace-event format (FLASH_TRACE), gathered in 'traceBuffer' and written in blocks
+int trace_fd = -1;
+pid_t trace_pid = 0; // process the buffered events belong to
+char* traceBuffer = NULL;
+size_t traceLen = 0;
+
+// Engine used to start external commands
+int launch_mode = FLASH_DEFAULT_LAUNCH;
+
+// Zygote launcher: the shell's end of the socket, and the descriptor of the working directory sent to it
+int zygote_fd = -1;
+int cwd_fd = -1;
+
+extern char** environ;
+
+// String hash (32-bit FNV-1a)
+unsigned int hashString(const char* str) {
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Hash of a byte range, same function as hashString()
+unsigned int hashBytes(const char* data, size_t len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+    Function: findSlot
+
+    Description:
+    Finds the slot of a variable in the hash table, or the slot where it should be inserted.
+
+    Parameters:
+    - table: The hash table to search. It must have at least one empty slot.
+    - name: The variable name.
+    - hash: hashString(name).
+
+    Return:
+    - The slot holding the variable if it exists.
+    - Otherwise the first tombstone met while probing, or the empty slot that ended the probe.
+*/
+HashSlot* findSlot(HashTable* table, const char* name, unsigned int hash) {
+    size_t mask = table->size - 1;
+    HashSlot* reuse = NULL;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        HashSlot* slot = &table->slots[i];
+        if (slot->name == NULL) {
+            return reuse ? reuse : slot;
+        }
+        if (slot->name == TOMBSTONE) {
+            if (reuse == NULL) {
+                reuse = slot;
+            }
+        } else if (slot->hash == hash && strcmp(slot->name, name) == 0) {
+            return slot;
+        }
     }
-    return hash % HASH_TABLE_SIZE;
 }
 
-// Function to insert a key-value pair into the hash table
-void insertIntoHashTable(const char* name, const char* value) {
-    unsigned int index = hashFunction(name);
-    HashNode* newNode = (HashNode*)malloc(sizeof(HashNode));
-    if (!newNode) {
+/*
+    Function: resizeHashTable
+
+    Description:
+    Rehashes every live variable into a new slot array, dropping tombstones.
+
+    Parameters:
+    - table: The hash table to resize.
+    - size: The new number of slots, a power of two larger than the number of live variables.
+
+    Return:
+    None
+*/
+void resizeHashTable(HashTable* table, size_t size) {
+    HashSlot* old = table->slots;
+    size_t oldSize = table->size;
+
+    table->slots = (HashSlot*)calloc(size, sizeof(HashSlot));
+    if (!table->slots) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(EXIT_FAILURE);
     }
-    strcpy(newNode->name, name);
-    strcpy(newNode->value, value);
-    newNode->next = NULL;
+    table->size = size;
+    table->used = table->count;
 
-    if (hashTable[index] == NULL) {
-        hashTable[index] = newNode;
-    } else {
-        // Collision handling: append at the end
-        HashNode* temp = hashTable[index];
-        while (temp->next != NULL) {
-            temp = temp->next;
+    for (size_t i = 0; i < oldSize; i++) {
+        if (old[i].name != NULL && old[i].name != TOMBSTONE) {
+            *findSlot(table, old[i].name, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
+
+/*
+    Function: insertIntoHashTable
+
+    Description:
+    Sets a variable, creating it if needed. Names and values can be of any length.
+
+    Parameters:
+    - name: The variable name.
+    - value: The new value.
+
+    Return:
+    A pointer to the stored value.
+
+    Details:
+    1. The table grows to twice its size once live variables and tombstones fill 3/4 of it,
+       or is rehashed in place when most of that load is tombstones.
+    2. An existing variable is updated in place; its value buffer is only reallocated when the
+       new value does not fit.
+    3. Updating an exported variable marks the child environment for a rebuild.
+*/
+char* insertIntoHashTable(const char* name, const char* value) {
+    HashTable* table = &hashTable;
+    if (table->size == 0 || (table->used + 1) * 4 > table->size * 3) {
+        size_t size = table->size ? table->size : HASH_TABLE_MIN_SIZE;
+        while ((table->count + 1) * 2 > size) {
+            size *= 2;
+        }
+        resizeHashTable(table, size);
+    }
+
+    unsigned int hash = hashString(name);
+    HashSlot* slot = findSlot(table, name, hash);
+    size_t len = strlen(value);
+
+    if (slot->name == NULL || slot->name == TOMBSTONE) {
+        if (slot->name == NULL) {
+            table->used++;
+        }
+        table->count++;
+        slot->name = strdup(name);
+        slot->value = NULL;
+        slot->valueCap = 0;
+        slot->hash = hash;
+        slot->exported = 0;
+        if (!slot->name) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (len + 1 > slot->valueCap) {
+        char* grown = (char*)realloc(slot->value, len + 1);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
         }
-        temp->next = newNode;
+        slot->value = grown;
+        slot->valueCap = len + 1;
     }
+    memcpy(slot->value, value, len + 1);
+    if (slot->exported) {
+        childEnvDirty = 1;
+    }
+    return slot->value;
 }
 
 // Function to search for a key in the hash table
 char* searchInHashTable(const char* name) {
-    unsigned int index = hashFunction(name);
-    HashNode* temp = hashTable[index];
-    while (temp != NULL) {
-        if (strcmp(temp->name, name) == 0) {
-            return temp->value;
-        }
-        temp = temp->next;
+    if (hashTable.count == 0) {
+        return NULL;
     }
-    return NULL; // Key not found
+    HashSlot* slot = findSlot(&hashTable, name, hashString(name));
+    if (slot->name == NULL || slot->name == TOMBSTONE) {
+        return NULL; // Key not found
+    }
+    return slot->value;
 }
 
+// Function to remove a key from the hash table. Returns 1 if it was present.
+int removeFromHashTable(const char* name) {
+    if (hashTable.count == 0) {
+        return 0;
+    }
+    HashSlot* slot = findSlot(&hashTable, name, hashString(name));
+    if (slot->name == NULL || slot->name == TOMBSTONE) {
+        return 0;
+    }
+    if (slot->exported) {
+        childEnvDirty = 1;
+    }
+    free(slot->name);
+    free(slot->value);
+    slot->name = TOMBSTONE;
+    slot->value = NULL;
+    slot->valueCap = 0;
+    hashTable.count--;
+    return 1;
+}
 
 /*
-    Function: printPrompt
+    Function: exportVariable
 
     Description:
-    This function prints the command prompt to indicate to the user that the shell is ready to receive input.
+    Sets or clears the export flag of a variable.
 
     Parameters:
-    None
+    - name: The variable name.
+    - exported: 1 to pass the variable to child processes, 0 to keep it in the shell.
 
     Return:
+    1 if the variable exists, 0 otherwise.
+*/
+int exportVariable(const char* name, int exported) {
+    if (hashTable.count == 0) {
+        return 0;
+    }
+    HashSlot* slot = findSlot(&hashTable, name, hashString(name));
+    if (slot->name == NULL || slot->name == TOMBSTONE) {
+        return 0;
+    }
+    if (slot->exported != exported) {
+        slot->exported = exported;
+        childEnvDirty = 1;
+    }
+    return 1;
+}
+
+/*
+    Function: childEnvironment
+
+    Description:
+    Returns the environment passed to child processes: one "NAME=VALUE" string per exported variable.
+
+    Parameters:
     None
 
+    Return:
+    A NULL-terminated array of strings. It stays valid until an exported variable changes.
+
     Details:
-    1. It retrieves the current username using getpwuid() function.
-    2. It retrieves the hostname using gethostname() function.
-    3. It retrieves the current working directory using getcwd() function.
-    4. It prints the command prompt in the format "<username>@<hostname>:<current_working_directory>$ ".
-       For example, "user@localhost:/home/user$ ".
+    The array is cached, so launching a command does not touch the variable table. It is rebuilt
+    only when 'childEnvDirty' has been set by a set, unset or export of an exported variable.
+    The strings are packed into a single buffer, so a rebuild costs two allocations.
 */
-void printPrompt() {
-    char hostname[1000];
-    char cwd[1000];
-    struct passwd *pw;
-    uid_t uid;
+char** childEnvironment() {
+    if (!childEnvDirty) {
+        return childEnv;
+    }
 
-    // Get the current username
-    uid = geteuid();
-    pw = getpwuid(uid);
-    if (pw == NULL) {
-        perror("Failed to get username");
-        return;
+    size_t count = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; i < hashTable.size; i++) {
+        HashSlot* slot = &hashTable.slots[i];
+        if (slot->name != NULL && slot->name != TOMBSTONE && slot->exported) {
+            count++;
+            bytes += strlen(slot->name) + strlen(slot->value) + 2;
+        }
     }
 
-    // Get the hostname
-    gethostname(hostname, sizeof(hostname));
+    free(childEnv);
+    free(childEnvStrings);
+    childEnv = (char**)malloc((count + 1) * sizeof(char*));
+    childEnvStrings = (char*)malloc(bytes + 1);
+    if (!childEnv || !childEnvStrings) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Get the current working directory
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
-        perror("Failed to get current working directory");
-        return;
+    char* next = childEnvStrings;
+    count = 0;
+    for (size_t i = 0; i < hashTable.size; i++) {
+        HashSlot* slot = &hashTable.slots[i];
+        if (slot->name != NULL && slot->name != TOMBSTONE && slot->exported) {
+            childEnv[count++] = next;
+            next = stpcpy(next, slot->name);
+            *next++ = '=';
+            next = stpcpy(next, slot->value) + 1;
+        }
     }
+    childEnv[count] = NULL;
+    childEnvCount = count;
+    childEnvBytes = bytes;
+    childEnvDirty = 0;
+    return childEnv;
+}
 
-    // Print the command line prompt
-    printf("%s@%s:%s$ ", pw->pw_name, hostname, cwd);
+/*
+    Function: arenaAlloc
+
+    Description:
+    Allocates memory from an arena. The memory stays valid until the next arenaReset() and is never freed individually.
+
+    Parameters:
+    - arena: The arena to allocate from.
+    - size: The number of bytes needed.
+
+    Return:
+    A pointer to the allocated memory, aligned to ARENA_ALIGN bytes.
+
+    Details:
+    1. The request is served from the current chunk if it fits.
+    2. Otherwise the next chunk kept from earlier lines is reused, or a new chunk of at least
+       ARENA_CHUNK_SIZE bytes is allocated and linked after the current one.
+    3. If memory allocation fails, an error message is printed and the shell exits.
+*/
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaChunk* chunk = arena->current;
+    while (chunk != NULL && chunk->size - chunk->used < size) {
+        chunk = chunk->next;
+        if (chunk != NULL) {
+            chunk->used = 0;
+        }
+    }
+
+    if (chunk == NULL) {
+        size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + chunkSize);
+        if (!chunk) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        if (arena->current == NULL) {
+            chunk->next = NULL;
+            arena->head = chunk;
+        } else {
+            // Chunks skipped above are too small for this request, so new ones go right after 'current'
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        }
+    }
+
+    arena->current = chunk;
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->bytes += size;
+    arena->allocations++;
+    return ptr;
+}
+
+/*
+    Function: arenaStrndup
+
+    Description:
+    Copies at most 'len' characters of a string into the arena and null-terminates the copy.
+
+    Parameters:
+    - arena: The arena to allocate from.
+    - str: The string to copy.
+    - len: The number of characters to copy.
+
+    Return:
+    The null-terminated copy.
+*/
+char* arenaStrndup(Arena* arena, const char* str, size_t len) {
+    char* copy = (char*)arenaAlloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
 }
 
+/*
+    Function: arenaMark
+
+    Description:
+    Records the current position of an arena, for arenaRelease().
+
+    Parameters:
+    - arena: The arena.
+
+    Return:
+    The position.
+*/
+ArenaMark arenaMark(Arena* arena) {
+    ArenaMark mark = {arena->current, arena->current ? arena->current->used : 0, arena->bytes, arena->allocations};
+    return mark;
+}
 
 /*
-    Function: takeInput
+    Function: arenaRelease
+
+    Description:
+    Releases everything allocated from an arena since a mark was taken. Earlier allocations stay valid.
+
+    Parameters:
+    - arena: The arena.
+    - mark: The position returned by arenaMark().
+
+    Return:
+    None
+
+    Details:
+    Chunks used since the mark stay linked after it and are reused by the next allocations, so a loop
+    that releases its memory after every iteration runs in the same few chunks.
+*/
+void arenaRelease(Arena* arena, ArenaMark mark) {
+    arena->current = mark.chunk ? mark.chunk : arena->head;
+    if (arena->current != NULL) {
+        arena->current->used = mark.chunk ? mark.used : 0;
+    }
+    arena->bytes = mark.bytes;
+    arena->allocations = mark.allocations;
+}
+
+/*
+    Function: arenaReset
+
+    Description:
+    Releases every allocation made from an arena at once.
+
+    Parameters:
+    - arena: The arena to reset.
+
+    Return:
+    None
+
+    Details:
+    Chunks are kept for the next line up to ARENA_RETAIN_SIZE bytes in total, so a steady stream of
+    lines reuses the same memory. Chunks beyond that limit, typically grown for one huge line, are freed.
+*/
+void arenaReset(Arena* arena) {
+    size_t kept = 0;
+    ArenaChunk** link = &arena->head;
+    while (*link != NULL) {
+        ArenaChunk* chunk = *link;
+        if (kept + chunk->size > ARENA_RETAIN_SIZE && kept > 0) {
+            *link = chunk->next;
+            free(chunk);
+            continue;
+        }
+        kept += chunk->size;
+        chunk->used = 0;
+        link = &chunk->next;
+    }
+    arena->current = arena->head;
+    arena->bytes = 0;
+    arena->allocations = 0;
+}
+
+/*
+    Function: flushTrace
 
     Description:
-    This function takes input from the user via stdin (standard input) and stores it in a string buffer.
+    Writes the buffered trace events to the trace file.
 
     Parameters:
-    - str: A pointer to a character array where the user input will be stored.
+    None
+
+    Return:
+    None
+
+    Details:
+    The file is opened with O_APPEND, so blocks written by forked subshells never overwrite each other.
+    A process forked without traceChild() still holds a copy of the shell's buffer, so only the
+    process the events belong to writes them.
+*/
+void flushTrace() {
+    if (trace_fd == -1 || traceLen == 0 || getpid() != trace_pid) {
+        return;
+    }
+    size_t written = 0;
+    while (written < traceLen) {
+        ssize_t n = write(trace_fd, traceBuffer + written, traceLen - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    traceLen = 0;
+}
+
+// Appends the decimal digits of a number to the trace buffer, at least 'width' of them
+void traceNumber(unsigned long long value, int width) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0 || n < width);
+    while (n > 0) {
+        traceBuffer[traceLen++] = digits[--n];
+    }
+}
+
+// Appends a string to the trace buffer
+void traceText(const char* text, size_t len) {
+    memcpy(traceBuffer + traceLen, text, len);
+    traceLen += len;
+}
+
+/*
+    Function: traceEvent
+
+    Description:
+    Records a trace event, if tracing is on.
+
+    Parameters:
+    - phase: 'B' to begin a span, 'E' to end the innermost one, 'i' for an instant event.
+    - name: The name of the span or event, such as "spawn" or "wait".
+    - detail: Text shown with the event, such as the command name, or NULL.
+
+    Return:
+    None
+
+    Details:
+    1. The time is read with clock_gettime(CLOCK_MONOTONIC), which is served from the vDSO, and
+       written in microseconds with nanosecond decimals, as the format expects.
+    2. The event is formatted by hand straight into the buffer, with no printf() or allocation, and
+       the buffer goes to the file with one write() every TRACE_BUFFER_SIZE bytes, so an event
+       costs well under a microsecond.
+    3. The detail is cut to TRACE_ARG_MAX bytes and escaped for JSON.
+*/
+void traceEvent(char phase, const char* name, const char* detail) {
+    if (trace_fd == -1) {
+        return;
+    }
+    if (TRACE_BUFFER_SIZE - traceLen < 128 + strlen(name) + 6 * TRACE_ARG_MAX) {
+        flushTrace();
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    traceText("{\"name\":\"", 9);
+    traceText(name, strlen(name));
+    traceText("\",\"ph\":\"", 8);
+    traceBuffer[traceLen++] = phase;
+    traceText("\",\"ts\":", 7);
+    traceNumber((unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000, 1);
+    traceBuffer[traceLen++] = '.';
+    traceNumber(now.tv_nsec % 1000, 3);
+    traceText(",\"pid\":", 7);
+    traceNumber(trace_pid, 1);
+    traceText(",\"tid\":", 7);
+    traceNumber(trace_pid, 1);
+    if (phase == 'i') {
+        traceText(",\"s\":\"t\"", 8);
+    }
+    if (detail != NULL) {
+        traceText(",\"args\":{\"detail\":\"", 19);
+        for (size_t i = 0; i < TRACE_ARG_MAX && detail[i] != '\0'; i++) {
+            unsigned char c = detail[i];
+            if (c == '"' || c == '\\') {
+                traceBuffer[traceLen++] = '\\';
+                traceBuffer[traceLen++] = c;
+            } else if (c < 0x20) {
+                traceText("\\u00", 4);
+                traceBuffer[traceLen++] = "0123456789abcdef"[c >> 4];
+                traceBuffer[traceLen++] = "0123456789abcdef"[c & 15];
+            } else {
+                traceBuffer[traceLen++] = c;
+            }
+        }
+        traceText("\"}", 2);
+    }
+    traceText("},\n", 3);
+}
+
+/*
+    Function: traceChild
+
+    Description:
+    Lets a forked subshell record its own events, under its own pid.
+
+    Parameters:
+    None
+
+    Return:
+    None
+
+    Details:
+    The events inherited in the buffer belong to the parent, which writes them itself, so they are dropped.
+*/
+void traceChild() {
+    if (trace_fd != -1) {
+        trace_pid = getpid();
+        traceLen = 0;
+    }
+}
+
+// Closes the trace at exit: flushes it and ends the JSON array with the process name
+void finishTrace() {
+    if (trace_fd == -1 || getpid() != trace_pid) {
+        return;
+    }
+    flushTrace();
+    char end[128];
+    int len = snprintf(end, sizeof(end), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"flash\"}}\n]\n", (int)trace_pid);
+    if (write(trace_fd, end, len) < 0) {
+        perror("trace");
+    }
+}
+
+/*
+    Function: clearPathCache
+
+    Description:
+    Removes every entry from the command path cache.
+
+    Parameters:
+    None
+
+    Return:
+    None
+*/
+void clearPathCache() {
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        PathCacheNode* node = pathCache[i];
+        while (node != NULL) {
+            PathCacheNode* next = node->next;
+            free(node->name);
+            free(node->path);
+            free(node);
+            node = next;
+        }
+        pathCache[i] = NULL;
+    }
+}
+
+/*
+    Function: forgetCachedPath
+
+    Description:
+    Removes a single command from the path cache, if present.
+
+    Parameters:
+    - name: The command name to remove.
+
+    Return:
+    - Returns 1 if an entry was removed, 0 otherwise.
+*/
+int forgetCachedPath(const char* name) {
+    PathCacheNode** link = &pathCache[hashString(name) % PATH_CACHE_SIZE];
+    while (*link != NULL) {
+        PathCacheNode* node = *link;
+        if (strcmp(node->name, name) == 0) {
+            *link = node->next;
+            free(node->name);
+            free(node->path);
+            free(node);
+            return 1;
+        }
+        link = &node->next;
+    }
+    return 0;
+}
+
+/*
+    Function: searchPath
+
+    Description:
+    Walks the directories of the search path looking for an executable regular file with the given name.
+
+    Parameters:
+    - name: The command name to look up. It must not contain a '/'.
+    - searchPath: The colon-separated list of directories to search. Empty entries mean the current directory.
+
+    Return:
+    - A newly allocated absolute (or cwd-relative) path to the executable.
+    - NULL if the command was not found in any directory.
+
+    Details:
+    One stat() call is made per directory, instead of the failed execve() calls execvp() would make.
+*/
+char* searchPath(const char* name, const char* searchPath) {
+    size_t nameLen = strlen(name);
+    const char* dir = searchPath;
+    while (1) {
+        const char* end = strchr(dir, ':');
+        size_t dirLen = end ? (size_t)(end - dir) : strlen(dir);
+        char* candidate = (char*)malloc(dirLen + nameLen + 3);
+        if (!candidate) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if (dirLen == 0) {
+            strcpy(candidate, "./");
+        } else {
+            memcpy(candidate, dir, dirLen);
+            candidate[dirLen] = '/';
+            candidate[dirLen + 1] = '\0';
+        }
+        strcat(candidate, name);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+            return candidate;
+        }
+        free(candidate);
+
+        if (end == NULL) {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+/*
+    Function: lookupPathCache
+
+    Description:
+    Finds the path cache entry for a command name, resolving and inserting it on a miss.
+
+    Parameters:
+    - name: The command name to look up. It must not contain a '/'.
+
+    Return:
+    - The cache entry for the command.
+    - NULL if the command was not found.
+
+    Details:
+    1. If PATH differs from the value the cache was filled with, the whole cache is cleared first.
+    2. On a miss, the search path is walked with searchPath() and the result is inserted into the cache
+       with a hit count of zero.
+*/
+PathCacheNode* lookupPathCache(const char* name) {
+    const char* currentPath = searchInHashTable("PATH");
+    if (currentPath == NULL) {
+        currentPath = DEFAULT_PATH;
+    }
+    if (pathCacheKey == NULL || strcmp(pathCacheKey, currentPath) != 0) {
+        clearPathCache();
+        free(pathCacheKey);
+        pathCacheKey = strdup(currentPath);
+    }
+
+    unsigned int hash = hashString(name);
+    unsigned int index = hash % PATH_CACHE_SIZE;
+    for (PathCacheNode* node = pathCache[index]; node != NULL; node = node->next) {
+        if (node->hash == hash && strcmp(node->name, name) == 0) {
+            return node;
+        }
+    }
+
+    char* path = searchPath(name, currentPath);
+    if (path == NULL) {
+        return NULL;
+    }
+    PathCacheNode* node = (PathCacheNode*)malloc(sizeof(PathCacheNode));
+    if (!node) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    node->name = strdup(name);
+    node->path = path;
+    node->hash = hash;
+    node->hits = 0;
+    node->next = pathCache[index];
+    pathCache[index] = node;
+    return node;
+}
+
+/*
+    Function: resolveCommand
+
+    Description:
+    Resolves a command name to the path of the executable to run, using the path cache.
+
+    Parameters:
+    - name: The command name as typed by the user.
+
+    Return:
+    - The name itself if it already contains a '/'.
+    - The cached path otherwise. It stays valid until the cache entry is removed.
+    - NULL if the command was not found.
+*/
+const char* resolveCommand(const char* name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    PathCacheNode* node = lookupPathCache(name);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->hits++;
+    return node->path;
+}
+
+/*
+    Function: hashCommand
+
+    Description:
+    Implements the 'hash' builtin, which inspects and manages the command path cache.
+
+    Parameters:
+    - parsed: An array of strings representing the command and its arguments.
+
+    Return:
+    None
+
+    Details:
+    - "hash" lists every cached command with its hit count and path.
+    - "hash -r" clears the cache.
+    - "hash -d name..." removes the given commands from the cache.
+    - "hash name..." resolves the given commands and adds them to the cache ahead of time.
+    - 'last_exit_status' is set to 1 if any name could not be found, 0 otherwise.
+*/
+void hashCommand(char** parsed) {
+    last_exit_status = 0;
+    if (parsed[1] == NULL) {
+        printf("hits\tcommand\n");
+        for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+            for (PathCacheNode* node = pathCache[i]; node != NULL; node = node->next) {
+                printf("%4lu\t%s\n", node->hits, node->path);
+            }
+        }
+    } else if (strcmp(parsed[1], "-r") == 0) {
+        clearPathCache();
+    } else if (strcmp(parsed[1], "-d") == 0) {
+        for (int i = 2; parsed[i] != NULL; i++) {
+            if (!forgetCachedPath(parsed[i])) {
+                fprintf(stderr, "hash: %s: not found\n", parsed[i]);
+                last_exit_status = 1;
+            }
+        }
+    } else {
+        for (int i = 1; parsed[i] != NULL; i++) {
+            if (strchr(parsed[i], '/') == NULL && lookupPathCache(parsed[i]) != NULL) {
+                continue;
+            }
+            fprintf(stderr, "hash: %s: not found\n", parsed[i]);
+            last_exit_status = 1;
+        }
+    }
+}
+
+/*
+    Function: refreshPromptCwd
+
+    Description:
+    This function refreshes the current working directory shown in the prompt.
+
+    Parameters:
+    None
+
+    Return:
+    None
+
+    Details:
+    It is called once at startup and after every successful directory change, instead of calling
+    getcwd() before every line. If getcwd() fails, an error is printed and "?" is shown.
+*/
+void refreshPromptCwd() {
+    free(promptCache.cwd);
+    promptCache.cwd = getcwd(NULL, 0);
+    if (promptCache.cwd == NULL) {
+        perror("Failed to get current working directory");
+        promptCache.cwd = strdup("?");
+    }
+}
+
+/*
+    Function: refreshPromptIdentity
+
+    Description:
+    This function refreshes the username and hostname shown in the prompt.
+
+    Parameters:
+    None
+
+    Return:
+    None
+
+    Details:
+    1. It retrieves the current username using getpwuid(), which may go through NSS or LDAP.
+    2. It retrieves the hostname using gethostname().
+    3. Both are kept until the next explicit refresh with "prompt -r". If a lookup fails, an error
+       is printed and "?" is shown.
+*/
+void refreshPromptIdentity() {
+    char hostname[HOST_NAME_MAX + 1];
+    struct passwd *pw;
+
+    // Get the current username
+    pw = getpwuid(geteuid());
+    if (pw == NULL) {
+        perror("Failed to get username");
+    }
+    free(promptCache.user);
+    promptCache.user = strdup(pw ? pw->pw_name : "?");
+
+    // Get the hostname
+    if (gethostname(hostname, sizeof(hostname)) != 0) {
+        perror("Failed to get hostname");
+        strcpy(hostname, "?");
+    }
+    hostname[HOST_NAME_MAX] = '\0';
+    free(promptCache.host);
+    promptCache.host = strdup(hostname);
+}
+
+/*
+    Function: appendPrompt
+
+    Description:
+    Appends a string to the rendered prompt buffer, growing it as needed.
+
+    Parameters:
+    - len: The current length of the rendered prompt.
+    - str: The string to append.
+    - strLen: The number of characters to append.
+
+    Return:
+    The new length of the rendered prompt.
+*/
+size_t appendPrompt(size_t len, const char* str, size_t strLen) {
+    if (len + strLen + 1 > promptCache.renderedCap) {
+        size_t cap = promptCache.renderedCap ? promptCache.renderedCap : 128;
+        while (len + strLen + 1 > cap) {
+            cap *= 2;
+        }
+        char* grown = (char*)realloc(promptCache.rendered, cap);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        promptCache.rendered = grown;
+        promptCache.renderedCap = cap;
+    }
+    memcpy(promptCache.rendered + len, str, strLen);
+    promptCache.rendered[len + strLen] = '\0';
+    return len + strLen;
+}
+
+/*
+    Function: printPrompt
+
+    Description:
+    This function prints the command prompt to indicate to the user that the shell is ready to receive input.
+
+    Parameters:
+    None
+
+    Return:
+    None
+
+    Details:
+    1. The username, hostname and current working directory come from the prompt cache, so no system
+       call or NSS lookup is made per line. They are fetched on first use.
+    2. The format is taken from the PROMPT variable, or DEFAULT_PROMPT if it is not set. In it,
+       "%u" is the username, "%h" the hostname, "%w" the current working directory, "%?" the last
+       exit code and "%%" a literal '%'.
+    3. With the default format, the prompt looks like "user@localhost:/home/user$ ".
+*/
+void printPrompt() {
+    if (promptCache.user == NULL) {
+        refreshPromptIdentity();
+    }
+    if (promptCache.cwd == NULL) {
+        refreshPromptCwd();
+    }
+
+    const char* format = searchInHashTable("PROMPT");
+    if (format == NULL) {
+        format = DEFAULT_PROMPT;
+    }
+
+    size_t len = appendPrompt(0, "", 0);
+    for (const char* c = format; *c != '\0'; c++) {
+        const char* part = NULL;
+        char status[16];
+        if (*c == '%' && c[1] != '\0') {
+            switch (c[1]) {
+                case 'u': part = promptCache.user; break;
+                case 'h': part = promptCache.host; break;
+                case 'w': part = promptCache.cwd; break;
+                case '%': part = "%"; break;
+                case '?':
+                    snprintf(status, sizeof(status), "%d", last_exit_status);
+                    part = status;
+                    break;
+            }
+        }
+        if (part != NULL) {
+            len = appendPrompt(len, part, strlen(part));
+            c++;
+        } else {
+            len = appendPrompt(len, c, 1);
+        }
+    }
+
+    // Print the command line prompt
+    fputs(promptCache.rendered, stdout);
+    fflush(stdout);
+}
+
+/*
+    Function: promptCommand
+
+    Description:
+    Implements the 'prompt' builtin.
+
+    Parameters:
+    - parsed: An array of strings representing the command and its arguments.
+
+    Return:
+    None
+
+    Details:
+    - "prompt -r" refreshes the cached username, hostname and current working directory.
+    - Without arguments, the current prompt format is printed. Use "set PROMPT=..." to change it.
+    - 'last_exit_status' is set to 1 on a usage error, 0 otherwise.
+*/
+void promptCommand(char** parsed) {
+    last_exit_status = 0;
+    if (parsed[1] != NULL && strcmp(parsed[1], "-r") == 0) {
+        refreshPromptIdentity();
+        refreshPromptCwd();
+    } else if (parsed[1] == NULL) {
+        const char* format = searchInHashTable("PROMPT");
+        printf("%s\n", format ? format : DEFAULT_PROMPT);
+    } else {
+        fprintf(stderr, "Usage: prompt [-r]\n");
+        last_exit_status = 1;
+    }
+}
+
+/*
+    Function: takeInput
+
+    Description:
+    This function takes input from the user via stdin (standard input) and returns it as a string.
+
+    Parameters:
+    None
+
+    Return:
+    - The line read, without its trailing newline. The buffer is reused by the next call.
+    - NULL at end of input or if reading fails.
+
+    Details:
+    1. If stdin is a terminal, the function reports finished background jobs and prints a prompt to indicate
+       that it is ready to receive input. Until a line is typed, the event loop keeps capturing the output
+       of background jobs. When stdout is a terminal too, the line is read with the line editor, editLine().
+    2. It uses getline() to read a line of input from stdin into a buffer that grows as needed,
+       so lines of any length are read whole.
+    3. If getline() fails for a reason other than end of input, an error message is printed.
+    4. It removes the newline character ('\n') from the end of the input string if present.
+*/
+char* takeInput() {
+    static char* str = NULL;
+    static size_t cap = 0;
+
+    if (interactive) {
+        reapJobs();
+        notifyJobs(); // Report finished background jobs before the prompt
+        printPrompt(); // Print prompt for user input
+        if (isatty(STDOUT_FILENO)) {
+            return editLine();
+        }
+        waitForInput();
+    }
+    errno = 0;
+    ssize_t len = getline(&str, &cap, stdin); // Read input from stdin
+    if (len < 0) {
+        if (errno != 0) {
+            printf("Failed to read input\n"); // Print error message if reading fails
+        } else if (interactive) {
+            printf("\n"); // End the prompt line on Ctrl-D
+        }
+        return NULL;
+    }
+    if (len > 0 && str[len - 1] == '\n'){ // Check if newline character exists at the end of input
+        str[len - 1] = '\0'; // Remove newline character by replacing it with null terminator
+    }
+    return str;
+}
+
+/*
+    Function: initHistory
+
+    Description:
+    Opens the history file and maps the part of it that is loaded.
+
+    Parameters:
+    - create: Create the file if it does not exist, and append the lines entered from now on to it.
+
+    Return:
+    None
+
+    Details:
+    1. The file is FLASH_HISTORY, or ~/.flash_history. One line is one entry.
+    2. Only the last HISTORY_LOAD_MAX bytes are mapped (FLASH_HISTORY_LOAD overrides the size), from the
+       first whole line in them. Mapping takes the same time whatever the size of the file, and the
+       lines are only split on the first use of the history.
+*/
+void initHistory(int create) {
+    history.opened = 1;
+    char* path = getenv("FLASH_HISTORY");
+    char* home = getenv("HOME");
+    char defaultPath[PATH_MAX];
+    if (path == NULL || *path == '\0') {
+        if (home == NULL) {
+            return;
+        }
+        snprintf(defaultPath, sizeof(defaultPath), "%s/.flash_history", home);
+        path = defaultPath;
+    }
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        if (create) {
+            perror(path);
+        }
+        return;
+    }
+    if (create) {
+        history.fd = fd;
+    }
+
+    size_t limit = HISTORY_LOAD_MAX;
+    char* limitText = getenv("FLASH_HISTORY_LOAD");
+    if (limitText != NULL && *limitText != '\0') {
+        limit = strtoull(limitText, NULL, 10);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && limit > 0) {
+        size_t size = st.st_size;
+        size_t start = size > limit ? size - limit : 0;
+        size_t offset = start & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        char* map = mmap(NULL, size - offset, PROT_READ, MAP_PRIVATE, fd, offset);
+        if (map != MAP_FAILED) {
+            history.map = map;
+            history.mapLen = size - offset;
+            history.mapSkip = 0;
+            if (start > 0) {
+                // Drop the line cut by the window, and everything mapped before the window
+                const char* newline = memchr(map + (start - offset - 1), '\n', history.mapLen - (start - offset - 1));
+                history.mapSkip = newline ? newline + 1 - map : history.mapLen;
+            }
+        }
+    }
+    if (!create) {
+        close(fd);
+    }
+}
+
+// Makes room for one more history entry
+void growHistory() {
+    if (history.count < history.cap) {
+        return;
+    }
+    size_t cap = history.cap ? history.cap * 2 : 256;
+    HistoryEntry* entries = (HistoryEntry*)realloc(history.entries, cap * sizeof(HistoryEntry));
+    if (!entries) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    history.entries = entries;
+    history.cap = cap;
+}
+
+/*
+    Function: loadHistory
+
+    Description:
+    Splits the mapped part of the history file into entries, the first time the history is used.
+
+    Parameters:
+    None
+
+    Return:
+    None
+
+    Details:
+    Lines entered before the history was first used are already in 'entries'. The file was mapped
+    before they were written to it, so they go after its lines.
+*/
+void loadHistory() {
+    if (!history.opened) {
+        initHistory(0); // Only reading, as in a script
+    }
+    if (history.split) {
+        return;
+    }
+    history.split = 1;
+    if (history.map == NULL) {
+        return;
+    }
+
+    size_t session = history.count;
+    HistoryEntry* entered = history.entries;
+    history.entries = NULL;
+    history.count = 0;
+    history.cap = 0;
+
+    const char* c = history.map + history.mapSkip;
+    const char* end = history.map + history.mapLen;
+    while (c < end) {
+        const char* newline = memchr(c, '\n', end - c);
+        const char* lineEnd = newline ? newline : end;
+        growHistory();
+        history.entries[history.count].text = c;
+        history.entries[history.count].len = lineEnd - c;
+        history.count++;
+        c = lineEnd + 1;
+    }
+    for (size_t i = 0; i < session; i++) {
+        growHistory();
+        history.entries[history.count++] = entered[i];
+    }
+    free(entered);
+}
+
+/*
+    Function: addHistory
+
+    Description:
+    Adds an entered command line to the history and appends it to the history file.
+
+    Parameters:
+    - line: The command line.
+
+    Return:
+    None
+
+    Details:
+    Blank lines, lines starting with a blank and repeats of the previous line are not added.
+*/
+void addHistory(const char* line) {
+    size_t len = strlen(line);
+    if (len == 0 || line[0] == ' ' || line[0] == '\t') {
+        return;
+    }
+    if (history.count > 0) {
+        const HistoryEntry* last = &history.entries[history.count - 1];
+        if (last->len == len && memcmp(last->text, line, len) == 0) {
+            return;
+        }
+    }
+
+    char* copy = (char*)malloc(len + 1);
+    if (!copy) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, line, len);
+    copy[len] = '\n'; // Written with its newline, kept without it
+    if (history.fd != -1 && write(history.fd, copy, len + 1) < 0) {
+        perror("history");
+        close(history.fd);
+        history.fd = -1;
+    }
+    copy[len] = '\0';
+    growHistory();
+    history.entries[history.count].text = copy;
+    history.entries[history.count].len = len;
+    history.count++;
+}
+
+// Returns the search index bucket of the three characters at 'p'
+unsigned int trigramBucket(const char* p) {
+    uint32_t trigram = (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 | (unsigned char)p[2];
+    return (trigram * 2654435761u) >> 16 & (TRIGRAM_BUCKETS - 1);
+}
+
+/*
+    Function: indexHistory
+
+    Description:
+    Builds the trigram index of the history, for searchHistory().
+
+    Parameters:
+    None
+
+    Return:
+    None
+
+    Details:
+    1. Every run of three characters of an entry is hashed to one of TRIGRAM_BUCKETS buckets, and each
+       bucket lists the entries holding one of its trigrams, once each and in order.
+    2. The lists are laid out in one array in two passes, counting then filling, so building takes
+       two reads of the history and two allocations.
+    3. The index is built once. Lines entered after it are searched one by one.
+*/
+void indexHistory() {
+    uint32_t* start = (uint32_t*)calloc(TRIGRAM_BUCKETS + 1, sizeof(uint32_t));
+    uint32_t* last = (uint32_t*)malloc(TRIGRAM_BUCKETS * sizeof(uint32_t)); // last entry counted per bucket
+    if (!start || !last) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = history.count;
+
+    memset(last, 0xff, TRIGRAM_BUCKETS * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        const HistoryEntry* entry = &history.entries[i];
+        for (size_t j = 0; j + 3 <= entry->len; j++) {
+            unsigned int bucket = trigramBucket(entry->text + j);
+            if (last[bucket] != i) {
+                last[bucket] = i;
+                start[bucket + 1]++;
+            }
+        }
+    }
+    for (size_t b = 0; b < TRIGRAM_BUCKETS; b++) {
+        start[b + 1] += start[b];
+    }
+
+    uint32_t* entries = (uint32_t*)malloc((start[TRIGRAM_BUCKETS] + 1) * sizeof(uint32_t));
+    if (!entries) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t* fill = last; // reused as the next free position of each bucket
+    memcpy(fill, start, TRIGRAM_BUCKETS * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        const HistoryEntry* entry = &history.entries[i];
+        for (size_t j = 0; j + 3 <= entry->len; j++) {
+            unsigned int bucket = trigramBucket(entry->text + j);
+            if (fill[bucket] == start[bucket] || entries[fill[bucket] - 1] != i) {
+                entries[fill[bucket]++] = i;
+            }
+        }
+    }
+    free(last);
+    history.trigramStart = start;
+    history.trigramEntries = entries;
+    history.indexed = count;
+}
+
+// Returns 1 if a history entry contains the text
+int historyContains(const HistoryEntry* entry, const char* text, size_t len) {
+    return len == 0 || memmem(entry->text, entry->len, text, len) != NULL;
+}
+
+/*
+    Function: searchHistory
+
+    Description:
+    Finds the most recent history entry before a position that contains some text.
+
+    Parameters:
+    - text: The text to look for.
+    - len: Its length.
+    - before: Only entries with a lower index are searched. Pass history.count to search them all.
+
+    Return:
+    The index of the entry, or -1 if none contains the text.
+
+    Details:
+    1. Text of three characters or more is looked up in the trigram index, built by the first search.
+       Only the entries in the shortest list of its trigrams' buckets are compared with memmem(),
+       so a search touches a small part of the history even with millions of entries.
+    2. Entries added after the index was built, and searches for shorter text, are scanned one by one.
+*/
+long searchHistory(const char* text, size_t len, size_t before) {
+    loadHistory();
+    if (before > history.count) {
+        before = history.count;
+    }
+    if (len >= 3 && history.trigramStart == NULL && history.count > 0) {
+        indexHistory();
+    }
+    size_t scanned = len >= 3 ? history.indexed : 0; // entries below this come from the index
+    for (size_t i = before; i > scanned; i--) {
+        if (historyContains(&history.entries[i - 1], text, len)) {
+            return i - 1;
+        }
+    }
+    if (len < 3 || before == 0) {
+        return -1;
+    }
+
+    // Candidates: the shortest list among the buckets of the text's trigrams
+    const uint32_t* list = NULL;
+    size_t listLen = 0;
+    for (size_t j = 0; j + 3 <= len; j++) {
+        unsigned int bucket = trigramBucket(text + j);
+        size_t n = history.trigramStart[bucket + 1] - history.trigramStart[bucket];
+        if (list == NULL || n < listLen) {
+            list = history.trigramEntries + history.trigramStart[bucket];
+            listLen = n;
+        }
+    }
+    // Skip the candidates at or after 'before', then try the others newest first
+    size_t low = 0, high = listLen;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (list[mid] < before) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (size_t i = low; i > 0; i--) {
+        if (historyContains(&history.entries[list[i - 1]], text, len)) {
+            return list[i - 1];
+        }
+    }
+    return -1;
+}
+
+/*
+    Function: expandHistory
+
+    Description:
+    Replaces a history reference at the start of an entered line with the command it stands for.
+
+    Parameters:
+    - line: The line as typed.
+
+    Return:
+    The line to run, or NULL (after printing an error) if the reference matches nothing.
+    An expanded line lives in a buffer reused by the next call.
+
+    Details:
+    1. "!!" is the previous command, "!N" the command numbered N by 'history', "!-N" the Nth most recent,
+       "!?TEXT" the most recent one containing TEXT (the rest of the line), and "!PREFIX" the most recent one starting with PREFIX.
+    2. Words typed after the reference are appended, so "!gcc -O3" reruns the last gcc with one more flag.
+    3. The expanded line is printed before it runs, and is what goes into the history.
+*/
+char* expandHistory(char* line) {
+    static char* expanded = NULL;
+    static size_t cap = 0;
+    if (line[0] != '!' || line[1] == '\0' || line[1] == ' ' || line[1] == '\t' || line[1] == '=') {
+        return line;
+    }
+    loadHistory();
+
+    char* word = line + 1;
+    char* rest = word + (word[0] == '?' ? strlen(word) : strcspn(word, " \t")); // "!?" takes the whole line
+    size_t wordLen = rest - word;
+    long index = -1;
+    char* numberEnd;
+    long number = strtol(word, &numberEnd, 10);
+    if (wordLen == 1 && word[0] == '!') {
+        index = (long)history.count - 1;
+    } else if (numberEnd == rest && wordLen > 0 && number != 0) {
+        index = number > 0 ? number - 1 : (long)history.count + number;
+    } else if (word[0] == '?') {
+        index = searchHistory(word + 1, wordLen - 1, history.count);
+    } else {
+        // The most recent candidate holding the prefix, until one starts with it
+        index = history.count;
+        while ((index = searchHistory(word, wordLen, index)) >= 0 &&
+               (history.entries[index].len < wordLen || memcmp(history.entries[index].text, word, wordLen) != 0)) {
+        }
+    }
+    if (index < 0 || index >= (long)history.count) {
+        fprintf(stderr, "%.*s: event not found\n", (int)(wordLen + 1), line);
+        return NULL;
+    }
+
+    const HistoryEntry* entry = &history.entries[index];
+    size_t restLen = strlen(rest);
+    if (entry->len + restLen + 1 > cap) {
+        cap = entry->len + restLen + 1;
+        if ((expanded = (char*)realloc(expanded, cap)) == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(expanded, entry->text, entry->len);
+    memcpy(expanded + entry->len, rest, restLen + 1);
+    printf("%s\n", expanded);
+    return expanded;
+}
+
+/*
+    Function: openRedirections
+
+    Description:
+    This function opens the files named by the "<" and ">" redirections found in a command's argument list.
+    It runs in the shell itself so that both launch engines can wire the files up the same way.
+
+    Parameters:
+    - parsed: A pointer to an array of strings representing the command and its arguments.
+    - inFd: Receives the descriptor to use as standard input, or -1 if there is no input redirection.
+    - outFd: Receives the descriptor to use as standard output, or -1 if there is no output redirection.
+
+    Return:
+    - Returns 0 on success.
+    - Returns -1 if a file could not be opened or a file name is missing.
+
+    Details:
+    1. It scans the arguments for input ("<") and output (">") redirection symbols.
+    2. The named file is opened with O_CLOEXEC, so the descriptor only survives in the child once it
+       has been duplicated onto standard input or standard output.
+    3. The symbol and the file name are removed from the argument list.
+    4. If the same redirection appears twice, the last one wins.
+    5. On failure, an error is printed and any descriptor already opened is closed.
+*/
+int openRedirections(char** parsed, int* inFd, int* outFd) {
+    *inFd = -1;
+    *outFd = -1;
+    int i = 0;
+    while (parsed[i] != NULL) {
+        int input = strcmp(parsed[i], "<") == 0;
+        int output = strcmp(parsed[i], ">") == 0;
+        if (!input && !output) {
+            i++;
+            continue;
+        }
+        if (parsed[i+1] == NULL) {
+            fprintf(stderr, "Expected file name after \"%s\"\n", parsed[i]);
+            goto fail;
+        }
+
+        int fd;
+        if (input) {
+            // Input redirection
+            fd = open(parsed[i+1], O_RDONLY | O_CLOEXEC);
+        } else {
+            // Output redirection
+            fd = open(parsed[i+1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        }
+        if (fd < 0) {
+            perror("open");
+            goto fail;
+        }
+        int* target = input ? inFd : outFd;
+        if (*target != -1) {
+            close(*target);
+        }
+        *target = fd;
+
+        // Remove the symbol and the file name from the arguments
+        int j = i;
+        do {
+            parsed[j] = parsed[j+2];
+        } while (parsed[j++] != NULL);
+    }
+    return 0;
+
+fail:
+    if (*inFd != -1) {
+        close(*inFd);
+    }
+    if (*outFd != -1) {
+        close(*outFd);
+    }
+    *inFd = *outFd = -1;
+    return -1;
+}
+
+// Reads exactly 'len' bytes, retrying short and interrupted reads. Returns -1 on error or end of file.
+int readFully(int fd, void* buf, size_t len) {
+    char* next = (char*)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, next, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        next += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+    Function: zygoteReceive
+
+    Description:
+    Reads one launch request in the zygote: the header, the descriptors that come with it and the strings.
+
+    Parameters:
+    - sock: The zygote's end of the socket.
+    - request: Receives the header.
+    - fds: Receives the ZYGOTE_FDS descriptors, opened with O_CLOEXEC.
+    - data: The buffer the strings are read into, grown as needed.
+    - dataCap: The size of 'data'.
+
+    Return:
+    0 on success, -1 if the shell closed the socket or sent a malformed request.
+*/
+int zygoteReceive(int sock, ZygoteRequest* request, int* fds, char** data, size_t* dataCap) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {request, sizeof(*request)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * ZYGOTE_FDS)) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * ZYGOTE_FDS);
+    if ((size_t)n < sizeof(*request) && readFully(sock, (char*)request + n, sizeof(*request) - n) < 0) {
+        return -1;
+    }
+
+    if (request->size > *dataCap) {
+        free(*data);
+        *data = (char*)malloc(request->size);
+        if (!*data) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        *dataCap = request->size;
+    }
+    return readFully(sock, *data, request->size);
+}
+
+/*
+    Function: zygoteServe
+
+    Description:
+    The main loop of the zygote: starts a process for every request the shell sends and replies with its pid.
+
+    Parameters:
+    - sock: The zygote's end of the socket.
+
+    Return:
+    Never returns. The zygote exits when the shell closes its end of the socket.
+
+    Details:
+    1. Each request carries the path to execute, the arguments, the environment, and four descriptors:
+       the shell's working directory and the standard input, output and error of the command.
+    2. The command is started with clone(CLONE_PARENT), so it becomes a child of the shell rather than of
+       the zygote. The shell waits for it, collects its resource usage and gets its SIGCHLD exactly as
+       with the other engines, and the zygote never has to relay an exit status.
+    3. The zygote was forked while the shell was small and only ever grows to the largest request,
+       so copying its page tables costs the same whatever the size of the shell's heap.
+    4. The reply is the pid of the new process, or minus the errno of a failed clone(), followed by
+       the errno of a failed execve(), or 0. The child writes that errno into an O_CLOEXEC pipe, so
+       the zygote reads end of file as soon as the exec succeeds. A child whose exec failed has
+       already exited, and the shell reaps it.
+    5. The zygote ignores SIGINT and SIGQUIT so that a keyboard interrupt does not take it down with
+       the foreground command; the command gets the default dispositions back before exec.
+*/
+void zygoteServe(int sock) {
+    char* data = NULL;
+    size_t dataCap = 0;
+    char** vectors = NULL;
+    size_t vectorsCap = 0;
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    for (;;) {
+        ZygoteRequest request;
+        int fds[ZYGOTE_FDS];
+        if (zygoteReceive(sock, &request, fds, &data, &dataCap) < 0) {
+            _exit(0);
+        }
+
+        // Split the strings into the path, argv and envp
+        size_t needed = request.argc + request.envc + 2;
+        if (needed > vectorsCap) {
+            free(vectors);
+            vectors = (char**)malloc(needed * sizeof(char*));
+            if (!vectors) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+            vectorsCap = needed;
+        }
+        char* path = data;
+        char* next = data + strlen(data) + 1;
+        char** argv = vectors;
+        char** envp = vectors + request.argc + 1;
+        for (uint32_t i = 0; i < request.argc; i++) {
+            argv[i] = next;
+            next += strlen(next) + 1;
+        }
+        argv[request.argc] = NULL;
+        for (uint32_t i = 0; i < request.envc; i++) {
+            envp[i] = next;
+            next += strlen(next) + 1;
+        }
+        envp[request.envc] = NULL;
+
+        int report[2] = {-1, -1};
+        int32_t reply[2] = {0, 0};
+        pid_t pid = -1;
+        if (pipe2(report, O_CLOEXEC) < 0) {
+            reply[0] = -errno;
+        } else {
+            pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+            reply[0] = pid < 0 ? -errno : pid;
+        }
+        if (pid == 0) {
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            if (fchdir(fds[0]) < 0) {
+                perror("fchdir");
+            }
+            dup2(fds[1], STDIN_FILENO);
+            dup2(fds[2], STDOUT_FILENO);
+            dup2(fds[3], STDERR_FILENO);
+            execve(path, argv, envp);
+            int err = errno;
+            if (write(report[1], &err, sizeof(err)) < 0) {
+                // The zygote then reads end of file, and the exit code still tells the failure
+            }
+            _exit(EXIT_FAILURE);
+        }
+        if (report[1] != -1) {
+            close(report[1]);
+            int err;
+            if (pid > 0 && readFully(report[0], &err, sizeof(err)) == 0) {
+                reply[1] = err;
+            }
+            close(report[0]);
+        }
+
+        for (int i = 0; i < ZYGOTE_FDS; i++) {
+            close(fds[i]);
+        }
+        if (write(sock, reply, sizeof(reply)) != sizeof(reply)) {
+            _exit(0);
+        }
+    }
+}
+
+/*
+    Function: startZygote
+
+    Description:
+    Forks the zygote launcher and keeps the shell's end of the socket connecting them in 'zygote_fd'.
+
+    Parameters: None
+
+    Return:
+    0 on success, -1 if the socket or the process could not be created. An error has been printed.
+
+    Details:
+    It is called once at startup, before the shell allocates its tables, so the zygote stays small.
+    The socket is a stream socket: a request of any size goes through, and the descriptors sent with
+    SCM_RIGHTS arrive with its first byte.
+*/
+int startZygote() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {
+        close(sv[0]);
+        zygoteServe(sv[1]);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+    return 0;
+}
+
+/*
+    Function: zygoteLaunch
+
+    Description:
+    Asks the zygote to start a command.
+
+    Parameters:
+    - path: The resolved path of the command.
+    - parsed: The command and its arguments.
+    - inFd: The descriptor to use as standard input, or -1 to inherit the shell's.
+    - outFd: The descriptor to use as standard output, or -1 to inherit the shell's.
+    - errFd: The descriptor to use as standard error, or -1 to inherit the shell's.
+    - pid: Receives the pid of the new process, or -1 if it could not be started.
+
+    Return:
+    0 if the process started, or the errno with which clone() or execve() failed; a child whose exec
+    failed has been reaped. -1 if the zygote is gone: an error has been printed, 'launch_mode' has
+    been switched to LAUNCH_FORK and the caller should launch the command itself.
+
+    Details:
+    1. The header, the path and the arguments, and the packed environment strings of childEnvironment()
+       are sent with a single sendmsg() call, so the environment is never copied by the shell.
+    2. The working directory is sent as an O_PATH descriptor, opened on the first launch after each 'cd'.
+*/
+int zygoteLaunch(const char* path, char** parsed, int inFd, int outFd, int errFd, pid_t* pid) {
+    *pid = -1;
+    if (cwd_fd == -1) {
+        cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (cwd_fd == -1) {
+            return errno;
+        }
+    }
+    childEnvironment();
+
+    // Pack the path and the arguments
+    ZygoteRequest request;
+    size_t argsSize = strlen(path) + 1;
+    request.argc = 0;
+    while (parsed[request.argc] != NULL) {
+        argsSize += strlen(parsed[request.argc++]) + 1;
+    }
+    char* args = (char*)arenaAlloc(&lineArena, argsSize);
+    char* next = stpcpy(args, path) + 1;
+    for (uint32_t i = 0; i < request.argc; i++) {
+        next = stpcpy(next, parsed[i]) + 1;
+    }
+    request.envc = childEnvCount;
+    request.size = argsSize + childEnvBytes;
+
+    int fds[ZYGOTE_FDS] = {
+        cwd_fd,
+        inFd != -1 ? inFd : STDIN_FILENO,
+        outFd != -1 ? outFd : STDOUT_FILENO,
+        errFd != -1 ? errFd : STDERR_FILENO
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov[3] = {
+        {&request, sizeof(request)},
+        {args, argsSize},
+        {childEnvStrings, childEnvBytes}
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // A large request may go out in several pieces; the descriptors travel with the first one
+    size_t remaining = sizeof(request) + request.size;
+    int32_t reply[2];
+    while (remaining > 0) {
+        ssize_t n = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            goto lost;
+        }
+        remaining -= n;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        while (n > 0 && msg.msg_iovlen > 0) {
+            if ((size_t)n >= msg.msg_iov->iov_len) {
+                n -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            } else {
+                msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+                msg.msg_iov->iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+    if (readFully(zygote_fd, reply, sizeof(reply)) < 0) {
+        goto lost;
+    }
+    if (reply[0] < 0) {
+        return -reply[0];
+    }
+    if (reply[1] != 0) {
+        waitpid(reply[0], NULL, 0); // The clone is the shell's child
+        return reply[1];
+    }
+    *pid = reply[0];
+    return 0;
+
+lost:
+    fprintf(stderr, "The zygote launcher exited, falling back to fork()\n");
+    close(zygote_fd);
+    zygote_fd = -1;
+    launch_mode = LAUNCH_FORK;
+    return -1;
+}
+
+/*
+    Function: launchPath
+
+    Description:
+    Starts a program from its resolved path with the current launch engine.
+
+    Parameters:
+    - path: The path of the program.
+    - parsed: The command and its arguments.
+    - inFd, outFd, errFd: The descriptors to use as standard input, output and error, or -1 to inherit the shell's.
+    - pid: Receives the pid of the new process.
+
+    Return:
+    0 on success, otherwise the errno with which the process could not be created or execve() failed.
+    Nothing has been printed.
+
+    Details:
+    With LAUNCH_FORK, the child writes the errno of a failed execve() into an O_CLOEXEC pipe and
+    exits, and the parent reaps it. The parent reads end of file as soon as the exec succeeds, so
+    every engine reports a missing program the way posix_spawn() does.
+*/
+int launchPath(const char* path, char** parsed, int inFd, int outFd, int errFd, pid_t* pid) {
+    int err;
+    if (launch_mode == LAUNCH_ZYGOTE && (err = zygoteLaunch(path, parsed, inFd, outFd, errFd, pid)) >= 0) {
+        return err;
+    }
+
+    char** envp = childEnvironment();
+    if (launch_mode == LAUNCH_SPAWN) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (inFd != -1) {
+            posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+        }
+        if (outFd != -1) {
+            posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+        }
+        if (errFd != -1) {
+            posix_spawn_file_actions_adddup2(&actions, errFd, STDERR_FILENO);
+        }
+        err = posix_spawn(pid, path, &actions, NULL, parsed, envp);
+        posix_spawn_file_actions_destroy(&actions);
+        return err;
+    }
+
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) < 0) {
+        return errno;
+    }
+    *pid = fork();
+    if (*pid == -1) {
+        err = errno;
+        close(report[0]);
+        close(report[1]);
+        return err;
+    } else if (*pid == 0) {
+        if (inFd != -1) {
+            dup2(inFd, STDIN_FILENO);
+        }
+        if (outFd != -1) {
+            dup2(outFd, STDOUT_FILENO);
+        }
+        if (errFd != -1) {
+            dup2(errFd, STDERR_FILENO);
+        }
+        execve(path, parsed, envp);
+        err = errno;
+        if (write(report[1], &err, sizeof(err)) < 0) {
+            // The parent then reads end of file, and the exit code still tells the failure
+        }
+        _exit(EXIT_FAILURE);
+    }
+    close(report[1]);
+    if (readFully(report[0], &err, sizeof(err)) == 0) {
+        waitpid(*pid, NULL, 0); // The exec failed and the child has exited
+        *pid = -1;
+    } else {
+        err = 0;
+    }
+    close(report[0]);
+    return err;
+}
+
+// Closes the descriptors marked O_CLOEXEC, which a forked child that does not exec would otherwise keep
+void closeExecFds() {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int fd = atoi(entry->d_name);
+        int flags = fd > STDERR_FILENO && fd != dirfd(dir) ? fcntl(fd, F_GETFD) : -1;
+        if (flags != -1 && (flags & FD_CLOEXEC)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+// Flushes what a builtin printed; a failed write is reported and fails the command, as in /bin/echo
+void checkBuiltinOutput(const char* name) {
+    if (fflush(stdout) == EOF || ferror(stdout)) {
+        fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+        last_exit_status = 1;
+        clearerr(stdout);
+    }
+}
+
+/*
+    Function: startCommand
+
+    Description:
+    This function starts an external command with the given descriptors as its standard input and output.
+    It is called through launchCommand().
+
+    Parameters:
+    - parsed: A pointer to an array of strings representing the command and its arguments.
+    - inFd: The descriptor to use as standard input, or -1 to inherit the shell's.
+    - outFd: The descriptor to use as standard output, or -1 to inherit the shell's.
+    - errFd: The descriptor to use as standard error, or -1 to inherit the shell's.
+
+    Return:
+    - The pid of the new process.
+    - -1 if the process could not be started. An error message has already been printed.
+
+    Details:
+    1. The command name is resolved to a path with resolveCommand(), so PATH is only walked on a cache
+       miss, and started with launchPath(). If a cached path no longer works (ENOENT or EACCES from
+       any engine), its entry is dropped and the command is resolved, with the current PATH, and
+       started once more.
+    2. With LAUNCH_SPAWN, posix_spawn() runs the resolved path. The descriptors are wired up with dup2
+       file actions, and the parent's page tables are never copied.
+    3. With LAUNCH_FORK, the shell forks, duplicates the descriptors in the child and calls execve() on the
+       resolved path.
+    4. With LAUNCH_ZYGOTE, the zygote started by startZygote() forks and execs the command, see zygoteServe().
+       If the zygote has gone away, the command is launched with LAUNCH_FORK instead.
+    5. Every engine passes the cached environment from childEnvironment(), which holds the exported variables.
+    6. Every other descriptor the shell hands out (pipes, redirection files) is opened with O_CLOEXEC,
+       so nothing else needs closing in the child.
+    7. A builtin, which can only get here as a pipeline stage, is run in a forked child that exits
+       with the builtin's exit code. The child first closes what an exec would (closeExecFds()), so
+       it does not hold open the write end of a pipe that it or a later stage reads from.
+*/
+pid_t startCommand(char** parsed, int inFd, int outFd, int errFd) {
+    pid_t pid;
+    fflush(stdout); // Keep the shell's own output ahead of the child's
+    const Builtin* builtin = builtinFor(parsed);
+    if (builtin != NULL) {
+        pid = fork();
+        if (pid == -1) {
+            printf("Failed to fork child\n");
+        } else if (pid == 0) {
+            if (inFd != -1) {
+                dup2(inFd, STDIN_FILENO);
+            }
+            if (outFd != -1) {
+                dup2(outFd, STDOUT_FILENO);
+            }
+            if (errFd != -1) {
+                dup2(errFd, STDERR_FILENO);
+            }
+            closeExecFds();
+            last_exit_status = 0;
+            builtin->run(parsed);
+            checkBuiltinOutput(parsed[0]);
+            _exit(last_exit_status);
+        }
+        return pid;
+    }
+
+    const char* path = resolveCommand(parsed[0]);
+    if (path == NULL) {
+        printf("Could not execute command: %s: command not found\n", parsed[0]);
+        return -1;
+    }
+    int err = launchPath(path, parsed, inFd, outFd, errFd, &pid);
+    if ((err == ENOENT || err == EACCES) && path != parsed[0]) {
+        // The cached path went stale: forget it and search PATH again
+        forgetCachedPath(parsed[0]);
+        path = resolveCommand(parsed[0]);
+        err = path ? launchPath(path, parsed, inFd, outFd, errFd, &pid) : ENOENT;
+    }
+    if (err != 0) {
+        printf("Could not execute command: %s\n", strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+/*
+    Function: launchCommand
+
+    Description:
+    Starts an external command with startCommand(), recording the launch in the trace.
+
+    Parameters:
+    - parsed: A pointer to an array of strings representing the command and its arguments.
+    - inFd: The descriptor to use as standard input, or -1 to inherit the shell's.
+    - outFd: The descriptor to use as standard output, or -1 to inherit the shell's.
+    - errFd: The descriptor to use as standard error, or -1 to inherit the shell's.
+
+    Return:
+    - The pid of the new process.
+    - -1 if the process could not be started. An error message has already been printed.
+
+    Details:
+    The launch is a "spawn" span, and a command that could not be started adds an "exec-failure" event.
+*/
+pid_t launchCommand(char** parsed, int inFd, int outFd, int errFd) {
+    traceEvent('B', "spawn", parsed[0]);
+    pid_t pid = startCommand(parsed, inFd, outFd, errFd);
+    if (pid == -1) {
+        traceEvent('i', "exec-failure", parsed[0]);
+    }
+    traceEvent('E', "spawn", NULL);
+    return pid;
+}
+
+/*
+    Function: statusToExitCode
+
+    Description:
+    Converts a status value returned by waitpid() into a shell exit code.
+
+    Parameters:
+    - status: The status value filled in by waitpid().
+
+    Return:
+    - The exit code of the process if it exited normally.
+    - 128 plus the signal number if the process was killed by a signal.
+*/
+int statusToExitCode(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return EXIT_FAILURE;
+}
+
+// Adds the resource usage of a child, or of a finished timed command, to 'child_usage'
+void addUsage(const struct rusage* usage) {
+    timeradd(&child_usage.ru_utime, &usage->ru_utime, &child_usage.ru_utime);
+    timeradd(&child_usage.ru_stime, &usage->ru_stime, &child_usage.ru_stime);
+    if (usage->ru_maxrss > child_usage.ru_maxrss) {
+        child_usage.ru_maxrss = usage->ru_maxrss;
+    }
+    child_usage.ru_nvcsw += usage->ru_nvcsw;
+    child_usage.ru_nivcsw += usage->ru_nivcsw;
+}
+
+/*
+    Function: waitChild
+
+    Description:
+    Waits for a child process with wait4() and adds its resource usage to 'child_usage'.
+    While background jobs have output to capture, the event loop runs during the wait.
+
+    Parameters:
+    - pid: The pid to wait for, or -1 for any child.
+    - status: Receives the status of the child.
+
+    Return:
+    The pid of the child that was waited for, or -1 on error. Interrupted waits are retried.
+
+    Details:
+    1. User and system times and context switches are summed; the maximum resident set size is the
+       largest of any child.
+    2. With no capture pipe open, wait4() simply blocks. Otherwise it is called with WNOHANG, and while
+       the child is running runEventLoop() blocks until a job writes output or a child exits, so
+       background jobs never stall on a full pipe while a foreground command runs.
+*/
+pid_t waitChild(pid_t pid, int* status) {
+    struct rusage usage;
+    pid_t result;
+    traceEvent('B', "wait", NULL);
+    for (;;) {
+        result = wait4(pid, status, capture_count > 0 ? WNOHANG : 0, &usage);
+        if (result > 0) {
+            break;
+        } else if (result == 0) {
+            runEventLoop(-1);
+        } else if (errno != EINTR) {
+            traceEvent('E', "wait", NULL);
+            return -1;
+        }
+    }
+    traceEvent('E', "wait", NULL);
+    addUsage(&usage);
+    return result;
+}
+
+/*
+    Function: setPipeStatus
+
+    Description:
+    Resizes the pipestatus array so that it can hold the exit codes of every stage of the last pipeline.
+
+    Parameters:
+    - count: The number of stages in the pipeline.
+
+    Return:
+    None
+*/
+void setPipeStatus(int count) {
+    if (count > pipe_status_cap) {
+        int* grown = (int*)realloc(pipe_status, count * sizeof(int));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        pipe_status = grown;
+        pipe_status_cap = count;
+    }
+    pipe_status_count = count;
+    for (int i = 0; i < count; i++) {
+        pipe_status[i] = 0;
+    }
+}
+
+/*
+    Function: pidMapSlot
+
+    Description:
+    Finds the slot of a pid in the pid-to-job map, or the slot where it should be inserted.
+
+    Parameters:
+    - pid: The pid to look up.
+    - forInsert: If non-zero, the first deleted slot met while probing is returned for a missing pid.
+
+    Return:
+    The index of the slot.
+*/
+size_t pidMapSlot(pid_t pid, int forInsert) {
+    size_t mask = pidMap.size - 1;
+    size_t reuse = pidMap.size;
+    for (size_t i = ((unsigned int)pid * 2654435761u) & mask; ; i = (i + 1) & mask) {
+        if (pidMap.pids[i] == pid) {
+            return i;
+        }
+        if (pidMap.pids[i] == 0) {
+            return (forInsert && reuse != pidMap.size) ? reuse : i;
+        }
+        if (pidMap.pids[i] == -1 && reuse == pidMap.size) {
+            reuse = i;
+        }
+    }
+}
+
+/*
+    Function: pidMapInsert
+
+    Description:
+    Records which job a pid belongs to, growing the map when it is 3/4 full.
+
+    Parameters:
+    - pid: The pid of a background process.
+    - slot: The job table slot of its job.
+
+    Return:
+    None
+*/
+void pidMapInsert(pid_t pid, int slot) {
+    if ((pidMap.used + 1) * 4 > pidMap.size * 3) {
+        pid_t* oldPids = pidMap.pids;
+        int* oldSlots = pidMap.slots;
+        size_t oldSize = pidMap.size;
+        size_t live = 0;
+        for (size_t i = 0; i < oldSize; i++) {
+            live += oldPids[i] > 0;
+        }
+        size_t size = oldSize ? oldSize : PID_MAP_MIN_SIZE;
+        while ((live + 1) * 2 > size) {
+            size *= 2;
+        }
+        pidMap.pids = (pid_t*)calloc(size, sizeof(pid_t));
+        pidMap.slots = (int*)malloc(size * sizeof(int));
+        if (!pidMap.pids || !pidMap.slots) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        pidMap.size = size;
+        pidMap.used = live;
+        for (size_t i = 0; i < oldSize; i++) {
+            if (oldPids[i] > 0) {
+                size_t j = pidMapSlot(oldPids[i], 1);
+                pidMap.pids[j] = oldPids[i];
+                pidMap.slots[j] = oldSlots[i];
+            }
+        }
+        free(oldPids);
+        free(oldSlots);
+    }
+
+    size_t i = pidMapSlot(pid, 1);
+    if (pidMap.pids[i] == 0) {
+        pidMap.used++;
+    }
+    pidMap.pids[i] = pid;
+    pidMap.slots[i] = slot;
+}
+
+/*
+    Function: pidMapRemove
+
+    Description:
+    Removes a pid from the pid-to-job map.
+
+    Parameters:
+    - pid: The pid to remove.
+
+    Return:
+    The job table slot the pid belonged to, or -1 if it is not a background process.
+*/
+int pidMapRemove(pid_t pid) {
+    if (pidMap.size == 0) {
+        return -1;
+    }
+    size_t i = pidMapSlot(pid, 0);
+    if (pidMap.pids[i] != pid) {
+        return -1;
+    }
+    pidMap.pids[i] = -1; // Leave a tombstone so later probes continue past it
+    return pidMap.slots[i];
+}
+
+/*
+    Function: sigchldHandler
+
+    Description:
+    SIGCHLD handler. It only writes a byte to the self-pipe; the children are reaped by reapJobs()
+    at the next safe point, so foreground waits never have their children stolen.
+
+    Parameters:
+    - sig: The signal number.
+
+    Return:
+    None
+*/
+void sigchldHandler(int sig) {
+    int savedErrno = errno;
+    char byte = 0;
+    (void)sig;
+    if (write(sigchldPipe[1], &byte, 1) < 0) {
+        // The pipe is full, so a wakeup is already pending
+    }
+    errno = savedErrno;
+}
+
+/*
+    Function: initJobs
+
+    Description:
+    Creates the SIGCHLD self-pipe, installs the SIGCHLD handler and creates the event loop watching the
+    self-pipe and the capture pipes of background jobs.
+
+    Parameters: None
+
+    Returns: None
+*/
+void initJobs() {
+    if (pipe2(sigchldPipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe");
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = EVENT_SIGCHLD;
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_fd == -1 || epoll_ctl(event_fd, EPOLL_CTL_ADD, sigchldPipe[0], &event) < 0) {
+        perror("epoll");
+        if (event_fd != -1) {
+            close(event_fd);
+            event_fd = -1; // Background output is not captured
+        }
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchldHandler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+        perror("sigaction");
+    }
+}
+
+/*
+    Function: closeJobOutput
+
+    Description:
+    Closes the capture pipe of a job, which also removes it from the event loop. The output read so far is kept.
+
+    Parameters:
+    - output: The job's output.
+
+    Return:
+    None
+*/
+void closeJobOutput(JobOutput* output) {
+    if (output->fd != -1) {
+        close(output->fd);
+        output->fd = -1;
+        capture_count--;
+    }
+}
+
+/*
+    Function: appendJobOutput
+
+    Description:
+    Appends output read from a job to its ring buffer, dropping the oldest bytes when it is full.
+
+    Parameters:
+    - output: The job's output.
+    - data: The bytes read.
+    - len: The number of bytes.
+
+    Return:
+    None
+*/
+void appendJobOutput(JobOutput* output, const char* data, size_t len) {
+    if (output->data == NULL) {
+        output->data = (char*)malloc(JOB_OUTPUT_SIZE);
+        if (!output->data) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (len > JOB_OUTPUT_SIZE) {
+        output->dropped += len - JOB_OUTPUT_SIZE;
+        data += len - JOB_OUTPUT_SIZE;
+        len = JOB_OUTPUT_SIZE;
+    }
+    if (output->length + len > JOB_OUTPUT_SIZE) {
+        size_t overflow = output->length + len - JOB_OUTPUT_SIZE;
+        output->start = (output->start + overflow) % JOB_OUTPUT_SIZE;
+        output->length -= overflow;
+        output->dropped += overflow;
+    }
+    size_t end = (output->start + output->length) % JOB_OUTPUT_SIZE;
+    size_t first = len < JOB_OUTPUT_SIZE - end ? len : JOB_OUTPUT_SIZE - end;
+    memcpy(output->data + end, data, first);
+    memcpy(output->data, data + first, len - first);
+    output->length += len;
+}
+
+/*
+    Function: writeJobOutput
+
+    Description:
+    Writes the output held for a job to stdout and empties its ring buffer.
+
+    Parameters:
+    - output: The job's output.
+
+    Return:
+    None
+*/
+void writeJobOutput(JobOutput* output) {
+    size_t first = output->length < JOB_OUTPUT_SIZE - output->start ? output->length : JOB_OUTPUT_SIZE - output->start;
+    if (output->length > 0) {
+        fwrite(output->data + output->start, 1, first, stdout);
+        fwrite(output->data, 1, output->length - first, stdout);
+    }
+    output->start = 0;
+    output->length = 0;
+    output->dropped = 0;
+}
+
+/*
+    Function: readJobOutput
+
+    Description:
+    Reads what is available on a job's capture pipe, without blocking.
+
+    Parameters:
+    - slot: The job table slot.
+
+    Return:
+    - 1 if output was read. It went to the ring buffer, or to stdout while the job is in the foreground.
+    - 0 if the pipe was empty.
+    - -1 if every writer has exited; the pipe has been closed.
+
+    Notes:
+    A single read() is done, of up to a full ring buffer. The event loop is level-triggered, so a job
+    with more to read is reported again, and one busy job cannot starve the others.
+*/
+int readJobOutput(int slot) {
+    static char buf[JOB_OUTPUT_SIZE];
+    JobOutput* output = &jobTable.jobs[slot].output;
+    ssize_t n;
+    do {
+        n = read(output->fd, buf, sizeof(buf));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    if (n <= 0) {
+        closeJobOutput(output);
+        return -1;
+    }
+    if (output->forward) {
+        fwrite(buf, 1, n, stdout);
+        fflush(stdout);
+    } else {
+        appendJobOutput(output, buf, n);
+    }
+    return 1;
+}
+
+/*
+    Function: runEventLoop
+
+    Description:
+    Waits for events on the capture pipes of background jobs and on the SIGCHLD self-pipe, and handles them.
+
+    Parameters:
+    - timeout: The longest time to wait in milliseconds, 0 to only handle pending events, -1 to wait
+      until at least one arrives.
+
+    Return:
+    1 if standard input became readable (it is only watched while the shell waits for a line), 0 otherwise.
+
+    Details:
+    1. A single epoll instance watches every capture pipe, so any number of jobs costs one system call
+       per wakeup, with no thread and no blocking read per job.
+    2. Output is read into the job's ring buffer with readJobOutput().
+    3. A byte on the SIGCHLD self-pipe drains it and sets 'sigchld_pending', so the next reapJobs()
+       still reaps the background jobs that exited. Callers waiting for a child simply try again.
+*/
+int runEventLoop(int timeout) {
+    struct epoll_event events[EVENT_BATCH];
+    int input = 0;
+    if (event_fd == -1) {
+        return 0;
+    }
+    int n = epoll_wait(event_fd, events, EVENT_BATCH, timeout);
+    for (int i = 0; i < n; i++) {
+        uint64_t tag = events[i].data.u64;
+        if (tag == EVENT_SIGCHLD) {
+            char buf[64];
+            while (read(sigchldPipe[0], buf, sizeof(buf)) > 0) {
+            }
+            sigchld_pending = 1;
+        } else if (tag == EVENT_INPUT) {
+            input = 1;
+        } else if (jobTable.jobs[tag].output.fd != -1) {
+            readJobOutput((int)tag);
+        }
+    }
+    return input;
+}
+
+/*
+    Function: captureJobOutput
+
+    Description:
+    Creates the pipe that captures the output of a background job.
+
+    Parameters:
+    - writeFd: Receives the write end, to pass to the job's processes as standard output and error,
+      or -1 if the output cannot be captured.
+
+    Return:
+    The read end, to pass to addJob(), or -1 if the output cannot be captured and goes to the terminal.
+*/
+int captureJobOutput(int* writeFd) {
+    int fds[2];
+    *writeFd = -1;
+    if (event_fd == -1 || pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    *writeFd = fds[1];
+    return fds[0];
+}
+
+/*
+    Function: waitForInput
+
+    Description:
+    Runs the event loop while the shell waits for the next line, until standard input is readable.
+
+    Parameters: None
+
+    Returns: None
+
+    Notes:
+    Standard input is watched with EPOLLONESHOT, re-armed here, so input typed while a foreground
+    command runs does not keep waking the loop. Nothing is done while no capture pipe is open.
+*/
+void waitForInput() {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = EVENT_INPUT;
+    if (capture_count == 0 || (epoll_ctl(event_fd, EPOLL_CTL_MOD, STDIN_FILENO, &event) < 0 &&
+                               epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0)) {
+        return;
+    }
+    while (capture_count > 0 && !runEventLoop(-1)) {
+    }
+}
+
+/*
+    Function: freeJob
+
+    Description:
+    Releases a job and returns its slot to the free list. Its pids must no longer be in the pid map.
+
+    Parameters:
+    - slot: The job table slot.
+
+    Return:
+    None
+*/
+void freeJob(int slot) {
+    Job* job = &jobTable.jobs[slot];
+    closeJobOutput(&job->output);
+    free(job->pids);
+    free(job->command);
+    free(job->output.data);
+    job->pids = NULL;
+    job->command = NULL;
+    job->output.data = NULL;
+    job->state = JOB_FREE;
+    job->next = jobTable.freeHead;
+    jobTable.freeHead = slot;
+}
+
+/*
+    Function: forgetDoneJob
+
+    Description:
+    Removes a finished job from the finished list and frees it.
+
+    Parameters:
+    - slot: The job table slot of a job in the JOB_DONE state.
+
+    Return:
+    None
+
+    Notes:
+    The finished list is singly linked, so this walks it; it is only called from builtins.
+    Dropping the oldest finished job, the common case, is O(1).
+*/
+void forgetDoneJob(int slot) {
+    int* link = &jobTable.doneHead;
+    int prev = -1;
+    while (*link != -1 && *link != slot) {
+        prev = *link;
+        link = &jobTable.jobs[*link].next;
+    }
+    if (*link == slot) {
+        *link = jobTable.jobs[slot].next;
+        if (jobTable.doneTail == slot) {
+            jobTable.doneTail = prev;
+        }
+        jobTable.doneCount--;
+    }
+    freeJob(slot);
+}
+
+/*
+    Function: finishJobStage
+
+    Description:
+    Records that one process of a background job has exited.
+
+    Parameters:
+    - slot: The job table slot.
+    - pid: The pid that exited.
+    - status: Its status as returned by waitpid().
+
+    Return:
+    None
+
+    Details:
+    1. The exit code of the last pipeline stage becomes the exit code of the job.
+    2. When every stage has exited, the output still in its capture pipe is read, and the job moves to
+       the finished list. If more than DONE_JOBS_MAX jobs are finished and not yet collected, the oldest
+       one is dropped, keeping memory bounded.
+*/
+void finishJobStage(int slot, pid_t pid, int status) {
+    Job* job = &jobTable.jobs[slot];
+    if (pid == job->pids[job->npids - 1]) {
+        job->exitCode = statusToExitCode(status);
+    }
+    if (--job->running > 0) {
+        return;
+    }
+
+    if (job->output.fd != -1) {
+        readJobOutput(slot);
+    }
+    job->state = JOB_DONE;
+    job->next = -1;
+    if (jobTable.doneTail == -1) {
+        jobTable.doneHead = slot;
+    } else {
+        jobTable.jobs[jobTable.doneTail].next = slot;
+    }
+    jobTable.doneTail = slot;
+    if (++jobTable.doneCount > DONE_JOBS_MAX) {
+        forgetDoneJob(jobTable.doneHead);
+    }
+}
+
+/*
+    Function: reapPid
+
+    Description:
+    Hands the status of a reaped child to the job it belongs to.
+
+    Parameters:
+    - pid: The pid returned by waitpid().
+    - status: Its status.
+
+    Return:
+    1 if the pid belonged to a background job, 0 otherwise.
+*/
+int reapPid(pid_t pid, int status) {
+    int slot = pidMapRemove(pid);
+    if (slot < 0) {
+        return 0;
+    }
+    finishJobStage(slot, pid, status);
+    return 1;
+}
+
+/*
+    Function: reapJobs
+
+    Description:
+    Reads the pending output of background jobs and reaps every background process that has exited, without blocking.
+
+    Parameters: None
+
+    Returns: None
+
+    Details:
+    1. Pending events are handled with runEventLoop(). The self-pipe is drained; if it was empty and the
+       event loop did not drain it either, no SIGCHLD arrived and nothing more is done.
+    2. Otherwise waitpid(-1, WNOHANG) is called until no more children have exited. It is only called
+       between command lines, when no foreground child is outstanding, so every child it returns is
+       a background job. Each one is found through the pid map in O(1).
+*/
+void reapJobs() {
+    char buf[64];
+    if (capture_count > 0) {
+        runEventLoop(0);
+    }
+    int woken = sigchld_pending;
+    sigchld_pending = 0;
+    while (sigchldPipe[0] != -1 && read(sigchldPipe[0], buf, sizeof(buf)) > 0) {
+        woken = 1;
+    }
+    if (!woken) {
+        return;
+    }
+
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        reapPid(pid, status);
+    }
+}
+
+/*
+    Function: addJob
+
+    Description:
+    Registers a background command or pipeline in the job table.
+
+    Parameters:
+    - stages: The argument lists of the stages, used to build the job's command text.
+    - count: The number of stages.
+    - pids: The pid of every stage; -1 for stages that could not be started.
+    - outputFd: The read end of the pipe capturing the job's output, from captureJobOutput(), or -1.
+
+    Return:
+    The job id, or 0 if no stage could be started.
+
+    Details:
+    A free slot is reused if there is one, otherwise the table doubles in size. Every pid is
+    added to the pid map so the reaper can find its job in O(1), and the capture pipe is added
+    to the event loop, tagged with the slot.
+*/
+int addJob(char*** stages, int count, pid_t* pids, int outputFd) {
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        started += pids[i] != -1;
+    }
+    if (started == 0) {
+        if (outputFd != -1) {
+            close(outputFd);
+        }
+        return 0;
+    }
+
+    if (jobTable.freeHead == -1) {
+        int size = jobTable.size ? jobTable.size * 2 : 16;
+        Job* grown = (Job*)realloc(jobTable.jobs, size * sizeof(Job));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        jobTable.jobs = grown;
+        for (int i = size - 1; i >= jobTable.size; i--) {
+            jobTable.jobs[i].state = JOB_FREE;
+            jobTable.jobs[i].next = jobTable.freeHead;
+            jobTable.freeHead = i;
+        }
+        jobTable.size = size;
+    }
+    int slot = jobTable.freeHead;
+    Job* job = &jobTable.jobs[slot];
+    jobTable.freeHead = job->next;
+
+    // Keep only the stages that started; the job is done once all of them have exited
+    job->pids = (pid_t*)malloc(started * sizeof(pid_t));
+    size_t len = 1;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; stages[i][j] != NULL; j++) {
+            len += strlen(stages[i][j]) + 1;
+        }
+        len += 2;
+    }
+    job->command = (char*)malloc(len);
+    if (!job->pids || !job->command) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    job->command[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            strcat(job->command, "| ");
+        }
+        for (int j = 0; stages[i][j] != NULL; j++) {
+            strcat(job->command, stages[i][j]);
+            strcat(job->command, " ");
+        }
+    }
+    job->command[strlen(job->command) - 1] = '\0';
+
+    job->npids = 0;
+    for (int i = 0; i < count; i++) {
+        if (pids[i] != -1) {
+            job->pids[job->npids++] = pids[i];
+            pidMapInsert(pids[i], slot);
+        }
+    }
+    job->running = job->npids;
+    job->exitCode = pids[count - 1] == -1 ? EXIT_FAILURE : 0;
+    memset(&job->output, 0, sizeof(job->output));
+    job->output.fd = -1;
+    if (outputFd != -1) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = slot;
+        if (epoll_ctl(event_fd, EPOLL_CTL_ADD, outputFd, &event) < 0) {
+            perror("epoll_ctl");
+            close(outputFd);
+        } else {
+            job->output.fd = outputFd;
+            capture_count++;
+        }
+    }
+    job->notified = 0;
+    job->state = JOB_RUNNING;
+    job->next = -1;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    jobTable.lastId = slot + 1;
+
+    if (interactive) {
+        printf("[%d] %d\n", slot + 1, (int)job->pids[job->npids - 1]);
+    }
+    return slot + 1;
+}
+
+/*
+    Function: jobSlotFromArg
+
+    Description:
+    Parses a job id given as "N" or "%N" and returns its slot in the job table.
+
+    Parameters:
+    - arg: The argument, or NULL for the most recently started job. If that job was already
+           collected, the job with the highest id is used instead.
+
+    Return:
+    The slot, or -1 if there is no such job (an error has been printed).
+*/
+int jobSlotFromArg(const char* arg) {
+    int id = jobTable.lastId;
+    if (arg == NULL && (id <= 0 || jobTable.jobs[id - 1].state == JOB_FREE)) {
+        for (id = jobTable.size; id > 0 && jobTable.jobs[id - 1].state == JOB_FREE; id--) {
+        }
+    }
+    if (arg != NULL) {
+        char* end;
+        id = (int)strtol(arg[0] == '%' ? arg + 1 : arg, &end, 10);
+        if (*end != '\0') {
+            id = 0;
+        }
+    }
+    if (id <= 0 || id > jobTable.size || jobTable.jobs[id - 1].state == JOB_FREE) {
+        fprintf(stderr, "%s: no such job\n", arg ? arg : "current");
+        return -1;
+    }
+    return id - 1;
+}
+
+/*
+    Function: waitJob
+
+    Description:
+    Blocks until every process of a background job has exited, then collects the job unless it has
+    captured output left to dump.
+
+    Parameters:
+    - slot: The job table slot.
+
+    Return:
+    The exit code of the job.
+*/
+int waitJob(int slot) {
+    Job* job = &jobTable.jobs[slot];
+    for (int i = 0; i < job->npids && job->state == JOB_RUNNING; i++) {
+        int status;
+        if (pidMapRemove(job->pids[i]) == -1) {
+            continue; // Already reaped
+        }
+        if (waitChild(job->pids[i], &status) < 0) {
+            status = EXIT_FAILURE << 8;
+        }
+        finishJobStage(slot, job->pids[i], status);
+    }
+    int exitCode = job->exitCode;
+    if (job->output.length == 0) {
+        forgetDoneJob(slot);
+    }
+    return exitCode;
+}
+
+/*
+    Function: notifyJobs
+
+    Description:
+    Reports the background jobs that finished since the last prompt and collects them.
+    Only used in interactive mode; scripts collect finished jobs with 'wait' or 'jobs'.
+
+    Parameters: None
+
+    Returns: None
+
+    Notes:
+    A job with captured output is reported once, with the size of its output, and kept until 'dump' shows it.
+*/
+void notifyJobs() {
+    for (int slot = jobTable.doneHead; slot != -1; ) {
+        Job* job = &jobTable.jobs[slot];
+        int next = job->next;
+        if (!job->notified) {
+            if (job->exitCode == 0) {
+                printf("[%d] Done\t%s", slot + 1, job->command);
+            } else {
+                printf("[%d] Exit %d\t%s", slot + 1, job->exitCode, job->command);
+            }
+            if (job->output.length > 0) {
+                printf("\t(%zu bytes of output, see 'dump %d')", job->output.length, slot + 1);
+            }
+            printf("\n");
+            job->notified = 1;
+        }
+        if (job->output.length == 0) {
+            forgetDoneJob(slot);
+        }
+        slot = next;
+    }
+}
+
+/*
+    Function: jobsCommand
+
+    Description:
+    Implements the 'jobs' builtin, listing running and finished background jobs.
+
+    Parameters:
+    - parsed: An array of strings representing the command and its arguments.
+
+    Return:
+    None
+
+    Details:
+    Each line shows the job id, the pid of its last stage, its state, the seconds since it started,
+    the command and, if there is any, the size of the captured output. Finished jobs are collected
+    once they have been listed, except those with output left to dump.
+*/
+void jobsCommand(char** parsed) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    (void)parsed;
+    for (int slot = 0; slot < jobTable.size; slot++) {
+        Job* job = &jobTable.jobs[slot];
+        if (job->state == JOB_FREE) {
+            continue;
+        }
+        double elapsed = (now.tv_sec - job->start.tv_sec) + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+        if (job->state == JOB_RUNNING) {
+            printf("[%d] %d Running\t%.1fs\t%s", slot + 1, (int)job->pids[job->npids - 1], elapsed, job->command);
+        } else {
+            printf("[%d] %d Exit %d\t%.1fs\t%s", slot + 1, (int)job->pids[job->npids - 1], job->exitCode, elapsed, job->command);
+        }
+        if (job->output.length > 0) {
+            printf("\t(%zu bytes of output)", job->output.length);
+        }
+        printf("\n");
+    }
+    for (int slot = jobTable.doneHead; slot != -1; ) {
+        int next = jobTable.jobs[slot].next;
+        if (jobTable.jobs[slot].output.length == 0) {
+            forgetDoneJob(slot);
+        }
+        slot = next;
+    }
+    last_exit_status = 0;
+}
+
+/*
+    Function: waitCommand
+
+    Description:
+    Implements the 'wait' builtin.
+
+    Parameters:
+    - parsed: An array of strings representing the command and its arguments.
+
+    Return:
+    None
+
+    Details:
+    - "wait" waits for every background job and sets 'last_exit_status' to 0.
+    - "wait N..." waits for the given jobs and sets 'last_exit_status' to the exit code of the last one,
+      or 127 if a job does not exist.
+*/
+void waitCommand(char** parsed) {
+    if (parsed[1] == NULL) {
+        for (int slot = 0; slot < jobTable.size; slot++) {
+            if (jobTable.jobs[slot].state != JOB_FREE) {
+                waitJob(slot);
+            }
+        }
+        last_exit_status = 0;
+        return;
+    }
+    for (int i = 1; parsed[i] != NULL; i++) {
+        int slot = jobSlotFromArg(parsed[i]);
+        last_exit_status = slot < 0 ? 127 : waitJob(slot);
+    }
+}
+
+/*
+    Function: fgCommand
+
+    Description:
+    Implements the 'fg' builtin: prints the command of a background job and waits for it in the foreground.
+    Without an argument, the most recently started job is used. The output captured so far is printed
+    first, and new output goes straight to stdout until the job exits.
+
+    Parameters:
+    - parsed: An array of strings representing the command and its arguments.
+
+    Return:
+    None
+*/
+void fgCommand(char** parsed) {
+    int slot = jobSlotFromArg(parsed[1]);
+    if (slot < 0) {
+        last_exit_status = 1;
+        return;
+    }
+    printf("%s\n", jobTable.jobs[slot].command);
+    writeJobOutput(&jobTable.jobs[slot].output);
+    jobTable.jobs[slot].output.forward = 1;
+    fflush(stdout);
+    last_exit_status = waitJob(slot);
+}
+
+/*
+    Function: dumpCommand
+
+    Description:
+    Implements the 'dump' builtin: writes the output captured from a background job to stdout.
+    Without an argument, the most recently started job is used.
+
+    Parameters:
+    - parsed: An array of strings representing the command and its arguments.
+
+    Return:
+    None
+
+    Details:
+    - Output still in the job's pipe is read first. The ring buffer is emptied, so the next dump only
+      shows what the job wrote since.
+    - If older output was dropped because the ring buffer was full, a note is printed on stderr.
+    - A finished job is collected once its output has been dumped.
+    - 'last_exit_status' is 0, or 1 if there is no such job.
+*/
+void dumpCommand(char** parsed) {
+    int slot = jobSlotFromArg(parsed[1]);
+    if (slot < 0) {
+        last_exit_status = 1;
+        return;
+    }
+    Job* job = &jobTable.jobs[slot];
+    if (job->output.fd != -1) {
+        readJobOutput(slot);
+    }
+    if (job->output.dropped > 0) {
+        fprintf(stderr, "dump: [%d] %zu earlier bytes were dropped\n", slot + 1, job->output.dropped);
+    }
+    writeJobOutput(&job->output);
+    if (job->state == JOB_DONE) {
+        forgetDoneJob(slot);
+    }
+    last_exit_status = 0;
+}
+
+/*
+    Function: execArgs
+
+    Description:
+    This function executes a command with arguments passed as an array of strings.
+    It optionally supports input and output redirection and can run the command in the background.
+
+    Parameters:
+    - parsed: A pointer to an array of strings representing the command and its arguments.
+    - background: An integer flag indicating whether the command should run in the background (1) or not (0).
+
+    Return:
+    None
+
+    Details:
+    1. Input and output redirections are opened using openRedirections().
+    2. The command is started with launchCommand(), using the engine selected by 'launch_mode'.
+    3. If the command runs in the background, its standard output (unless redirected) and standard error
+       go to a capture pipe, and it is registered in the job table with addJob().
+    4. Otherwise:
+       - It waits for the child process to finish.
+       - It retrieves the exit status of the child process.
+       - It stores the exit status in the global variable 'last_exit_status' and in the pipestatus array.
+    5. A command that could not be started counts as a failure.
+*/
+void execArgs(char** parsed, int background) {
+    int inFd, outFd;
+    int captureFd = -1;
+    int outputFd = background ? captureJobOutput(&captureFd) : -1;
+    pid_t pid = -1;
+
+    if (openRedirections(parsed, &inFd, &outFd) == 0) {
+        pid = launchCommand(parsed, inFd, outFd != -1 ? outFd : captureFd, captureFd);
+        if (inFd != -1) {
+            close(inFd);
+        }
+        if (outFd != -1) {
+            close(outFd);
+        }
+    }
+    if (captureFd != -1) {
+        close(captureFd);
+    }
+
+    if (background && pid != -1) {
+        addJob(&parsed, 1, &pid, outputFd);
+    } else {
+        if (outputFd != -1) {
+            close(outputFd);
+        }
+        int status = EXIT_FAILURE << 8;
+        if (pid != -1) {
+            waitChild(pid, &status);
+        }
+        last_exit_status = statusToExitCode(status); // Store exit code
+        setPipeStatus(1);
+        pipe_status[0] = last_exit_status;
+    }
+}
+
+/* Function: parseEnvVars
+Description: This function parses environment variables from the array of parsed arguments and inserts them into a hash table. Each environment variable is expected to be in the form "name=value" within the parsed array. The function iterates through the array, identifying environment variables by locating the "=" separator. It then separates the name and value, inserts them into the hash table, and modifies the parsed array by setting the "=" element to NULL to indicate the end of each environment variable. 
+This prevents the separator from being treated as a separate argument in later processing.
+
+ Parameters:
+ - parsed: A pointer to an array of strings representing the parsed arguments, where environment variables are expected to be in the format "name=value".
+ Returns: None */
+void parseEnvVars(char** parsed) {
+    for (int i = 1; parsed[i] != NULL; i++) {
+        if (strcmp(parsed[i], "=") == 0) {
+            // Separate name and value
+            parsed[i] = NULL;
+            char* name = parsed[i - 1];
+            char* value = parsed[i + 1];
+            insertIntoHashTable(name, value);
+        }
+    }
+}
+
+
+/*
+  Function: setEnvVar
+
+  Description:
+  Sets environment variables by parsing and extracting name-value pairs from the given command arguments.
+  The function ensures correct syntax and removes quotes around the value if present.
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments, where parsed[1] contains the name-value pair.
+
+  Returns:
+  Void. Sets the environment variable if the syntax is valid. 'last_exit_status' is set to 0 on success, 1 otherwise.
+
+  Notes:
+  - Parses the name-value pair from the command arguments.
+  - Checks for valid syntax; if not, prints an error message and returns.
+  - Separates the name and value, and removes quotes from the value if present.
+  - Calls insertIntoHashTable() function to set the environment variable.
+*/
+void setEnvVar(char** parsed) {
+    last_exit_status = 1;
+    if (parsed[1] == NULL) {
+        fprintf(stderr, "Invalid syntax for set command\n");
+        return;
+    }
+
+    // Separate name and value
+    char* assignment = parsed[1];
+    char* equal_sign = strchr(assignment, '=');
+    if (equal_sign == NULL) {
+        fprintf(stderr, "Invalid syntax for set command\n");
+        return;
+    }
+
+    *equal_sign = '\0'; // Separate name and value
+    char* name = assignment;
+    char* value = equal_sign + 1;
+
+    // Remove quotes if present
+    if (value[0] == '"' && value[strlen(value) - 1] == '"') {
+        value[strlen(value) - 1] = '\0';
+        value++;
+    }
+
+    insertIntoHashTable(name, value);
+    last_exit_status = 0;
+}
+
+/*
+  Function: getEnvVar
+
+  Description:
+  Retrieves the value of an environment variable specified by the given name.
+  If the name is '?', prints the last exit status.
+  If the variable is found, prints its value; otherwise, prints a message indicating the variable was not found.
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments, where parsed[1] contains the variable name.
+
+  Returns:
+  Void. Prints the value of the variable or an appropriate message.
+  'last_exit_status' is then set to 0, or 1 if the variable was not found.
+
+  Notes:
+  - Retrieves the name of the environment variable from the command arguments.
+  - If the name is '?', prints the last exit status.
+  - If the name is 'PIPESTATUS', prints the exit codes of every stage of the last pipeline.
+  - Searches for the variable in the hash table using searchInHashTable() function.
+  - If the variable is found, prints its value; otherwise, prints a message indicating the variable was not found.
+*/
+void getEnvVar(char** parsed) {
+    char* name = parsed[1];
+    char* value;
+    if (name == NULL) {
+        fprintf(stderr, "Invalid syntax for get command\n");
+        last_exit_status = 1;
+        return;
+    }
+    if (strcmp(name, "?") == 0) {
+        printf("%d\n", last_exit_status); // Print last exit status
+    } else if (strcmp(name, "PIPESTATUS") == 0) {
+        for (int i = 0; i < pipe_status_count; i++) {
+            printf(i ? " %d" : "%d", pipe_status[i]);
+        }
+        printf("\n");
+    } else {
+        value = searchInHashTable(name);
+        if (value != NULL) {
+            printf("%s\n", value);
+        } else {
+            printf("Variable not found\n"); // Print message if variable not found
+            last_exit_status = 1;
+            return;
+        }
+    }
+    last_exit_status = 0;
+}
+
+/*
+  Function: unsetEnvVar
+
+  Description:
+  Removes the environment variables named in the command arguments.
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments, where parsed[1..] contain variable names.
+
+  Returns:
+  Void. 'last_exit_status' is set to 1 if no variable was named or any did not exist, 0 otherwise.
+*/
+void unsetEnvVar(char** parsed) {
+    if (parsed[1] == NULL) {
+        fprintf(stderr, "Invalid syntax for unset command\n");
+        last_exit_status = 1;
+        return;
+    }
+    last_exit_status = 0;
+    for (int i = 1; parsed[i] != NULL; i++) {
+        if (!removeFromHashTable(parsed[i])) {
+            last_exit_status = 1;
+        }
+    }
+}
+
+/*
+  Function: exportCommand
+
+  Description:
+  Marks variables to be passed to child processes.
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments.
+
+  Returns:
+  Void. 'last_exit_status' is set to 1 if no variable was named or any did not exist, 0 otherwise.
+
+  Notes:
+  - "export" lists the exported variables as NAME=VALUE lines.
+  - "export NAME=VALUE..." sets the variables and exports them.
+  - "export NAME..." exports variables that are already set.
+  - "export -n NAME..." keeps the variables but stops passing them to child processes.
+*/
+void exportCommand(char** parsed) {
+    last_exit_status = 0;
+    if (parsed[1] == NULL) {
+        for (char** env = childEnvironment(); *env != NULL; env++) {
+            printf("%s\n", *env);
+        }
+        return;
+    }
+
+    int i = 1;
+    int exported = 1;
+    if (strcmp(parsed[1], "-n") == 0) {
+        exported = 0;
+        i++;
+    }
+    for (; parsed[i] != NULL; i++) {
+        char* equal_sign = strchr(parsed[i], '=');
+        if (equal_sign != NULL && exported) {
+            *equal_sign = '\0'; // Separate name and value
+            insertIntoHashTable(parsed[i], equal_sign + 1);
+        }
+        if (!exportVariable(parsed[i], exported)) {
+            fprintf(stderr, "export: %s: not set\n", parsed[i]);
+            last_exit_status = 1;
+        }
+    }
+}
+
+/*
+  Function: startPipeline
+
+  Description:
+  Starts every stage of a pipeline without waiting for any of them.
+
+  Parameters:
+  - stages: An array of argument lists, one per command of the pipeline.
+  - count: The number of commands in the pipeline.
+  - pids: Receives the pid of every stage, or -1 for a stage that could not be started.
+  - inputFd: The standard input of the first stage, such as the read end of a fan-out pipe, or -1
+    to use the shell's. It is not closed.
+  - outputFd: The standard output of the last stage, such as the write end of a capture pipe, or -1
+    to use the shell's.
+  - errFd: The standard error of every stage, or -1 to use the shell's.
+
+  Returns:
+  The number of stages that were started.
+
+  Notes:
+  - All stages are started with launchCommand() in a single pass; each pipe is created just before
+    the stage that writes into it.
+  - The parent closes every pipe end as soon as the stages using it are started, so each reader sees
+    EOF as soon as its writer exits. Pipes are created with O_CLOEXEC so children never inherit
+    the ends they do not use.
+  - Each stage may use "<" and ">" redirections, which take precedence over the pipe.
+*/
+int startPipeline(char*** stages, int count, pid_t* pids, int inputFd, int outputFd, int errFd) {
+    int prevRead = inputFd; // Read end of the pipe feeding the current stage
+    int started = 0;
+
+    for (int i = 0; i < count; i++) {
+        int pipefd[2] = {-1, -1};
+        int inFd, outFd;
+
+        // Create the pipe between this stage and the next one
+        if (i < count - 1 && pipe2(pipefd, O_CLOEXEC) < 0) {
+            printf("Pipe could not be initialized\n");
+        }
+
+        pids[i] = -1;
+        if (openRedirections(stages[i], &inFd, &outFd) == 0) {
+            pids[i] = launchCommand(stages[i],
+                                    inFd != -1 ? inFd : prevRead,
+                                    outFd != -1 ? outFd : (pipefd[1] != -1 ? pipefd[1] : outputFd),
+                                    errFd);
+            if (inFd != -1) {
+                close(inFd);
+            }
+            if (outFd != -1) {
+                close(outFd);
+            }
+        }
+        started += pids[i] != -1;
+
+        // Drop the pipe ends that now belong to the children
+        if (prevRead != -1 && prevRead != inputFd) {
+            close(prevRead);
+        }
+        if (pipefd[1] != -1) {
+            close(pipefd[1]);
+        }
+        prevRead = pipefd[0];
+    }
+    return started;
+}
+
+/*
+  Function: execArgsPiped
+
+  Description:
+  Executes a pipeline of any number of commands. The output of each command becomes the input of the next one.
+
+  Parameters:
+  - stages: An array of argument lists, one per command of the pipeline.
+  - count: The number of commands in the pipeline.
+  - background: An integer flag indicating whether the pipeline should run in the background (1) or not (0).
+
+  Returns:
+  Void. Executes the commands in a piped manner.
+
+  Notes:
+  - The stages are started with startPipeline().
+  - Once every stage is started, all of them are reaped in a single pass. The exit code of every
+    stage is stored in the pipestatus array and the last stage's exit code in 'last_exit_status'.
+    A stage that could not be started counts as a failure.
+  - A background pipeline is registered in the job table as a single job instead, with its output captured.
+*/
+void execArgsPiped(char*** stages, int count, int background) {
+    pid_t* pids = (pid_t*)arenaAlloc(&lineArena, count * sizeof(pid_t));
+    int captureFd = -1;
+    int outputFd = background ? captureJobOutput(&captureFd) : -1;
+    startPipeline(stages, count, pids, -1, captureFd, captureFd);
+    if (captureFd != -1) {
+        close(captureFd);
+    }
+
+    if (background) {
+        addJob(stages, count, pids, outputFd);
+    } else {
+        setPipeStatus(count);
+        for (int i = 0; i < count; i++) {
+            int status = EXIT_FAILURE << 8;
+            if (pids[i] != -1) {
+                waitChild(pids[i], &status);
+            }
+            pipe_status[i] = statusToExitCode(status);
+        }
+        last_exit_status = pipe_status[count - 1];
+    }
+}
+
+/*
+  Function: execFanOut
+
+  Description:
+  Runs a "producer |> (consumer, consumer...)" fan-out: one producer pipeline whose output every
+  consumer pipeline receives in full.
+
+  Parameters:
+  - pipeline: The parsed producer, with the consumers as its branches.
+
+  Returns:
+  Void. In the foreground, the pipestatus array holds the exit code of every producer stage and then
+  of every consumer stage, and 'last_exit_status' is 0 if every consumer succeeded, otherwise the exit
+  code of the last stage of the first failing one. If the producer or a consumer expands to no words,
+  nothing runs, an error is printed and 'last_exit_status' is 1.
+
+  Notes:
+  1. The producer writes into one pipe. A forked copy of the shell, the distributor, reads that pipe
+     with distributeStream() and feeds one pipe per consumer. The stream is produced once, and tee()
+     and splice() pass its pages from pipe to pipe without copying them.
+  2. The distributor ignores SIGPIPE. A consumer that exits early, such as "head", is dropped and the
+     others still get everything. Once every consumer is gone the distributor exits, and the producer
+     gets SIGPIPE as it would in a pipeline.
+  3. A consumer that falls behind fills its pipe, which stalls the distributor and in turn the
+     producer, so memory use stays at a few pipe buffers whatever the size of the stream.
+  4. In the background, every process, the distributor included, belongs to one job, whose exit
+     code is that of the last consumer.
+*/
+void execFanOut(const Pipeline* pipeline) {
+    static char* distributorArgs[] = {"|>", NULL};
+    int nbranches = pipeline->nbranches;
+    char*** producer;
+    int count = expandPipeline(pipeline, &producer);
+    char**** branches = (char****)arenaAlloc(&lineArena, nbranches * sizeof(char***));
+    int* counts = (int*)arenaAlloc(&lineArena, nbranches * sizeof(int));
+    int total = count + 1; // Every process, the distributor included
+    const Pipeline* empty = count == 0 ? pipeline : NULL;
+    for (int b = 0; b < nbranches && empty == NULL; b++) {
+        counts[b] = expandPipeline(&pipeline->branches[b], &branches[b]);
+        total += counts[b];
+        if (counts[b] == 0) {
+            empty = &pipeline->branches[b];
+        }
+    }
+    int source[2];
+    if (empty != NULL) {
+        // Nothing runs; expandPipeline() has already complained about an empty stage of a longer pipeline
+        if (empty->nstages == 1) {
+            fprintf(stderr, "Invalid syntax: empty pipeline stage\n");
+        }
+        last_exit_status = 1;
+        setPipeStatus(1);
+        pipe_status[0] = 1;
+        return;
+    } else if (pipe2(source, O_CLOEXEC) < 0) {
+        perror("pipe");
+        last_exit_status = 1;
+        return;
+    }
+    fcntl(source[1], F_SETPIPE_SZ, COPY_PIPE_SIZE);
+
+    // The processes in start order, the distributor right after the producer
+    char*** stages = (char***)arenaAlloc(&lineArena, total * sizeof(char**));
+    pid_t* pids = (pid_t*)arenaAlloc(&lineArena, total * sizeof(pid_t));
+    int* outputs = (int*)arenaAlloc(&lineArena, nbranches * sizeof(int));
+    const char** names = (const char**)arenaAlloc(&lineArena, nbranches * sizeof(char*));
+    int captureFd = -1;
+    int outputFd = pipeline->background ? captureJobOutput(&captureFd) : -1;
+
+    memcpy(stages, producer, count * sizeof(char**));
+    startPipeline(producer, count, pids, -1, source[1], captureFd);
+    close(source[1]);
+    int next = count + 1;
+    for (int b = 0; b < nbranches; b++) {
+        int fds[2];
+        memcpy(stages + next, branches[b], counts[b] * sizeof(char**));
+        names[b] = branches[b][0][0];
+        outputs[b] = -1;
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            for (int i = 0; i < counts[b]; i++) {
+                pids[next + i] = -1;
+            }
+        } else {
+            fcntl(fds[1], F_SETPIPE_SZ, COPY_PIPE_SIZE);
+            startPipeline(branches[b], counts[b], pids + next, fds[0], captureFd, captureFd);
+            close(fds[0]);
+            outputs[b] = fds[1];
+        }
+        next += counts[b];
+    }
+
+    stages[count] = distributorArgs;
+    fflush(stdout);
+    pids[count] = fork();
+    if (pids[count] == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        _exit(distributeStream(source[0], outputs, names, nbranches, "|>"));
+    } else if (pids[count] == -1) {
+        perror("fork");
+    }
+    close(source[0]);
+    for (int b = 0; b < nbranches; b++) {
+        if (outputs[b] != -1) {
+            close(outputs[b]);
+        }
+    }
+    if (captureFd != -1) {
+        close(captureFd);
+    }
+
+    if (pipeline->background) {
+        addJob(stages, total, pids, outputFd);
+        return;
+    }
+    setPipeStatus(total - 1);
+    for (int i = 0, n = 0; i < total; i++) {
+        int status = EXIT_FAILURE << 8;
+        if (pids[i] != -1) {
+            waitChild(pids[i], &status);
+        }
+        if (i != count) {
+            pipe_status[n++] = statusToExitCode(status);
+        }
+    }
+    last_exit_status = 0;
+    for (int b = 0, end = count; b < nbranches; b++) {
+        end += counts[b];
+        if (last_exit_status == 0) {
+            last_exit_status = pipe_status[end - 1];
+        }
+    }
+}
+
+/*
+  Function: changeDirectory
+
+  Description:
+  Changes the current working directory to the directory specified in the command arguments.
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments, where parsed[1] contains the directory to change to.
+
+  Returns:
+  Void. Changes the current working directory.
+
+  Notes:
+  - Checks if the expected argument for "cd" command is provided.
+  - Uses chdir() system call to change the current working directory.
+  - Prints an error message if chdir() fails.
+  - Refreshes the working directory cached for the prompt on success.
+  - 'last_exit_status' is set to 0 on success, 1 otherwise.
+*/
+void changeDirectory(char** parsed) {
+    // `parsed[1]` should be the directory to change to
+    last_exit_status = 0;
+    if (parsed[1] == NULL) {
+        fprintf(stderr, "Expected argument to \"cd\"\n");
+        last_exit_status = 1;
+    } else {
+        if (chdir(parsed[1]) != 0) {
+            perror("chdir failed");
+            last_exit_status = 1;
+        } else {
+            if (cwd_fd != -1) {
+                close(cwd_fd); // Reopened on the next zygote launch
+                cwd_fd = -1;
+            }
+            if (promptCache.cwd != NULL) {
+                refreshPromptCwd(); // Keep the cached prompt in sync
+            }
+        }
+    }
+}
+
+
+/*
+  Function: echoCommand
+
+  Description:
+  Prints its arguments separated by single spaces, followed by a newline unless the first argument is "-n".
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments.
+
+  Returns:
+  Void. 'last_exit_status' is set to 0.
+*/
+void echoCommand(char** parsed) {
+    int i = 1;
+    int newline = 1;
+    if (parsed[1] != NULL && strcmp(parsed[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; parsed[i] != NULL; i++) {
+        if (i > first) {
+            putchar(' ');
+        }
+        fputs(parsed[i], stdout);
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    last_exit_status = 0;
+}
+
+// "true": does nothing, successfully
+void trueCommand(char** parsed) {
+    last_exit_status = 0;
+}
+
+// "false": does nothing, unsuccessfully
+void falseCommand(char** parsed) {
+    last_exit_status = 1;
+}
+
+// "exit [code]": exits the shell with the given code, 0 by default
+void exitCommand(char** parsed) {
+    exit(parsed[1] != NULL ? atoi(parsed[1]) : 0);
+}
+
+/*
+  Function: pwdCommand
+
+  Description:
+  Prints the current working directory.
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments. Arguments are ignored.
+
+  Returns:
+  Void. 'last_exit_status' is set to 0, or 1 if the directory could not be read.
+*/
+void pwdCommand(char** parsed) {
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        last_exit_status = 1;
+        return;
+    }
+    puts(cwd);
+    free(cwd);
+    last_exit_status = 0;
+}
+
+/*
+  Function: printEscape
+
+  Description:
+  Prints the character written as a backslash escape in a printf format.
+
+  Parameters:
+  - c: Points to the backslash.
+
+  Returns:
+  A pointer to the last character of the escape sequence.
+
+  Notes:
+  - \n, \t, \r, \a, \b, \f, \v, \\ and \" are understood. Anything else is printed as is, backslash included.
+*/
+const char* printEscape(const char* c) {
+    const char* from = "ntrabfv\\\"";
+    const char* to = "\n\t\r\a\b\f\v\\\"";
+    const char* found = c[1] != '\0' ? strchr(from, c[1]) : NULL;
+    if (found == NULL) {
+        putchar('\\');
+        return c;
+    }
+    putchar(to[found - from]);
+    return c + 1;
+}
+
+/*
+  Function: printfCommand
+
+  Description:
+  Prints its arguments under the control of a format, like printf(1).
+
+  Parameters:
+  - parsed: An array of strings where parsed[1] is the format and parsed[2..] are the arguments.
+
+  Returns:
+  Void. 'last_exit_status' is set to 0, or 1 on a usage error or an invalid conversion.
+
+  Notes:
+  - The conversions %s, %c, %d, %i, %u, %o, %x, %X and %% are supported, with flags, width and precision.
+  - Missing arguments print as an empty string or 0.
+  - The format is reused as long as arguments remain, so "printf '%s\n' a b c" prints three lines.
+*/
+void printfCommand(char** parsed) {
+    if (parsed[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        last_exit_status = 1;
+        return;
+    }
+    last_exit_status = 0;
+    const char* format = parsed[1];
+    char** arg = parsed + 2;
+    char** before;
+
+    do {
+        before = arg;
+        for (const char* c = format; *c != '\0'; c++) {
+            if (*c == '\\') {
+                c = printEscape(c);
+                continue;
+            }
+            if (*c != '%') {
+                putchar(*c);
+                continue;
+            }
+            if (c[1] == '%') {
+                putchar('%');
+                c++;
+                continue;
+            }
+
+            // Copy flags, width and precision into a conversion spec for printf()
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = *c++;
+            while (*c != '\0' && strchr("-+ #0", *c) != NULL && n < 8) {
+                spec[n++] = *c++;
+            }
+            while (*c != '\0' && (isdigit((unsigned char)*c) || *c == '.') && n < 24) {
+                spec[n++] = *c++;
+            }
+            const char* value = *arg != NULL ? *arg++ : "";
+
+            switch (*c) {
+            case 's':
+            case 'c':
+                spec[n++] = *c;
+                spec[n] = '\0';
+                if (*c == 's') {
+                    printf(spec, value);
+                } else {
+                    printf(spec, *value);
+                }
+                break;
+            case 'd':
+            case 'i':
+                memcpy(spec + n, "lld", 4);
+                printf(spec, strtoll(value, NULL, 0));
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = *c;
+                spec[n] = '\0';
+                printf(spec, strtoull(value, NULL, 0));
+                break;
+            default:
+                fprintf(stderr, "printf: invalid conversion in \"%s\"\n", format);
+                last_exit_status = 1;
+                return;
+            }
+        }
+    } while (*arg != NULL && arg != before);
+}
+
+/*
+  Function: testInteger
+
+  Description:
+  Parses an integer operand of "test".
+
+  Parameters:
+  - str: The operand.
+  - value: Receives the parsed value.
+
+  Returns:
+  0 on success, -1 (after printing an error) if the operand is not an integer.
+*/
+int testInteger(const char* str, long long* value) {
+    char* end;
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    if (end == str || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", str);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Function: testExpression
+
+  Description:
+  Evaluates a "test" expression of up to three arguments, optionally negated with "!".
+
+  Parameters:
+  - args: The arguments of the expression.
+  - count: The number of arguments.
+
+  Returns:
+  0 if the expression is true, 1 if it is false, 2 on a syntax error.
+
+  Notes:
+  - One argument is true if it is not empty.
+  - Unary operators: -n, -z, -e, -f, -d, -s, -r, -w, -x.
+  - Binary operators: =, ==, != on strings, and -eq, -ne, -lt, -le, -gt, -ge on integers.
+*/
+int testExpression(char** args, int count) {
+    if (count == 0) {
+        return 1;
+    }
+    if (strcmp(args[0], "!") == 0 && count > 1) {
+        int result = testExpression(args + 1, count - 1);
+        return result == 2 ? 2 : !result;
+    }
+    if (count == 1) {
+        return args[0][0] == '\0';
+    }
+
+    if (count == 2) {
+        const char* op = args[0];
+        const char* operand = args[1];
+        struct stat st;
+        if (strcmp(op, "-n") == 0) {
+            return operand[0] == '\0';
+        } else if (strcmp(op, "-z") == 0) {
+            return operand[0] != '\0';
+        } else if (strcmp(op, "-r") == 0) {
+            return access(operand, R_OK) != 0;
+        } else if (strcmp(op, "-w") == 0) {
+            return access(operand, W_OK) != 0;
+        } else if (strcmp(op, "-x") == 0) {
+            return access(operand, X_OK) != 0;
+        } else if (strcmp(op, "-e") == 0 || strcmp(op, "-f") == 0 ||
+                   strcmp(op, "-d") == 0 || strcmp(op, "-s") == 0) {
+            if (stat(operand, &st) != 0) {
+                return 1;
+            }
+            switch (op[1]) {
+            case 'f':
+                return !S_ISREG(st.st_mode);
+            case 'd':
+                return !S_ISDIR(st.st_mode);
+            case 's':
+                return st.st_size == 0;
+            default:
+                return 0;
+            }
+        }
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+
+    if (count == 3) {
+        const char* op = args[1];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+            return strcmp(args[0], args[2]) != 0;
+        } else if (strcmp(op, "!=") == 0) {
+            return strcmp(args[0], args[2]) == 0;
+        }
+
+        static const char* intOps[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+        for (int i = 0; i < 6; i++) {
+            if (strcmp(op, intOps[i]) != 0) {
+                continue;
+            }
+            long long left, right;
+            if (testInteger(args[0], &left) < 0 || testInteger(args[2], &right) < 0) {
+                return 2;
+            }
+            int results[] = {left == right, left != right, left < right,
+                             left <= right, left > right, left >= right};
+            return !results[i];
+        }
+        fprintf(stderr, "test: %s: binary operator expected\n", op);
+        return 2;
+    }
+
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
+
+/*
+  Function: testCommand
+
+  Description:
+  Runs "test expression" or "[ expression ]".
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments.
+
+  Returns:
+  Void. 'last_exit_status' is set to the result of testExpression().
+*/
+void testCommand(char** parsed) {
+    int count = 0;
+    while (parsed[count + 1] != NULL) {
+        count++;
+    }
+    if (strcmp(parsed[0], "[") == 0) {
+        if (count == 0 || strcmp(parsed[count], "]") != 0) {
+            fprintf(stderr, "[: missing \"]\"\n");
+            last_exit_status = 2;
+            return;
+        }
+        count--;
+    }
+    last_exit_status = testExpression(parsed + 1, count);
+}
+
+/*
+  Function: batchCommand
+
+  Description:
+  Implements the 'batch' builtin: runs a command over a list of items, splitting the list into batches
+  that each fit in the kernel's argument size limit, and runs the batches in parallel.
+
+  Parameters:
+  - parsed: "batch [-j JOBS] [-n ITEMS] COMMAND [ARGS... --] ITEMS...".
+
+  Returns:
+  Void. 'last_exit_status' is 0 if every batch succeeded, otherwise the exit code of the first failing
+  batch in list order, or 1 on a usage error, such as a JOBS or ITEMS that is not a whole positive number.
+
+  Details:
+  1. Without "--", every word after the command is an item. With "--", the words before it are given
+     to every batch and the words after it are the items.
+  2. A batch takes items until the next one would not fit in ARG_MAX, less the size of the environment
+     and 2 KB of headroom, or until it holds ITEMS items with -n. A single item too large for any batch
+     is run on its own, and fails as it would outside 'batch'.
+  3. At most JOBS batches run at once, by default the shell's "&&&" limit (-j, or the number of CPUs).
+     A new one starts as soon as any running one exits. Nothing runs if there are no items.
+*/
+void batchCommand(char** parsed) {
+    int jobs = parallel_limit;
+    long maxItems = 0;
+    int i = 1;
+    int badNumber = 0;
+    last_exit_status = 1;
+    while (parsed[i] != NULL && parsed[i + 1] != NULL &&
+           (strcmp(parsed[i], "-j") == 0 || strcmp(parsed[i], "-n") == 0)) {
+        char* end;
+        errno = 0;
+        long value = strtol(parsed[i + 1], &end, 10);
+        if (end == parsed[i + 1] || *end != '\0' || errno != 0 || value < 1 || value > INT_MAX) {
+            badNumber = 1; // Not a whole positive number
+            break;
+        }
+        if (parsed[i][1] == 'j') {
+            jobs = (int)value;
+        } else {
+            maxItems = value;
+        }
+        i += 2;
+    }
+    if (parsed[i] == NULL || badNumber || jobs < 1) {
+        fprintf(stderr, "Usage: batch [-j jobs] [-n items] command [args... --] items...\n");
+        return;
+    }
+
+    // Split the words into those every batch gets and the items
+    char** fixed = &parsed[i];
+    int nfixed = 1;
+    char** items = &parsed[i + 1];
+    for (int j = i + 1; parsed[j] != NULL; j++) {
+        if (strcmp(parsed[j], "--") == 0) {
+            nfixed = j - i;
+            items = &parsed[j + 1];
+            break;
+        }
+    }
+    int nitems = 0;
+    while (items[nitems] != NULL) {
+        nitems++;
+    }
+    last_exit_status = 0;
+    if (nitems == 0) {
+        return;
+    }
+
+    // Lay out the batches: batch b holds items starts[b] to starts[b + 1] - 1
+    long argMax = sysconf(_SC_ARG_MAX);
+    childEnvironment();
+    long budget = (argMax > 0 ? argMax : _POSIX_ARG_MAX) - 2048 -
+                  (long)(childEnvBytes + (childEnvCount + 1) * sizeof(char*));
+    for (int j = 0; j < nfixed; j++) {
+        budget -= strlen(fixed[j]) + 1 + sizeof(char*);
+    }
+    budget -= sizeof(char*); // The NULL ending argv
+    int* starts = (int*)arenaAlloc(&lineArena, (nitems + 1) * sizeof(int));
+    int nbatches = 0;
+    long used = 0;
+    for (int j = 0; j < nitems; j++) {
+        long size = strlen(items[j]) + 1 + sizeof(char*);
+        if (j == 0 || used + size > budget || (maxItems > 0 && j - starts[nbatches - 1] >= maxItems)) {
+            starts[nbatches++] = j;
+            used = 0;
+        }
+        used += size;
+    }
+    starts[nbatches] = nitems;
+
+    // Run them, at most 'jobs' at a time
+    pid_t* pids = (pid_t*)arenaAlloc(&lineArena, nbatches * sizeof(pid_t));
+    int* exitCodes = (int*)arenaAlloc(&lineArena, nbatches * sizeof(int));
+    int next = 0;
+    int inFlight = 0;
+    while (next < nbatches || inFlight > 0) {
+        while (next < nbatches && inFlight < jobs) {
+            int b = next++;
+            int count = starts[b + 1] - starts[b];
+            char** argv = (char**)arenaAlloc(&lineArena, (nfixed + count + 1) * sizeof(char*));
+            memcpy(argv, fixed, nfixed * sizeof(char*));
+            memcpy(argv + nfixed, items + starts[b], count * sizeof(char*));
+            argv[nfixed + count] = NULL;
+            pids[b] = launchCommand(argv, -1, -1, -1);
+            exitCodes[b] = EXIT_FAILURE;
+            inFlight += pids[b] != -1;
+        }
+        if (inFlight == 0) {
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitChild(-1, &status);
+        if (pid < 0) {
+            perror("waitpid");
+            break;
+        }
+        int owner = -1;
+        for (int b = 0; b < next && owner < 0; b++) {
+            if (pids[b] == pid) {
+                owner = b;
+            }
+        }
+        if (owner < 0) {
+            reapPid(pid, status); // A background job
+            continue;
+        }
+        exitCodes[owner] = statusToExitCode(status);
+        pids[owner] = -1;
+        inFlight--;
+    }
+
+    for (int b = 0; b < nbatches && last_exit_status == 0; b++) {
+        last_exit_status = exitCodes[b];
+    }
+}
+
+/*
+  Function: historyCommand
+
+  Description:
+  Implements the 'history' builtin: lists or searches the command history.
+
+  Parameters:
+  - parsed: "history" to list every loaded entry, "history N" for the last N, or "history -s TEXT"
+            for the entries containing TEXT.
+
+  Returns:
+  Void. 'last_exit_status' is 0, or 1 on a usage error or if a search finds nothing.
+
+  Notes:
+  - Entries are numbered from the first line loaded from the history file, and "!N" runs entry N.
+  - Searches go through the trigram index of searchHistory(), newest first, and are printed oldest first.
+*/
+void historyCommand(char** parsed) {
+    loadHistory();
+    size_t first = 0;
+    last_exit_status = 0;
+
+    if (parsed[1] != NULL && strcmp(parsed[1], "-s") == 0 && parsed[2] != NULL) {
+        size_t len = strlen(parsed[2]);
+        long* matches = NULL; // newest first
+        size_t count = 0, cap = 0;
+        long index = history.count;
+        while ((index = searchHistory(parsed[2], len, index)) >= 0) {
+            matches = (long*)growScratch(matches, &cap, count, sizeof(long));
+            matches[count++] = index;
+        }
+        for (size_t i = count; i > 0; i--) {
+            const HistoryEntry* entry = &history.entries[matches[i - 1]];
+            printf("%5ld  %.*s\n", matches[i - 1] + 1, (int)entry->len, entry->text);
+        }
+        free(matches);
+        last_exit_status = count == 0;
+        return;
+    } else if (parsed[1] != NULL) {
+        char* end;
+        long count = strtol(parsed[1], &end, 10);
+        if (*end != '\0' || count < 0 || parsed[2] != NULL) {
+            fprintf(stderr, "Usage: history [N | -s text]\n");
+            last_exit_status = 1;
+            return;
+        }
+        first = (size_t)count < history.count ? history.count - count : 0;
+    }
+    for (size_t i = first; i < history.count; i++) {
+        printf("%5zu  %.*s\n", i + 1, (int)history.entries[i].len, history.entries[i].text);
+    }
+}
+
+// Returns 1 if no argument from 'first' on is an option, apart from a lone "-" when 'dash' is set
+int noOptions(char** parsed, int first, int dash) {
+    for (int i = first; parsed[i] != NULL; i++) {
+        if (parsed[i][0] == '-' && !(dash && parsed[i][1] == '\0')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 'cat', 'tee' and 'cp' only implement their plain forms; any other option goes to coreutils
+int catAccepts(char** parsed) {
+    return noOptions(parsed, 1, 1);
+}
+
+int teeAccepts(char** parsed) {
+    return noOptions(parsed, parsed[1] != NULL && strcmp(parsed[1], "-a") == 0 ? 2 : 1, 0);
+}
+
+int cpAccepts(char** parsed) {
+    return noOptions(parsed, 1, 0);
+}
+
+/*
+  Function: copyData
+
+  Description:
+  Copies everything readable from one descriptor to another, without passing the data through user
+  space when the kernel can move it directly.
+
+  Parameters:
+  - in: The descriptor to read, from its current offset.
+  - out: The descriptor to write, at its current offset.
+
+  Returns:
+  0 once the input is exhausted, or -1 with errno set if reading or writing failed.
+
+  Notes:
+  1. Between two regular files, copy_file_range() copies inside the kernel, or shares the blocks on
+     file systems that support it.
+  2. From a regular file to anything else, sendfile() sends the page cache straight to the output.
+  3. When either side is a pipe, splice() moves the pages between the pipe and the other side.
+  4. Each call falls back to the next when the kernel refuses the pair of descriptors (EINVAL,
+     EXDEV, ENOSYS, EOPNOTSUPP), for example a file opened with O_APPEND (which copy_file_range()
+     rejects with EBADF, so it is not even tried), and the last resort is
+     read() and write() through a COPY_BUFFER_SIZE buffer. Every method moves the file offsets, so
+     a fallback carries on where the previous one stopped.
+*/
+int copyData(int in, int out) {
+    static char* buffer = NULL;
+    struct stat inStat, outStat;
+    if (fstat(in, &inStat) < 0 || fstat(out, &outStat) < 0) {
+        return -1;
+    }
+    ssize_t n = -1;
+    errno = EINVAL;
+
+    if (S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode) && !(fcntl(out, F_GETFL) & O_APPEND)) {
+        while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK_SIZE, 0)) > 0 || (n < 0 && errno == EINTR)) {
+        }
+    }
+    if (n < 0 && S_ISREG(inStat.st_mode) && COPY_FALLBACK(errno)) {
+        while ((n = sendfile(out, in, NULL, COPY_CHUNK_SIZE)) > 0 || (n < 0 && errno == EINTR)) {
+        }
+    }
+    if (n < 0 && (S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode)) && COPY_FALLBACK(errno)) {
+        while ((n = splice(in, NULL, out, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 ||
+               (n < 0 && errno == EINTR)) {
+        }
+    }
+    if (n >= 0 || !COPY_FALLBACK(errno)) {
+        return n < 0 ? -1 : 0;
+    }
+
+    if (buffer == NULL && (buffer = (char*)malloc(COPY_BUFFER_SIZE)) == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        n = read(in, buffer, COPY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -1 : 0;
+        }
+        for (ssize_t written = 0; written < n; ) {
+            ssize_t w = write(out, buffer + written, n - written);
+            if (w < 0 && errno != EINTR) {
+                return -1;
+            }
+            written += w > 0 ? w : 0;
+        }
+    }
+}
+
+/*
+  Function: catCommand
+
+  Description:
+  Implements the 'cat' builtin: writes files, or standard input, to standard output.
+
+  Parameters:
+  - parsed: "cat [FILE...]". "-" stands for standard input, as does an empty list. With any option,
+    such as -n, the command runs /bin/cat instead (catAccepts()).
+
+  Returns:
+  Void. 'last_exit_status' is 0, or 1 if a file could not be opened or copied (an error is printed).
+
+  Notes:
+  The data is moved with copyData(), so "cat big.log | grep x" and "cat a > b" copy nothing through
+  the shell. In a pipeline it runs in a forked copy of the shell, like every builtin stage.
+*/
+void catCommand(char** parsed) {
+    last_exit_status = 0;
+    fflush(stdout); // Keep earlier output ahead of the data
+    int i = 1;
+    do {
+        const char* name = parsed[i] != NULL ? parsed[i] : "-";
+        int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || copyData(fd, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            last_exit_status = 1;
+        }
+        if (fd > STDIN_FILENO) {
+            close(fd);
+        }
+    } while (parsed[i] != NULL && parsed[++i] != NULL);
+}
+
+// Empties 'len' bytes of a pipe into a descriptor with splice(), or through a buffer if it refuses
+int drainPipe(int pipeFd, int out, size_t len) {
+    static char* buffer = NULL;
+    while (len > 0) {
+        ssize_t n = splice(pipeFd, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && COPY_FALLBACK(errno)) {
+            if (buffer == NULL && (buffer = (char*)malloc(COPY_BUFFER_SIZE)) == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+            n = read(pipeFd, buffer, len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE);
+            for (ssize_t written = 0; n > 0 && written < n; ) {
+                ssize_t w = write(out, buffer + written, n - written);
+                if (w < 0 && errno != EINTR) {
+                    return -1;
+                }
+                written += w > 0 ? w : 0;
+            }
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+  Function: distributeStream
+
+  Description:
+  Copies everything readable from one descriptor to several others, for 'tee' and for the consumers
+  of a "|>" fan-out.
+
+  Parameters:
+  - in: The descriptor to read.
+  - outputs: The descriptors to write. An entry of -1 is skipped, and one that fails is set to -1.
+  - names: The names of the outputs, for error messages.
+  - count: The number of outputs.
+  - prefix: The start of error messages, such as "tee".
+
+  Returns:
+  0 on success, 1 if reading or an output failed (an error has been printed).
+
+  Notes:
+  1. Input is spliced into a private pipe one pipe-load at a time. tee() duplicates the load into a
+     second private pipe for every output but the last, which is then spliced to that output, and the
+     load itself is spliced to the last output. Only page references are copied, never the data.
+  2. An output that refuses splice() is written through a buffer by drainPipe(), and an input that
+     refuses it makes the whole copy go through read() and write().
+  3. A load is only dropped once every output has taken it, so the slowest output sets the pace and
+     the writer blocks on a full pipe instead of the data piling up in memory.
+  4. An output that fails is dropped and the others carry on. A closed pipe (EPIPE, with SIGPIPE
+     ignored) is a reader that has seen enough and is not reported. Once no output is left, the
+     copy stops.
+*/
+int distributeStream(int in, int* outputs, const char** names, int count, const char* prefix) {
+    int result = 0;
+    int load[2] = {-1, -1}, copy[2] = {-1, -1};
+    int spliced = pipe2(load, O_CLOEXEC) == 0 && pipe2(copy, O_CLOEXEC) == 0;
+    if (spliced) {
+        fcntl(load[1], F_SETPIPE_SZ, COPY_PIPE_SIZE);
+        fcntl(copy[1], F_SETPIPE_SZ, fcntl(load[1], F_GETPIPE_SZ));
+    }
+    char* buffer = NULL;
+    for (;;) {
+        ssize_t n;
+        if (spliced) {
+            n = splice(in, NULL, load[1], NULL, COPY_PIPE_SIZE, SPLICE_F_MOVE);
+            if (n < 0 && COPY_FALLBACK(errno)) {
+                spliced = 0;
+                continue;
+            }
+        } else {
+            if (buffer == NULL) {
+                buffer = (char*)arenaAlloc(&lineArena, COPY_BUFFER_SIZE);
+            }
+            n = read(in, buffer, COPY_BUFFER_SIZE);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                fprintf(stderr, "%s: input: %s\n", prefix, strerror(errno));
+                result = 1;
+            }
+            break;
+        }
+
+        int last = count - 1;
+        while (last >= 0 && outputs[last] < 0) {
+            last--;
+        }
+        for (int i = 0; i <= last; i++) {
+            if (outputs[i] < 0) {
+                continue;
+            }
+            int failed;
+            if (!spliced) {
+                failed = 0;
+                for (ssize_t written = 0; written < n && !failed; ) {
+                    ssize_t w = write(outputs[i], buffer + written, n - written);
+                    failed = w < 0 && errno != EINTR;
+                    written += w > 0 ? w : 0;
+                }
+            } else if (i == last) {
+                failed = drainPipe(load[0], outputs[i], n) < 0;
+            } else {
+                failed = tee(load[0], copy[1], n, 0) != n || drainPipe(copy[0], outputs[i], n) < 0;
+            }
+            if (failed) {
+                if (errno != EPIPE) {
+                    fprintf(stderr, "%s: %s: %s\n", prefix, names[i], strerror(errno));
+                    result = 1;
+                }
+                outputs[i] = -1;
+                if (spliced && i == last) {
+                    // What is left of the load went to every other output already: drop it with its pipe
+                    close(load[0]);
+                    close(load[1]);
+                    if (pipe2(load, O_CLOEXEC) < 0) {
+                        load[0] = load[1] = -1;
+                        spliced = 0;
+                    } else {
+                        fcntl(load[1], F_SETPIPE_SZ, fcntl(copy[1], F_GETPIPE_SZ));
+                    }
+                }
+            }
+        }
+        if (last < 0) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (load[i] >= 0) {
+            close(load[i]);
+        }
+        if (copy[i] >= 0) {
+            close(copy[i]);
+        }
+    }
+    return result;
+}
+
+/*
+  Function: teeCommand
+
+  Description:
+  Implements the 'tee' builtin: copies standard input to standard output and to files.
+
+  Parameters:
+  - parsed: "tee [-a] FILE...". With -a the files are appended to instead of truncated. With any
+    other option the command runs the external tee instead (teeAccepts()).
+
+  Returns:
+  Void. 'last_exit_status' is 0, or 1 if a file could not be opened or written (an error is printed).
+
+  Notes:
+  The copy is made by distributeStream(), which moves page references with splice() and tee() rather
+  than the data itself.
+*/
+void teeCommand(char** parsed) {
+    int append = parsed[1] != NULL && strcmp(parsed[1], "-a") == 0;
+    int first = 1 + append;
+    int count = 1;
+    last_exit_status = 0;
+    fflush(stdout);
+    while (parsed[first + count - 1] != NULL) {
+        count++;
+    }
+    int* outputs = (int*)arenaAlloc(&lineArena, count * sizeof(int));
+    const char** names = (const char**)arenaAlloc(&lineArena, count * sizeof(char*));
+    outputs[0] = STDOUT_FILENO;
+    names[0] = "standard output";
+    for (int i = 1; i < count; i++) {
+        names[i] = parsed[first + i - 1];
+        outputs[i] = open(names[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+        if (outputs[i] < 0) {
+            fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+            last_exit_status = 1;
+        }
+    }
+
+    last_exit_status |= distributeStream(STDIN_FILENO, outputs, names, count, "tee");
+    for (int i = 1; i < count; i++) {
+        if (outputs[i] >= 0) {
+            close(outputs[i]);
+        }
+    }
+}
+
+/*
+  Function: copyFile
+
+  Description:
+  Copies one file for the 'cp' builtin.
+
+  Parameters:
+  - source: The file to copy.
+  - target: The path of the copy, replaced if it exists.
+
+  Returns:
+  0 on success, or -1 if the copy failed (an error has been printed).
+
+  Notes:
+  The copy gets the permission bits of the source, and the data is moved with copyData(), so on file
+  systems with copy_file_range() support it never leaves the kernel.
+*/
+int copyFile(const char* source, const char* target) {
+    struct stat sourceStat, targetStat;
+    int in = open(source, O_RDONLY | O_CLOEXEC);
+    if (in < 0 || fstat(in, &sourceStat) < 0) {
+        fprintf(stderr, "cp: %s: %s\n", source, strerror(errno));
+        if (in >= 0) {
+            close(in);
+        }
+        return -1;
+    }
+    if (S_ISDIR(sourceStat.st_mode)) {
+        fprintf(stderr, "cp: %s: is a directory, not copied\n", source);
+        close(in);
+        return -1;
+    }
+    if (stat(target, &targetStat) == 0 && targetStat.st_dev == sourceStat.st_dev && targetStat.st_ino == sourceStat.st_ino) {
+        fprintf(stderr, "cp: %s and %s are the same file\n", source, target);
+        close(in);
+        return -1;
+    }
+
+    int out = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, sourceStat.st_mode & 07777);
+    int result = 0;
+    if (out < 0 || copyData(in, out) < 0) {
+        fprintf(stderr, "cp: %s: %s\n", out < 0 ? target : source, strerror(errno));
+        result = -1;
+    }
+    if (out >= 0 && close(out) < 0 && result == 0) {
+        fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+        result = -1;
+    }
+    close(in);
+    return result;
+}
+
+/*
+  Function: cpCommand
+
+  Description:
+  Implements the 'cp' builtin: copies files.
+
+  Parameters:
+  - parsed: "cp SOURCE TARGET", or "cp SOURCE... DIRECTORY" to copy into a directory under the same
+    names. With any option, such as -r or -p, the command runs the external cp instead (cpAccepts()).
+
+  Returns:
+  Void. 'last_exit_status' is 0, or 1 if a file could not be copied or on a usage error.
+
+  Notes:
+  Directories are not copied; "cp -r" goes to the external cp.
+*/
+void cpCommand(char** parsed) {
+    int count = 0;
+    while (parsed[count + 1] != NULL) {
+        count++;
+    }
+    last_exit_status = 1;
+    if (count < 2) {
+        fprintf(stderr, "Usage: cp source target, or cp source... directory\n");
+        return;
+    }
+
+    const char* target = parsed[count];
+    struct stat st;
+    int intoDir = stat(target, &st) == 0 && S_ISDIR(st.st_mode);
+    if (!intoDir && count > 2) {
+        fprintf(stderr, "cp: %s: not a directory\n", target);
+        return;
+    }
+    last_exit_status = 0;
+    for (int i = 1; i < count; i++) {
+        if (!intoDir) {
+            last_exit_status |= copyFile(parsed[i], target) < 0;
+            continue;
+        }
+        const char* base = strrchr(parsed[i], '/');
+        base = base ? base + 1 : parsed[i];
+        size_t len = strlen(target) + strlen(base) + 2;
+        char* path = (char*)arenaAlloc(&lineArena, len);
+        snprintf(path, len, "%s/%s", target, base);
+        last_exit_status |= copyFile(parsed[i], path) < 0;
+    }
+}
+
+// Every builtin. Lookups go through builtinIndex, built from this list by initBuiltins().
+const Builtin builtins[] = {
+    {"cd", changeDirectory},
+    {"hash", hashCommand},
+    {"prompt", promptCommand},
+    {"jobs", jobsCommand},
+    {"wait", waitCommand},
+    {"fg", fgCommand},
+    {"set", setEnvVar},
+    {"get", getEnvVar, 1},
+    {"unset", unsetEnvVar},
+    {"export", exportCommand},
+    {"echo", echoCommand, 1},
+    {"true", trueCommand, 1},
+    {"false", falseCommand, 1},
+    {"printf", printfCommand, 1},
+    {"test", testCommand, 1},
+    {"[", testCommand, 1},
+    {"pwd", pwdCommand, 1},
+    {"exit", exitCommand},
+    {"dump", dumpCommand},
+    {"batch", batchCommand},
+    {"history", historyCommand, 1},
+    {"cat", catCommand, 0, catAccepts},
+    {"tee", teeCommand, 0, teeAccepts},
+    {"cp", cpCommand, 0, cpAccepts},
+};
+
+// Perfect hash of the builtin names: index into builtins[] plus one, 0 for an empty slot
+unsigned char builtinIndex[BUILTIN_TABLE_SIZE];
+
+/*
+  Function: builtinHash
+
+  Description:
+  Hashes a command name from its length and its first and last characters.
+
+  Parameters:
+  - name: The command name.
+
+  Returns:
+  A slot of builtinIndex.
+
+  Notes:
+  The weights were chosen so that no two builtin names share a slot, which initBuiltins() checks.
+  Looking a name up therefore costs one hash and at most one strcmp(), whether or not it is a builtin.
+*/
+unsigned int builtinHash(const char* name) {
+    size_t len = strlen(name);
+    if (len == 0) {
+        return 0;
+    }
+    return (len + 2 * (unsigned char)name[0] + 4 * (unsigned char)name[len - 1]) & (BUILTIN_TABLE_SIZE - 1);
+}
+
+/*
+  Function: initBuiltins
+
+  Description:
+  Fills builtinIndex from the builtins[] list.
+
+  Parameters: None
+
+  Returns: None
+
+  Notes:
+  Two names sharing a slot mean builtinHash() is no longer perfect for the list. That is a
+  programming error, so it is reported and the shell exits.
+*/
+void initBuiltins() {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        unsigned int slot = builtinHash(builtins[i].name);
+        if (builtinIndex[slot] != 0) {
+            fprintf(stderr, "Builtins \"%s\" and \"%s\" share a hash slot\n",
+                    builtins[builtinIndex[slot] - 1].name, builtins[i].name);
+            exit(EXIT_FAILURE);
+        }
+        builtinIndex[slot] = i + 1;
+    }
+}
+
+/*
+  Function: findBuiltin
+
+  Description:
+  Looks a command name up in the builtin table.
+
+  Parameters:
+  - name: The command name.
+
+  Returns:
+  The builtin, or NULL if the name is not a builtin.
+*/
+const Builtin* findBuiltin(const char* name) {
+    unsigned char index = builtinIndex[builtinHash(name)];
+    if (index == 0 || strcmp(builtins[index - 1].name, name) != 0) {
+        return NULL;
+    }
+    return &builtins[index - 1];
+}
+
+// Returns the builtin that runs a command, or NULL if it is not a builtin or the builtin leaves these
+// arguments to the external program of the same name
+const Builtin* builtinFor(char** parsed) {
+    const Builtin* builtin = findBuiltin(parsed[0]);
+    return builtin != NULL && builtin->accepts != NULL && !builtin->accepts(parsed) ? NULL : builtin;
+}
+
+/*
+  Function: execBuiltin
+
+  Description:
+  Runs a command inside the shell if it is a builtin.
+
+  Parameters:
+  - parsed: An array of strings representing the command and its arguments.
+
+  Returns:
+  1 if the command was a builtin and has been run, 0 otherwise, including for a builtin that leaves
+  its arguments to the external program (see builtinFor()), which the caller then starts.
+
+  Notes:
+  - "<" and ">" redirections are applied by saving the shell's standard input and output with
+    F_DUPFD_CLOEXEC, duplicating the files over them for the duration of the call, and restoring them.
+    If they cannot be saved (EMFILE), the builtin is not run and 'last_exit_status' is 1, so the
+    shell's own descriptors are never left redirected.
+  - stdout is flushed before and after, so buffered output ends up where it was written to.
+  - The exit code is stored in 'last_exit_status' and in the pipestatus array.
+*/
+int execBuiltin(char** parsed) {
+    const Builtin* builtin = builtinFor(parsed);
+    if (builtin == NULL) {
+        return 0;
+    }
+
+    int inFd, outFd;
+    int savedIn = -1, savedOut = -1;
+    if (openRedirections(parsed, &inFd, &outFd) < 0) {
+        last_exit_status = 1;
+        return 1;
+    }
+    // Save what gets replaced first: without a copy, a redirection could not be undone
+    if ((inFd != -1 && (savedIn = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10)) < 0) ||
+        (outFd != -1 && (savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10)) < 0)) {
+        perror("Could not save the shell's standard input or output");
+        int fds[] = {inFd, outFd, savedIn, savedOut};
+        for (int i = 0; i < 4; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+        last_exit_status = 1;
+        return 1;
+    }
+    if (inFd != -1) {
+        dup2(inFd, STDIN_FILENO);
+        close(inFd);
+    }
+    if (outFd != -1) {
+        fflush(stdout);
+        dup2(outFd, STDOUT_FILENO);
+        close(outFd);
+    }
+
+    traceEvent('B', "builtin", parsed[0]);
+    builtin->run(parsed);
+    traceEvent('E', "builtin", NULL);
+    checkBuiltinOutput(parsed[0]);
+
+    if (savedOut != -1) {
+        dup2(savedOut, STDOUT_FILENO);
+        close(savedOut);
+    }
+    if (savedIn != -1) {
+        dup2(savedIn, STDIN_FILENO);
+        close(savedIn);
+    }
+    setPipeStatus(1);
+    pipe_status[0] = last_exit_status;
+    return 1;
+}
+
+/*
+  Function: scanPathDir
+
+  Description:
+  Lists the executables in one PATH directory.
+
+  Parameters:
+  - dir: The directory. Its previous names are freed and replaced.
+
+  Returns: None
+
+  Notes:
+  The names are read with readGlobDir(), in one or two getdents64() calls, and each is checked with
+  faccessat(X_OK) relative to the directory, so a directory of thousands of programs is listed in a few
+  milliseconds. This only happens when the directory changed.
+*/
+void scanPathDir(PathDir* dir) {
+    for (size_t i = 0; i < dir->count; i++) {
+        free(dir->names[i]);
+    }
+    free(dir->names);
+    dir->names = NULL;
+    dir->count = 0;
+
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/", dir->path);
+    int dirFd = open(dir->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0 || len >= (int)sizeof(path)) {
+        if (dirFd >= 0) {
+            close(dirFd);
+        }
+        return;
+    }
+    GlobDir* listing = readGlobDir(path, len);
+    dir->names = (char**)malloc((listing->count + 1) * sizeof(char*));
+    if (!dir->names) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < listing->count; i++) {
+        struct stat st;
+        if (listing->types[i] == DT_DIR || faccessat(dirFd, listing->names[i], X_OK, 0) != 0 ||
+            (listing->types[i] != DT_REG && (fstatat(dirFd, listing->names[i], &st, 0) != 0 || !S_ISREG(st.st_mode)))) {
+            continue;
+        }
+        if ((dir->names[dir->count] = strdup(listing->names[i])) == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        dir->count++;
+    }
+    close(dirFd);
+    clearGlobCache();
+}
+
+/*
+  Function: refreshExecIndex
+
+  Description:
+  Brings the sorted index of the executables on PATH up to date.
+
+  Parameters: None
+
+  Returns: None
+
+  Notes:
+  - Each PATH directory keeps the modification time it had when it was listed. A refresh costs one
+    stat() per directory, and only a directory whose time changed, because a program was installed or
+    removed, is listed again.
+  - When PATH itself changes, directories still on it keep their listings.
+  - The index is only merged and sorted again when a directory was listed again.
+*/
+void refreshExecIndex() {
+    const char* currentPath = searchInHashTable("PATH");
+    if (currentPath == NULL) {
+        currentPath = DEFAULT_PATH;
+    }
+    int changed = 0;
+
+    if (execIndex.key == NULL || strcmp(execIndex.key, currentPath) != 0) {
+        PathDir* old = execIndex.dirs;
+        size_t oldCount = execIndex.ndirs;
+        size_t count = 1;
+        for (const char* c = currentPath; *c != '\0'; c++) {
+            count += *c == ':';
+        }
+        execIndex.dirs = (PathDir*)calloc(count, sizeof(PathDir));
+        if (!execIndex.dirs) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        execIndex.ndirs = 0;
+        for (const char* start = currentPath; ; ) {
+            const char* end = strchrnul(start, ':');
+            size_t len = end - start;
+            PathDir* dir = &execIndex.dirs[execIndex.ndirs];
+            for (size_t i = 0; len > 0 && i < oldCount && dir->path == NULL; i++) {
+                if (old[i].path != NULL && strlen(old[i].path) == len && memcmp(old[i].path, start, len) == 0) {
+                    *dir = old[i]; // Still on PATH: keep its listing
+                    old[i].path = NULL;
+                }
+            }
+            if (len > 0 && dir->path == NULL) {
+                dir->path = strndup(start, len);
+            }
+            execIndex.ndirs += len > 0;
+            if (*end == '\0') {
+                break;
+            }
+            start = end + 1;
+        }
+        for (size_t i = 0; i < oldCount; i++) {
+            if (old[i].path != NULL) {
+                for (size_t j = 0; j < old[i].count; j++) {
+                    free(old[i].names[j]);
+                }
+                free(old[i].names);
+                free(old[i].path);
+            }
+        }
+        free(old);
+        free(execIndex.key);
+        execIndex.key = strdup(currentPath);
+        changed = 1;
+    }
+
+    for (size_t i = 0; i < execIndex.ndirs; i++) {
+        PathDir* dir = &execIndex.dirs[i];
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(dir->path, &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        if (!dir->scanned || mtime.tv_sec != dir->mtime.tv_sec || mtime.tv_nsec != dir->mtime.tv_nsec) {
+            dir->mtime = mtime;
+            dir->scanned = 1;
+            scanPathDir(dir);
+            changed = 1;
+        }
+    }
+    if (!changed) {
+        return;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < execIndex.ndirs; i++) {
+        total += execIndex.dirs[i].count;
+    }
+    free(execIndex.names);
+    execIndex.names = (char**)malloc((total + 1) * sizeof(char*));
+    if (!execIndex.names) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    execIndex.count = 0;
+    for (size_t i = 0; i < execIndex.ndirs; i++) {
+        memcpy(execIndex.names + execIndex.count, execIndex.dirs[i].names, execIndex.dirs[i].count * sizeof(char*));
+        execIndex.count += execIndex.dirs[i].count;
+    }
+    qsort(execIndex.names, execIndex.count, sizeof(char*), compareMatches);
+    size_t unique = 0;
+    for (size_t i = 0; i < execIndex.count; i++) {
+        if (unique == 0 || strcmp(execIndex.names[unique - 1], execIndex.names[i]) != 0) {
+            execIndex.names[unique++] = execIndex.names[i];
+        }
+    }
+    execIndex.count = unique;
+}
+
+// Adds a completion candidate
+void addCompletion(const char* name, unsigned char type) {
+    completions = (Completion*)growScratch(completions, &completionCap, completionCount, sizeof(Completion));
+    completions[completionCount].name = name;
+    completions[completionCount++].type = type;
+}
+
+// Orders completion candidates by name
+int compareCompletions(const void* a, const void* b) {
+    return strcmp(((const Completion*)a)->name, ((const Completion*)b)->name);
+}
+
+/*
+  Function: completeCommand
+
+  Description:
+  Finds the builtins and the executables on PATH whose names start with a prefix.
+
+  Parameters:
+  - prefix: The start of the command name.
+  - len: Its length.
+
+  Returns:
+  The number of candidates, sorted and without duplicates, in 'completions'.
+
+  Notes:
+  The index is refreshed with refreshExecIndex(), which only stats the PATH directories unless one
+  changed, and the names are found by binary search, so a completion takes microseconds with tens
+  of thousands of programs on PATH.
+*/
+size_t completeCommand(const char* prefix, size_t len) {
+    refreshExecIndex();
+    completionCount = 0;
+
+    size_t low = 0, high = execIndex.count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (strncmp(execIndex.names[mid], prefix, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (size_t i = low; i < execIndex.count && strncmp(execIndex.names[i], prefix, len) == 0; i++) {
+        addCompletion(execIndex.names[i], DT_REG);
+    }
+    size_t fromPath = completionCount;
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strncmp(builtins[i].name, prefix, len) == 0) {
+            addCompletion(builtins[i].name, DT_REG);
+        }
+    }
+    if (completionCount > fromPath) {
+        qsort(completions, completionCount, sizeof(Completion), compareCompletions);
+        size_t unique = 0;
+        for (size_t i = 0; i < completionCount; i++) {
+            if (unique == 0 || strcmp(completions[unique - 1].name, completions[i].name) != 0) {
+                completions[unique++] = completions[i];
+            }
+        }
+        completionCount = unique;
+    }
+    return completionCount;
+}
+
+/*
+  Function: completeFile
+
+  Description:
+  Finds the files whose paths start with a partial path.
+
+  Parameters:
+  - word: The partial path, such as "src/ma". Everything up to its last '/' is the directory.
+  - len: Its length.
+
+  Returns:
+  The number of candidates, sorted, in 'completions'. Each is a name within the directory.
+
+  Notes:
+  - The directory is read again with readGlobDir() on every call, so new files show up. The
+    candidates point into its listing, which stays until the next command runs.
+  - Hidden files are only offered when the name typed so far starts with '.'.
+*/
+size_t completeFile(const char* word, size_t len) {
+    const char* slash = memrchr(word, '/', len);
+    size_t dirLen = slash ? slash + 1 - word : 0;
+    const char* name = word + dirLen;
+    size_t nameLen = len - dirLen;
+    completionCount = 0;
+    clearGlobCache();
+
+    char dir[PATH_MAX];
+    if (dirLen >= sizeof(dir)) {
+        return 0;
+    }
+    memcpy(dir, word, dirLen);
+    dir[dirLen] = '\0';
+    GlobDir* listing = readGlobDir(dir, dirLen);
+    for (size_t i = 0; i < listing->count; i++) {
+        const char* candidate = listing->names[i];
+        if (strncmp(candidate, name, nameLen) == 0 && (candidate[0] != '.' || name[0] == '.')) {
+            addCompletion(candidate, listing->types[i]);
+        }
+    }
+    qsort(completions, completionCount, sizeof(Completion), compareCompletions);
+    return completionCount;
+}
+
+// Appends bytes to the editor's output buffer, written to the terminal in one write()
+void editorOutput(const char* text, size_t len) {
+    if (editor.outLen + len > editor.outCap) {
+        size_t cap = editor.outCap ? editor.outCap : 256;
+        while (editor.outLen + len > cap) {
+            cap *= 2;
+        }
+        char* grown = (char*)realloc(editor.out, cap);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        editor.out = grown;
+        editor.outCap = cap;
+    }
+    memcpy(editor.out + editor.outLen, text, len);
+    editor.outLen += len;
+}
+
+// Writes the editor's output buffer to the terminal
+void editorFlush() {
+    size_t written = 0;
+    while (written < editor.outLen) {
+        ssize_t n = write(STDOUT_FILENO, editor.out + written, editor.outLen - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    editor.outLen = 0;
+}
+
+// Returns the number of columns the prompt takes, skipping escape sequences and UTF-8 continuation bytes
+size_t promptWidth(const char* prompt) {
+    size_t width = 0;
+    for (const char* c = prompt; *c != '\0'; c++) {
+        if (*c == '\x1b' && c[1] == '[') {
+            c += 2;
+            while (*c != '\0' && !isalpha((unsigned char)*c)) {
+                c++;
+            }
+            if (*c == '\0') {
+                break;
+            }
+        } else if (((unsigned char)*c & 0xc0) != 0x80) {
+            width++;
+        }
+    }
+    return width;
+}
+
+/*
+  Function: refreshLine
+
+  Description:
+  Redraws the prompt and the line being edited, and puts the cursor back in place.
+
+  Parameters: None
+
+  Returns: None
+
+  Notes:
+  A line wider than the terminal scrolls sideways so the cursor stays visible. The whole redraw goes
+  out in one write().
+*/
+void refreshLine() {
+    struct winsize size;
+    size_t columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    const char* prompt = promptCache.rendered ? promptCache.rendered : "";
+    size_t width = promptWidth(prompt);
+    size_t room = columns > width + 1 ? columns - width - 1 : 1;
+    size_t start = editor.pos > room ? editor.pos - room : 0;
+    size_t shown = editor.len - start < room ? editor.len - start : room;
+
+    editorOutput("\r", 1);
+    editorOutput(prompt, strlen(prompt));
+    editorOutput(editor.buf + start, shown);
+    editorOutput("\x1b[0K\r", 5);
+    if (width + editor.pos - start > 0) {
+        char move[32];
+        editorOutput(move, snprintf(move, sizeof(move), "\x1b[%zuC", width + editor.pos - start));
+    }
+    editorFlush();
+}
+
+// Inserts text at the cursor and moves the cursor after it
+void editorInsert(const char* text, size_t len) {
+    if (editor.len + len + 1 > editor.cap) {
+        size_t cap = editor.cap ? editor.cap : 256;
+        while (editor.len + len + 1 > cap) {
+            cap *= 2;
+        }
+        char* grown = (char*)realloc(editor.buf, cap);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        editor.buf = grown;
+        editor.cap = cap;
+    }
+    memmove(editor.buf + editor.pos + len, editor.buf + editor.pos, editor.len - editor.pos);
+    memcpy(editor.buf + editor.pos, text, len);
+    editor.len += len;
+    editor.pos += len;
+}
+
+// Deletes the characters from 'from' to 'to' and leaves the cursor at 'from'
+void editorDelete(size_t from, size_t to) {
+    memmove(editor.buf + from, editor.buf + to, editor.len - to);
+    editor.len -= to - from;
+    editor.pos = from;
+}
+
+// Replaces the whole line, with the cursor at its end
+void editorReplace(const char* text, size_t len) {
+    editor.len = 0;
+    editor.pos = 0;
+    editorInsert(text, len);
+}
+
+// Returns the next byte typed, waiting for it while background jobs keep being captured, or -1 at end of input
+int readKey() {
+    while (editor.inputPos == editor.inputLen) {
+        waitForInput();
+        ssize_t n = read(STDIN_FILENO, editor.input, sizeof(editor.input));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        editor.inputLen = n;
+        editor.inputPos = 0;
+    }
+    return (unsigned char)editor.input[editor.inputPos++];
+}
+
+// Inserts a completed name, escaping the characters the parser would otherwise treat specially
+void insertCompletion(const char* text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (strchr(" \t\"\\$,;|#*?[", text[i]) != NULL) {
+            editorInsert("\\", 1);
+        }
+        editorInsert(text + i, 1);
+    }
+}
+
+// Prints completion candidates in columns below the line, then redraws the line
+void listCompletions(size_t count) {
+    struct winsize size;
+    size_t columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    size_t shown = count < LINE_LIST_MAX ? count : LINE_LIST_MAX;
+    size_t width = 0;
+    for (size_t i = 0; i < shown; i++) {
+        size_t len = strlen(completions[i].name);
+        width = len > width ? len : width;
+    }
+    width += 2;
+    size_t perRow = columns / width ? columns / width : 1;
+
+    editorOutput("\r\n", 2);
+    for (size_t i = 0; i < shown; i++) {
+        size_t len = strlen(completions[i].name);
+        editorOutput(completions[i].name, len);
+        if ((i + 1) % perRow == 0 || i + 1 == shown) {
+            editorOutput("\r\n", 2);
+        } else {
+            editorOutput("                                ", width - len < 32 ? width - len : 32);
+        }
+    }
+    if (count > shown) {
+        char more[64];
+        editorOutput(more, snprintf(more, sizeof(more), "... and %zu more\r\n", count - shown));
+    }
+    editorFlush();
+}
+
+/*
+  Function: completeLine
+
+  Description:
+  Completes the word before the cursor, as Tab does.
+
+  Parameters: None
+
+  Returns: None
+
+  Notes:
+  - The first word of a command, with no '/', is completed from the builtins and the executables on
+    PATH with completeCommand(). Other words are completed as paths with completeFile().
+  - The word is extended as far as all candidates agree. A single candidate also gets a ' ', or a
+    '/' if it is a directory. When the candidates do not agree on anything more, a second Tab lists them.
+*/
+void completeLine() {
+    size_t start = editor.pos;
+    while (start > 0 && (strchr(" \t|,;", editor.buf[start - 1]) == NULL ||
+                         (start > 1 && editor.buf[start - 2] == '\\'))) {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && (editor.buf[before - 1] == ' ' || editor.buf[before - 1] == '\t')) {
+        before--;
+    }
+    int command = before == 0 || strchr("|,;{", editor.buf[before - 1]) != NULL;
+
+    // The word as the parser will see it, without its backslashes
+    char word[PATH_MAX];
+    size_t len = 0;
+    for (size_t i = start; i < editor.pos && len < sizeof(word) - 1; i++) {
+        if (editor.buf[i] == '\\' && i + 1 < editor.pos) {
+            i++;
+        }
+        word[len++] = editor.buf[i];
+    }
+    word[len] = '\0';
+
+    size_t count;
+    size_t nameStart = 0;
+    if (command && memchr(word, '/', len) == NULL) {
+        count = completeCommand(word, len);
+    } else {
+        const char* slash = memrchr(word, '/', len);
+        nameStart = slash ? slash + 1 - word : 0;
+        count = completeFile(word, len);
+    }
+    if (count == 0) {
+        editorOutput("\a", 1);
+        editorFlush();
+        return;
+    }
+
+    size_t typed = len - nameStart;
+    size_t common = strlen(completions[0].name);
+    for (size_t i = 1; i < count && common > typed; i++) {
+        size_t j = typed;
+        while (j < common && completions[i].name[j] == completions[0].name[j]) {
+            j++;
+        }
+        common = j;
+    }
+    insertCompletion(completions[0].name + typed, common - typed);
+
+    if (count == 1) {
+        unsigned char type = completions[0].type;
+        if (type == DT_LNK || type == DT_UNKNOWN) {
+            struct stat st;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%.*s%s", (int)nameStart, word, completions[0].name);
+            type = stat(path, &st) == 0 && S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+        editorInsert(type == DT_DIR ? "/" : " ", 1);
+    } else if (common == typed) {
+        if (editor.lastTab) {
+            listCompletions(count);
+        } else {
+            editorOutput("\a", 1);
+        }
+    }
+    refreshLine();
+}
+
+/*
+  Function: searchLine
+
+  Description:
+  Runs an incremental reverse search of the history, as Ctrl-R does.
+
+  Parameters: None
+
+  Returns:
+  1 if the search ended with Enter, so the line is to be run, 0 otherwise.
+
+  Notes:
+  - Each character typed narrows the search, which goes through the trigram index of searchHistory().
+    Ctrl-R again finds the next older match, and Backspace widens the search again.
+  - Enter runs the match, Ctrl-G or Ctrl-C restores the line as it was, and any other key leaves the
+    match in the line for editing.
+*/
+int searchLine() {
+    char query[256];
+    size_t queryLen = 0;
+    long match = -1;
+    loadHistory();
+
+    for (;;) {
+        const char* found = match >= 0 ? history.entries[match].text : "";
+        size_t foundLen = match >= 0 ? history.entries[match].len : 0;
+        editorOutput("\r(reverse-i-search)`", 20);
+        editorOutput(query, queryLen);
+        editorOutput("': ", 3);
+        editorOutput(found, foundLen);
+        editorOutput("\x1b[0K", 4);
+        editorFlush();
+
+        int key = readKey();
+        if (key == 18) { // Ctrl-R: the next older match
+            long older = match > 0 ? searchHistory(query, queryLen, match) : -1;
+            match = older >= 0 ? older : match;
+            continue;
+        }
+        if ((key == 127 || key == 8) && queryLen > 0) {
+            queryLen--;
+        } else if (key >= 32 && key != 127 && queryLen < sizeof(query)) {
+            query[queryLen++] = key;
+        } else {
+            if (key == 7 || key == 3 || key == -1) {
+                refreshLine();
+                return 0;
+            }
+            if (match >= 0) {
+                editorReplace(history.entries[match].text, history.entries[match].len);
+            }
+            refreshLine();
+            return key == '\r' || key == '\n';
+        }
+        match = queryLen > 0 ? searchHistory(query, queryLen, history.count) : -1;
+    }
+}
+
+// Shows a history entry while browsing with Up and Down, keeping the line being typed in 'draft'
+void browseHistory(int older) {
+    loadHistory();
+    if (editor.browse == (size_t)-1) {
+        if (!older || history.count == 0) {
+            return;
+        }
+        editor.draftLen = 0;
+        if (editor.len + 1 > editor.draftCap) {
+            editor.draftCap = editor.len + 1;
+            if ((editor.draft = (char*)realloc(editor.draft, editor.draftCap)) == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(editor.draft, editor.buf, editor.len);
+        editor.draftLen = editor.len;
+        editor.browse = history.count;
+    }
+    if (older && editor.browse > 0) {
+        editor.browse--;
+    } else if (!older) {
+        editor.browse++;
+    }
+    if (editor.browse >= history.count) {
+        editor.browse = (size_t)-1;
+        editorReplace(editor.draft, editor.draftLen);
+    } else {
+        editorReplace(history.entries[editor.browse].text, history.entries[editor.browse].len);
+    }
+}
+
+/*
+  Function: editLine
+
+  Description:
+  Reads a line from the terminal with line editing, after printPrompt() has printed the prompt.
+
+  Parameters: None
+
+  Returns:
+  The line, without its newline, in a buffer reused by the next call. NULL at end of input.
+  "" if the line was cancelled with Ctrl-C.
+
+  Notes:
+  - The terminal is in raw mode only while the line is edited, so commands run with the normal settings.
+  - Keys: Left/Right, Home/End (Ctrl-A/Ctrl-E), Backspace, Delete, Ctrl-K/Ctrl-U/Ctrl-W to cut to the end,
+    to the start or the word before the cursor, Up/Down to browse the history, Ctrl-R to search it,
+    Tab to complete, Ctrl-L to clear the screen, Ctrl-D at the start of an empty line to exit.
+  - Bytes typed ahead are kept for the next line.
+*/
+char* editLine() {
+    struct termios raw;
+    if (tcgetattr(STDIN_FILENO, &editor.saved) < 0) {
+        return NULL;
+    }
+    raw = editor.saved;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    editor.len = 0;
+    editor.pos = 0;
+    editor.browse = (size_t)-1;
+    editor.lastTab = 0;
+    editorInsert("", 0); // Makes sure the buffer exists
+    int done = 0;
+    int eof = 0;
+
+    while (!done) {
+        int key = readKey();
+        int tab = 0;
+        switch (key) {
+        case -1:
+            eof = 1;
+            done = 1;
+            break;
+        case '\r':
+        case '\n':
+            done = 1;
+            break;
+        case 4: // Ctrl-D
+            if (editor.len == 0) {
+                eof = 1;
+                done = 1;
+            } else if (editor.pos < editor.len) {
+                editorDelete(editor.pos, editor.pos + 1);
+            }
+            break;
+        case 3: // Ctrl-C
+            editorOutput("^C", 2);
+            editor.len = 0;
+            editor.pos = 0;
+            done = 1;
+            break;
+        case 9: // Tab
+            completeLine();
+            tab = 1;
+            break;
+        case 18: // Ctrl-R
+            done = searchLine();
+            break;
+        case 127:
+        case 8: // Backspace
+            if (editor.pos > 0) {
+                editorDelete(editor.pos - 1, editor.pos);
+            }
+            break;
+        case 1: // Ctrl-A
+            editor.pos = 0;
+            break;
+        case 5: // Ctrl-E
+            editor.pos = editor.len;
+            break;
+        case 2: // Ctrl-B
+            editor.pos -= editor.pos > 0;
+            break;
+        case 6: // Ctrl-F
+            editor.pos += editor.pos < editor.len;
+            break;
+        case 11: // Ctrl-K
+            editor.len = editor.pos;
+            break;
+        case 21: // Ctrl-U
+            editorDelete(0, editor.pos);
+            break;
+        case 23: { // Ctrl-W
+            size_t start = editor.pos;
+            while (start > 0 && editor.buf[start - 1] == ' ') {
+                start--;
+            }
+            while (start > 0 && editor.buf[start - 1] != ' ') {
+                start--;
+            }
+            editorDelete(start, editor.pos);
+            break;
+        }
+        case 12: // Ctrl-L
+            editorOutput("\x1b[H\x1b[2J", 7);
+            break;
+        case 16: // Ctrl-P
+            browseHistory(1);
+            break;
+        case 14: // Ctrl-N
+            browseHistory(0);
+            break;
+        case 27: { // Escape sequences of the arrow and editing keys
+            int first = readKey();
+            int second = readKey();
+            if (first == '[' && second >= '0' && second <= '9') {
+                int end = readKey();
+                if (end == '~' && (second == '1' || second == '7')) {
+                    editor.pos = 0;
+                } else if (end == '~' && (second == '4' || second == '8')) {
+                    editor.pos = editor.len;
+                } else if (end == '~' && second == '3' && editor.pos < editor.len) {
+                    editorDelete(editor.pos, editor.pos + 1);
+                }
+            } else if (first == '[' || first == 'O') {
+                switch (second) {
+                case 'A': browseHistory(1); break;
+                case 'B': browseHistory(0); break;
+                case 'C': editor.pos += editor.pos < editor.len; break;
+                case 'D': editor.pos -= editor.pos > 0; break;
+                case 'H': editor.pos = 0; break;
+                case 'F': editor.pos = editor.len; break;
+                }
+            }
+            break;
+        }
+        default:
+            if (key >= 32) {
+                char c = key;
+                editorInsert(&c, 1);
+            }
+            break;
+        }
+        editor.lastTab = tab;
+        if (!done && key != 9) {
+            refreshLine();
+        }
+    }
+
+    editorFlush();
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.saved);
+    if (write(STDOUT_FILENO, "\n", 1) < 0 || eof) {
+        return NULL;
+    }
+    editor.buf[editor.len] = '\0';
+    return editor.buf;
+}
+
+/*
+  Function: execParallel
+
+  Description:
+  Executes commands separated by "&&&" concurrently, with at most 'parallel_limit' of them running at once.
+
+  Parameters:
+  - command: The parsed command holding the "&&&"-separated pipelines.
+
+  Returns:
+  Void. Executes the commands.
+
+  Notes:
+  - Each command can be a pipeline. Its variables are expanded, and a builtin is run inside the shell,
+    when its turn comes.
+  - Commands are started in order. As soon as any running one finishes, the next one is started.
+  - waitChild(-1) is used to learn which command finished; a pid that belongs to a background job is
+    handed to the job table instead.
+  - The exit code of every command is stored in the pipestatus array. 'last_exit_status' is 0 if all
+    of them succeeded, otherwise the exit code of the first failing one in list order.
+*/
+void execParallel(const Command* command) {
+    int count = command->npipelines;
+    pid_t** pids = (pid_t**)arenaAlloc(&lineArena, count * sizeof(pid_t*));
+    int* stageCounts = (int*)arenaAlloc(&lineArena, count * sizeof(int));
+    int* running = (int*)arenaAlloc(&lineArena, count * sizeof(int));
+    int* exitCodes = (int*)arenaAlloc(&lineArena, count * sizeof(int));
+    int next = 0;
+    int inFlight = 0;
+
+    while (next < count || inFlight > 0) {
+        // Start commands until the worker limit is reached
+        while (next < count && inFlight < parallel_limit) {
+            int i = next++;
+            char*** stages = NULL;
+            int background = command->pipelines[i].background;
+            int stageCount = expandPipeline(&command->pipelines[i], &stages);
+
+            running[i] = 0;
+            exitCodes[i] = last_exit_status;
+            if (stageCount == 0 || (stageCount == 1 && execBuiltin(stages[0]))) {
+                exitCodes[i] = last_exit_status;
+            } else if (background) {
+                execArgsPiped(stages, stageCount, background);
+                exitCodes[i] = 0;
+            } else {
+                pids[i] = (pid_t*)arenaAlloc(&lineArena, stageCount * sizeof(pid_t));
+                stageCounts[i] = stageCount;
+                running[i] = startPipeline(stages, stageCount, pids[i], -1, -1, -1);
+                exitCodes[i] = EXIT_FAILURE; // Kept if the last stage could not be started
+                if (running[i] > 0) {
+                    inFlight++;
+                }
+            }
+        }
+        if (inFlight == 0) {
+            continue;
+        }
+
+        // Wait for any child and find the command it belongs to
+        int status;
+        pid_t pid = waitChild(-1, &status);
+        if (pid < 0) {
+            perror("waitpid");
+            break;
+        }
+        int owner = -1;
+        for (int i = 0; i < next && owner < 0; i++) {
+            for (int j = 0; running[i] > 0 && j < stageCounts[i]; j++) {
+                if (pids[i][j] == pid) {
+                    owner = i;
+                    if (j == stageCounts[i] - 1) {
+                        exitCodes[i] = statusToExitCode(status);
+                    }
+                    break;
+                }
+            }
+        }
+        if (owner < 0) {
+            reapPid(pid, status); // A background job finished meanwhile
+        } else if (--running[owner] == 0) {
+            inFlight--;
+        }
+    }
+
+    setPipeStatus(count);
+    last_exit_status = 0;
+    for (int i = 0; i < count; i++) {
+        pipe_status[i] = exitCodes[i];
+        if (last_exit_status == 0) {
+            last_exit_status = exitCodes[i];
+        }
+    }
+}
+
+/*
+  Function: reportUsage
+
+  Description:
+  Reports the time and resources used by a command, for the 'time' prefix and the timing log.
+
+  Parameters:
+  - out: The stream to write to.
+  - command: The command text, or NULL to print the human-readable 'time' report.
+  - start: The CLOCK_MONOTONIC time the command started at.
+  - selfStart: The shell's own resource usage when the command started.
+
+  Returns: None
+
+  Notes:
+  - User and system times include the shell's own work (builtins, launching) and every child waited for.
+  - The maximum RSS is the largest of any child, or the shell's own if the command ran no child.
+  - With a command, one tab-separated line is written: epoch seconds, real, user and system seconds,
+    max RSS in KB, voluntary and involuntary context switches, exit code and the command.
+*/
+void reportUsage(FILE* out, const char* command, struct timespec* start, struct rusage* selfStart) {
+    struct timespec end;
+    struct rusage self;
+    struct timeval user, sys;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self);
+
+    double real = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    timersub(&self.ru_utime, &selfStart->ru_utime, &user);
+    timersub(&self.ru_stime, &selfStart->ru_stime, &sys);
+    timeradd(&user, &child_usage.ru_utime, &user);
+    timeradd(&sys, &child_usage.ru_stime, &sys);
+    long maxrss = child_usage.ru_maxrss ? child_usage.ru_maxrss : self.ru_maxrss;
+    long nvcsw = child_usage.ru_nvcsw + (self.ru_nvcsw - selfStart->ru_nvcsw);
+    long nivcsw = child_usage.ru_nivcsw + (self.ru_nivcsw - selfStart->ru_nivcsw);
+
+    if (command == NULL) {
+        fprintf(out, "real\t%.3fs\nuser\t%ld.%03lds\nsys\t%ld.%03lds\nmaxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+                real, (long)user.tv_sec, (long)user.tv_usec / 1000, (long)sys.tv_sec, (long)sys.tv_usec / 1000,
+                maxrss, nvcsw, nivcsw);
+    } else {
+        fprintf(out, "%ld\t%.6f\t%ld.%06ld\t%ld.%06ld\t%ld\t%ld\t%ld\t%d\t%s\n",
+                (long)time(NULL), real, (long)user.tv_sec, (long)user.tv_usec, (long)sys.tv_sec, (long)sys.tv_usec,
+                maxrss, nvcsw, nivcsw, last_exit_status, command);
+    }
+}
+
+/*
+  Function: execCommand
+
+  Description:
+  Executes one command of a sequence: a builtin, a simple command, a pipeline, a "&&&" list or a loop.
+
+  Parameters:
+  - command: The parsed command.
+
+  Returns: None
+*/
+void execCommand(const Command* command) {
+    clearGlobCache(); // Listings read for earlier commands may be out of date
+    if (command->loop != NULL) {
+        execLoop(command->loop);
+        return;
+    }
+    if (command->npipelines > 1) {
+        execParallel(command);
+        return;
+    }
+    if (command->pipelines[0].nbranches > 0) {
+        execFanOut(&command->pipelines[0]);
+        return;
+    }
+
+    char*** stages = NULL;
+    int background = command->pipelines[0].background;
+    int count = expandPipeline(&command->pipelines[0], &stages);
+
+    if (count == 1) { // No pipe
+        if (!execBuiltin(stages[0])) {
+            execArgs(stages[0], background);
+        }
+    } else if (count > 1) { // Piped commands
+        execArgsPiped(stages, count, background);
+    }
+}
+
+/*
+  Function: execCommandSeq
+
+  Description:
+  Executes a sequence of parsed commands: those of a command line, separated by ',' in the source,
+  or the body of a loop.
+
+  Parameters:
+  - commands: The parsed commands.
+  - count: The number of commands.
+
+  Returns:
+  Void. Executes the sequence of commands.
+
+  Notes:
+  - Each command is run with execCommand().
+  - A command starting with the 'time' keyword is timed as a whole, pipelines, "&&&" lists and loops
+    included, and the report is printed on stderr.
+  - If a timing log is open (FLASH_TIMELOG), every command is also logged there.
+  - The usage of a timed command is added back to the enclosing one's, so timing a loop still counts
+    the children of the commands timed inside it.
+*/
+void execCommandSeq(const Command* commands, int count) {
+    for (int i = 0; i < count; i++) {
+        const Command* command = &commands[i];
+        traceEvent('B', "command", command->text);
+        if (!command->timed && time_log == NULL) {
+            execCommand(command);
+            traceEvent('E', "command", NULL);
+            continue;
+        }
+
+        struct timespec start;
+        struct rusage selfStart;
+        struct rusage outer = child_usage;
+        memset(&child_usage, 0, sizeof(child_usage));
+        getrusage(RUSAGE_SELF, &selfStart);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        execCommand(command);
+
+        if (command->timed) {
+            fflush(stdout);
+            reportUsage(stderr, NULL, &start, &selfStart);
+        }
+        if (time_log != NULL) {
+            reportUsage(time_log, command->text, &start, &selfStart);
+        }
+        struct rusage inner = child_usage;
+        child_usage = outer;
+        addUsage(&inner);
+        traceEvent('E', "command", NULL);
+    }
+}
+
+/*
+  Function: execLoop
+
+  Description:
+  Runs a "for" or "repeat" loop from its parsed body.
+
+  Parameters:
+  - loop: The parsed loop.
+
+  Returns:
+  Void. 'last_exit_status' is the exit code of the last command run, 0 if the body never ran, or 1
+  if the repeat count is not a number.
+
+  Notes:
+  - The words of a "for" loop and the count of a "repeat" loop are expanded once, before the first iteration.
+    The words are expanded with expandArguments(), so "for f in $(ls)" runs once per file.
+  - The loop variable is first set to the longest value, so its buffer in the variable table is
+    allocated once and every iteration updates it in place.
+  - Everything the body allocates from the line arena is released after each iteration, so memory
+    does not grow with the number of iterations.
+*/
+void execLoop(const Loop* loop) {
+    long long count;
+    char** values = NULL;
+
+    if (loop->var == NULL) {
+        char* text = expandWord(&loop->words[0]);
+        char* end;
+        errno = 0;
+        count = strtoll(text, &end, 10);
+        if (*text == '\0' || *end != '\0' || errno != 0 || count < 0) {
+            fprintf(stderr, "repeat: %s: expected a count\n", text);
+            last_exit_status = 1;
+            return;
+        }
+    } else {
+        size_t base = expandArgCount;
+        traceEvent('B', "expand", NULL);
+        for (int i = 0; i < loop->nwords; i++) {
+            expandArguments(&loop->words[i]);
+        }
+        traceEvent('E', "expand", NULL);
+        count = expandArgCount - base;
+        values = (char**)arenaAlloc(&lineArena, count * sizeof(char*));
+        memcpy(values, expandArgs + base, count * sizeof(char*));
+        expandArgCount = base;
+
+        int longest = 0;
+        size_t longestLength = 0;
+        for (int i = 0; i < count; i++) {
+            size_t length = strlen(values[i]);
+            if (length > longestLength) {
+                longest = i;
+                longestLength = length;
+            }
+        }
+        if (count > 0) {
+            insertIntoHashTable(loop->var, values[longest]);
+        }
+    }
+
+    last_exit_status = 0;
+    ArenaMark mark = arenaMark(&lineArena);
+    for (long long i = 0; i < count; i++) {
+        if (values != NULL) {
+            insertIntoHashTable(loop->var, values[i]);
+        }
+        execCommandSeq(loop->body, loop->nbody);
+        arenaRelease(&lineArena, mark);
+    }
+}
+
+/*
+  Function: appendExpansion
+
+  Description:
+  Appends characters to the expansion scratch buffer, growing it as needed.
+
+  Parameters:
+  - len: The current length of the text in the buffer.
+  - str: The characters to append.
+  - strLen: The number of characters to append.
+
+  Returns:
+  The new length of the text in the buffer.
+*/
+size_t appendExpansion(size_t len, const char* str, size_t strLen) {
+    if (len + strLen + 1 > expandBufferCap) {
+        size_t cap = expandBufferCap ? expandBufferCap : 256;
+        while (len + strLen + 1 > cap) {
+            cap *= 2;
+        }
+        char* grown = (char*)realloc(expandBuffer, cap);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        expandBuffer = grown;
+        expandBufferCap = cap;
+    }
+    memcpy(expandBuffer + len, str, strLen);
+    return len + strLen;
+}
+
+// Appends output written by a builtin run for "$(...)" to 'captureBuffer', doubling it in the line arena
+ssize_t captureWrite(void* cookie, const char* data, size_t len) {
+    CaptureBuffer* buffer = (CaptureBuffer*)cookie;
+    if (buffer->len + len > buffer->cap) {
+        size_t cap = buffer->cap ? buffer->cap : 256;
+        while (buffer->len + len > cap) {
+            cap *= 2;
+        }
+        char* grown = (char*)arenaAlloc(&lineArena, cap + 1);
+        memcpy(grown, buffer->data, buffer->len);
+        buffer->data = grown;
+        buffer->cap = cap;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return len;
+}
+
+/*
+  Function: readSubstitution
+
+  Description:
+  Reads everything from the read end of a pipe into 'substBuffer', doubling it as needed.
+
+  Parameters:
+  - fd: The read end. It is closed once the writers have exited.
+
+  Returns:
+  The number of bytes read.
+*/
+size_t readSubstitution(int fd) {
+    size_t len = 0;
+    for (;;) {
+        if (len == substBufferCap) {
+            size_t cap = substBufferCap ? substBufferCap * 2 : 4096;
+            char* grown = (char*)realloc(substBuffer, cap);
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+            substBuffer = grown;
+            substBufferCap = cap;
+        }
+        ssize_t n = read(fd, substBuffer + len, substBufferCap - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    return len;
+}
+
+/*
+  Function: substituteCommand
+
+  Description:
+  Runs the commands of a "$(...)" and returns what they wrote to standard output.
+
+  Parameters:
+  - part: The PART_COMMAND word part.
+  - len: Receives the length of the output.
+
+  Returns:
+  The output without its trailing newlines, null-terminated and allocated from the line arena.
+  'last_exit_status' is the exit code of the last command run.
+
+  Details:
+  1. A single builtin that only writes output ("pure" in the builtin table), without redirections,
+     runs in the shell with no fork and no pipe: stdout is pointed at a stream whose writes go
+     straight into a buffer in the line arena.
+  2. Any other single command or pipeline is started with startPipeline(), its last stage writing
+     into a pipe that the shell reads into a buffer grown geometrically and reused across calls.
+  3. Anything else (several commands, loops, "&&&" lists, fan-outs, background jobs) runs in a forked copy
+     of the shell, as does a builtin that is not pure, so that a "cd" or "set" inside "$(...)"
+     does not affect the shell itself.
+*/
+char* substituteCommand(const WordPart* part, size_t* len) {
+    const Command* command = part->commands;
+    char* output = NULL;
+    *len = 0;
+    fflush(stdout);
+
+    if (part->ncommands == 1 && command->loop == NULL && command->npipelines == 1 &&
+        !command->timed && !command->pipelines[0].background && command->pipelines[0].nbranches == 0) {
+        char*** stages;
+        int count = expandPipeline(&command->pipelines[0], &stages);
+        const Builtin* builtin = count == 1 ? findBuiltin(stages[0][0]) : NULL;
+        int redirected = 0;
+        for (int i = 0; builtin != NULL && stages[0][i] != NULL; i++) {
+            redirected |= strcmp(stages[0][i], "<") == 0 || strcmp(stages[0][i], ">") == 0;
+        }
+
+        if (count == 0) {
+            // Nothing to run
+        } else if (builtin != NULL && builtin->pure && !redirected) {
+            if (captureStream == NULL) {
+                cookie_io_functions_t io = {NULL, captureWrite, NULL, NULL};
+                captureStream = fopencookie(&captureBuffer, "w", io);
+            }
+            if (captureStream != NULL) {
+                FILE* saved = stdout;
+                memset(&captureBuffer, 0, sizeof(captureBuffer));
+                stdout = captureStream;
+                builtin->run(stages[0]);
+                fflush(captureStream);
+                stdout = saved;
+                output = captureBuffer.data;
+                *len = captureBuffer.len;
+            }
+        } else {
+            int fds[2];
+            if (pipe2(fds, O_CLOEXEC) < 0) {
+                perror("pipe");
+                last_exit_status = 1;
+                return "";
+            }
+            pid_t* pids = (pid_t*)arenaAlloc(&lineArena, count * sizeof(pid_t));
+            startPipeline(stages, count, pids, -1, fds[1], -1);
+            close(fds[1]);
+            *len = readSubstitution(fds[0]);
+            output = substBuffer;
+            for (int i = 0; i < count; i++) {
+                int status = EXIT_FAILURE << 8;
+                if (pids[i] != -1) {
+                    waitChild(pids[i], &status);
+                }
+                last_exit_status = statusToExitCode(status);
+            }
+        }
+    } else {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            last_exit_status = 1;
+            return "";
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            printf("Failed to fork child\n");
+            close(fds[0]);
+            close(fds[1]);
+            last_exit_status = 1;
+            return "";
+        } else if (pid == 0) {
+            dup2(fds[1], STDOUT_FILENO);
+            if (event_fd != -1) {
+                close(event_fd); // Leave the capture pipes to the shell
+                event_fd = -1;
+            }
+            capture_count = 0;
+            traceChild();
+            execCommandSeq(part->commands, part->ncommands);
+            fflush(stdout);
+            flushTrace();
+            _exit(last_exit_status);
+        }
+        close(fds[1]);
+        *len = readSubstitution(fds[0]);
+        output = substBuffer;
+        int status;
+        if (waitChild(pid, &status) < 0) {
+            status = EXIT_FAILURE << 8;
+        }
+        last_exit_status = statusToExitCode(status);
+    }
+
+    while (*len > 0 && output[*len - 1] == '\n') {
+        (*len)--;
+    }
+    return arenaStrndup(&lineArena, *len ? output : "", *len);
+}
+
+/*
+  Function: clearGlobCache
+
+  Description:
+  Drops every cached directory listing and the memory holding them.
+
+  Parameters: None
+
+  Returns: None
+
+  Notes:
+  Called before every command and after every line: a command may create or remove files, so
+  listings are only shared by the patterns expanded between two commands.
+*/
+void clearGlobCache() {
+    if (glob_cache_entries == 0) {
+        return;
+    }
+    memset(globCache, 0, sizeof(globCache));
+    glob_cache_entries = 0;
+    arenaReset(&globArena);
+}
+
+/*
+  Function: readGlobDir
+
+  Description:
+  Returns the names in a directory, from the cache or read with getdents64().
+
+  Parameters:
+  - path: The directory, "" for the working directory. When it is not empty it ends with '/'.
+  - len: The length of the path.
+
+  Returns:
+  The listing, which stays valid until the next clearGlobCache().
+
+  Notes:
+  - The directory is read with getdents64() into a GLOB_READ_SIZE buffer, so even a directory with
+    hundreds of thousands of entries takes a handful of system calls, without readdir()'s
+    per-entry copies.
+  - A directory that cannot be opened is cached as empty, so patterns simply do not match in it.
+*/
+GlobDir* readGlobDir(const char* path, size_t len) {
+    unsigned int hash = hashBytes(path, len);
+    GlobDir** bucket = &globCache[hash & (GLOB_CACHE_SIZE - 1)];
+    for (GlobDir* dir = *bucket; dir != NULL; dir = dir->next) {
+        if (dir->hash == hash && strncmp(dir->path, path, len) == 0 && dir->path[len] == '\0') {
+            return dir;
+        }
+    }
+
+    GlobDir* dir = (GlobDir*)arenaAlloc(&globArena, sizeof(GlobDir));
+    dir->path = arenaStrndup(&globArena, path, len);
+    dir->hash = hash;
+    dir->names = NULL;
+    dir->types = NULL;
+    dir->count = 0;
+    dir->next = *bucket;
+    *bucket = dir;
+    glob_cache_entries++;
+
+    int fd = open(len ? dir->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return dir;
+    }
+    if (globReadBuffer == NULL && (globReadBuffer = (char*)malloc(GLOB_READ_SIZE)) == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t count = 0;
+    long bytes;
+    while ((bytes = syscall(SYS_getdents64, fd, globReadBuffer, GLOB_READ_SIZE)) > 0) {
+        for (long offset = 0; offset < bytes; ) {
+            LinuxDirent64* entry = (LinuxDirent64*)(globReadBuffer + offset);
+            offset += entry->d_reclen;
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            globNames = (char**)growScratch(globNames, &globNameCap, count, sizeof(char*));
+            globTypes = (unsigned char*)growScratch(globTypes, &globTypeCap, count, 1);
+            globNames[count] = arenaStrndup(&globArena, name, strlen(name));
+            globTypes[count] = entry->d_type;
+            count++;
+        }
+    }
+    close(fd);
+
+    dir->names = (char**)arenaAlloc(&globArena, count * sizeof(char*));
+    dir->types = (unsigned char*)arenaAlloc(&globArena, count);
+    memcpy(dir->names, globNames, count * sizeof(char*));
+    memcpy(dir->types, globTypes, count);
+    dir->count = count;
+    return dir;
+}
+
+// Returns a pointer just past the ']' closing a bracket expression that starts after 'p', or NULL
+const char* globBracketEnd(const char* p) {
+    if (*p == '!' || *p == '^') {
+        p++;
+    }
+    if (*p == ']') {
+        p++; // A ']' right after the '[' is a member
+    }
+    while (*p != '\0' && *p != ']') {
+        p += p[0] == '\\' && p[1] != '\0' ? 2 : 1;
+    }
+    return *p == ']' ? p + 1 : NULL;
+}
+
+/*
+  Function: globMatchChar
+
+  Description:
+  Matches one character of a name against the next element of a pattern.
+
+  Parameters:
+  - p: The pattern element: '?', a bracket expression, an escaped character or a plain character.
+  - c: The character.
+
+  Returns:
+  A pointer just past the element if it matches, or NULL.
+
+  Notes:
+  A bracket expression lists characters and ranges such as "a-z", and "[!...]" or "[^...]" negates it.
+  A '[' without a closing ']' is a plain character.
+*/
+const char* globMatchChar(const char* p, unsigned char c) {
+    if (*p == '?') {
+        return p + 1;
+    }
+    if (*p == '\\' && p[1] != '\0') {
+        return (unsigned char)p[1] == c ? p + 2 : NULL;
+    }
+    if (*p != '[') {
+        return (unsigned char)*p == c ? p + 1 : NULL;
+    }
+
+    const char* end = globBracketEnd(p + 1);
+    if (end == NULL) {
+        return c == '[' ? p + 1 : NULL;
+    }
+    const char* q = p + 1;
+    int negate = *q == '!' || *q == '^';
+    int found = 0;
+    q += negate;
+    do { // The first member may be ']'
+        unsigned char low = *q == '\\' ? *++q : *q;
+        q++;
+        unsigned char high = low;
+        if (q[0] == '-' && q[1] != ']') {
+            q++;
+            high = *q == '\\' ? *++q : *q;
+            q++;
+        }
+        found |= c >= low && c <= high;
+    } while (*q != ']');
+    return found != negate ? end : NULL;
+}
+
+/*
+  Function: globMatch
+
+  Description:
+  Matches a name against one component of a pattern.
+
+  Parameters:
+  - p: The pattern component, with "*", "?", "[...]" and '\' escapes.
+  - name: The name.
+
+  Returns:
+  1 if the name matches, 0 otherwise.
+
+  Notes:
+  - A '*' matches any run of characters. Only the most recent '*' is retried on a mismatch, which
+    is enough since each later one can only extend the match, so matching takes linear time in practice.
+  - A name starting with '.' only matches a pattern that starts with a literal '.'.
+*/
+int globMatch(const char* p, const char* name) {
+    if (name[0] == '.' && p[0] != '.' && !(p[0] == '\\' && p[1] == '.')) {
+        return 0;
+    }
+
+    const char* star = NULL;
+    const char* starName = NULL;
+    while (*name != '\0') {
+        if (*p == '*') {
+            while (*p == '*') {
+                p++;
+            }
+            if (*p == '\0') {
+                return 1;
+            }
+            star = p;
+            starName = name;
+            continue;
+        }
+        const char* next = *p != '\0' ? globMatchChar(p, *name) : NULL;
+        if (next != NULL) {
+            p = next;
+            name++;
+        } else if (star != NULL) {
+            p = star;
+            name = ++starName;
+        } else {
+            return 0;
+        }
+    }
+    while (*p == '*') {
+        p++;
+    }
+    return *p == '\0';
+}
+
+// Returns 1 if a pattern component contains an unescaped '*', '?' or complete bracket expression
+int globHasMeta(const char* p) {
+    for (; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '*' || *p == '?' || (*p == '[' && globBracketEnd(p + 1) != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Removes the '\' escapes of a pattern in place and returns its new length
+size_t globUnescape(char* text) {
+    char* out = text;
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+        }
+        *out++ = *c;
+    }
+    *out = '\0';
+    return out - text;
+}
+
+// Returns 1 if a path names a directory. 'type' is its d_type, if known; symlinks are followed unless 'noFollow'.
+int globIsDir(size_t len, unsigned char type, int noFollow) {
+    if (type == DT_DIR || (type != DT_UNKNOWN && (type != DT_LNK || noFollow))) {
+        return type == DT_DIR;
+    }
+    struct stat st;
+    expandBuffer[len] = '\0';
+    return fstatat(AT_FDCWD, expandBuffer, &st, noFollow ? AT_SYMLINK_NOFOLLOW : 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Adds the path in 'expandBuffer' to the matches, with a '/' if the pattern ended with one
+void globEmit(size_t len, int dirsOnly) {
+    char* match = arenaStrndup(&lineArena, expandBuffer, len + dirsOnly);
+    if (dirsOnly) {
+        match[len] = '/';
+    }
+    expandArgs = (char**)growScratch(expandArgs, &expandArgCap, expandArgCount, sizeof(char*));
+    expandArgs[expandArgCount++] = match;
+}
+
+/*
+  Function: globWalk
+
+  Description:
+  Matches the pattern components from 'index' on, below the directory built so far in 'expandBuffer',
+  and adds every matching path to 'expandArgs'.
+
+  Parameters:
+  - components: The pattern, split at '/'. Literal components are already unescaped.
+  - meta: For each component, 1 if it is a pattern, 0 if it is literal.
+  - count: The number of components.
+  - index: The component to match.
+  - len: The length of the directory in 'expandBuffer': 0, or a path ending with '/'.
+  - dirsOnly: The pattern ended with '/', so only directories match.
+
+  Returns: None
+
+  Notes:
+  - Literal components are appended without reading their directory. A literal last component is
+    checked with fstatat(); other missing ones simply give an empty listing below them.
+  - "**" matches any number of directories, itself included. Symlinks to directories are not
+    followed by it, so links cannot make it loop.
+  - Hidden directories are skipped unless a component asks for them with a leading '.'.
+*/
+void globWalk(char** components, const char* meta, int count, int index, size_t len, int dirsOnly) {
+    const char* component = components[index];
+    int last = index == count - 1;
+
+    if (!meta[index]) {
+        size_t end = appendExpansion(len, component, strlen(component));
+        if (!last) {
+            globWalk(components, meta, count, index + 1, appendExpansion(end, "/", 1), dirsOnly);
+            return;
+        }
+        struct stat st;
+        expandBuffer[end] = '\0';
+        if (fstatat(AT_FDCWD, expandBuffer, &st, AT_SYMLINK_NOFOLLOW) == 0 && (!dirsOnly || globIsDir(end, DT_UNKNOWN, 0))) {
+            globEmit(end, dirsOnly);
+        }
+        return;
+    }
+
+    int recursive = strcmp(component, "**") == 0;
+    if (recursive) {
+        globWalk(components, meta, count, index + 1, len, dirsOnly); // No directory at all
+    }
+    GlobDir* dir = readGlobDir(expandBuffer, len);
+    for (size_t i = 0; i < dir->count; i++) {
+        const char* name = dir->names[i];
+        if (recursive ? name[0] == '.' : !globMatch(component, name)) {
+            continue;
+        }
+        size_t end = appendExpansion(len, name, strlen(name));
+        if (recursive) {
+            if (globIsDir(end, dir->types[i], 1)) {
+                globWalk(components, meta, count, index, appendExpansion(end, "/", 1), dirsOnly);
+            }
+        } else if (!last) {
+            if (dir->types[i] == DT_DIR || dir->types[i] == DT_LNK || dir->types[i] == DT_UNKNOWN) {
+                globWalk(components, meta, count, index + 1, appendExpansion(end, "/", 1), dirsOnly);
+            }
+        } else if (!dirsOnly || globIsDir(end, dir->types[i], 0)) {
+            globEmit(end, dirsOnly);
+        }
+    }
+}
+
+// Orders glob matches by byte value, as the C locale does
+int compareMatches(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+  Function: expandGlob
+
+  Description:
+  Adds the paths matching a pattern to 'expandArgs', sorted, or the pattern itself if none match.
+
+  Parameters:
+  - pattern: The expanded word, in the line arena. Literal glob characters are escaped with '\'.
+
+  Returns: None
+
+  Notes:
+  - "*" matches any run of characters, "?" any one character and "[...]" one of a set, within one
+    path component. A "**" component matches any number of directories, so a "**" component
+    followed by "*.c" finds every C file below the directories before it.
+  - A pattern with no component left to match, such as a lone '[', is used as is without reading
+    any directory.
+  - Directories are read through readGlobDir(), so several patterns over the same directory read it once.
+  - A pattern that matches nothing is passed on as is, without its escapes, as POSIX shells do.
+*/
+void expandGlob(char* pattern) {
+    size_t base = expandArgCount;
+    char* copy = arenaStrndup(&lineArena, pattern, strlen(pattern));
+    int count = 1;
+    for (const char* c = copy; *c != '\0'; c++) {
+        count += *c == '/';
+    }
+    char** components = (char**)arenaAlloc(&lineArena, (count + 1) * sizeof(char*));
+    char* meta = (char*)arenaAlloc(&lineArena, count + 1);
+    int any = 0;
+    int dirsOnly = copy[strlen(copy) - 1] == '/';
+    size_t len = 0;
+    count = 0;
+
+    char* c = copy;
+    if (*c == '/') {
+        len = appendExpansion(0, "/", 1);
+    }
+    while (*c != '\0') {
+        while (*c == '/') {
+            c++;
+        }
+        if (*c == '\0') {
+            break;
+        }
+        char* component = c;
+        while (*c != '\0' && *c != '/') {
+            c++;
+        }
+        if (*c == '/') {
+            *c++ = '\0';
+        }
+        meta[count] = globHasMeta(component);
+        if (!meta[count]) {
+            globUnescape(component);
+        }
+        any |= meta[count];
+        components[count++] = component;
+    }
+
+    if (any) {
+        if (strcmp(components[count - 1], "**") == 0 && meta[count - 1]) {
+            components[count] = "*"; // A trailing "**" stands for every file below
+            meta[count++] = 1;
+        }
+        globWalk(components, meta, count, 0, len, dirsOnly);
+    }
+    if (expandArgCount == base) {
+        globUnescape(pattern);
+        expandArgs = (char**)growScratch(expandArgs, &expandArgCap, expandArgCount, sizeof(char*));
+        expandArgs[expandArgCount++] = pattern;
+        return;
+    }
+    qsort(expandArgs + base, expandArgCount - base, sizeof(char*), compareMatches);
+}
+
+/*
+  Function: expandArguments
+
+  Description:
+  Adds the arguments a word stands for to 'expandArgs'.
+
+  Parameters:
+  - word: The parsed word.
+
+  Returns: None
+
+  Notes:
+  - A word that is a single unquoted "$(...)" gives one argument per run of characters between
+    blanks and newlines in the output, so "for f in $(ls)" loops over the files.
+  - A word with an unquoted '*', '?' or '[' gives the sorted paths it matches, with expandGlob().
+  - Any other word gives one argument, or none if it is unquoted and expands to nothing.
+  - Substitutions expand words of their own, so callers keep their arguments above the count they
+    started from and drop them once copied out, using 'expandArgs' as a stack.
+*/
+void expandArguments(const Word* word) {
+    char* arg;
+    if (word->nparts == 1 && word->parts[0].type == PART_COMMAND && !word->quoted) {
+        size_t len;
+        char* output = substituteCommand(&word->parts[0], &len);
+        for (char* c = output; c < output + len; ) {
+            while (c < output + len && (*c == ' ' || *c == '\t' || *c == '\n')) {
+                *c++ = '\0';
+            }
+            if (c == output + len) {
+                break;
+            }
+            expandArgs = (char**)growScratch(expandArgs, &expandArgCap, expandArgCount, sizeof(char*));
+            expandArgs[expandArgCount++] = c;
+            while (c < output + len && *c != ' ' && *c != '\t' && *c != '\n') {
+                c++;
+            }
+        }
+        return;
+    }
+    arg = expandWord(word);
+    if (word->glob) {
+        expandGlob(arg);
+    } else if (*arg != '\0' || word->quoted) {
+        expandArgs = (char**)growScratch(expandArgs, &expandArgCap, expandArgCount, sizeof(char*));
+        expandArgs[expandArgCount++] = arg;
+    }
+}
+
+/*
+  Function: expandWord
+
+  Description:
+  Builds the argument a word stands for, substituting the current value of every variable it references.
+
+  Parameters:
+  - word: The parsed word.
+
+  Returns:
+  The argument, allocated from the line arena.
+
+  Notes:
+  - A variable that is not set expands to nothing, and "$?" to the exit code of the last command.
+  - Each variable is looked up once. A word without variables is copied directly.
+  - Values are not scanned again, so a value holding '$', ',' or '|' is used as is.
+  - Command substitutions are run first, with substituteCommand(), since they expand words of
+    their own in 'expandBuffer'. Their output is inserted as is.
+*/
+char* expandWord(const Word* word) {
+    if (word->nparts == 1 && word->parts[0].type == PART_TEXT) {
+        return arenaStrndup(&lineArena, word->parts[0].text, word->parts[0].len);
+    }
+
+    char** outputs = NULL;
+    size_t* lengths = NULL;
+    for (int i = 0; i < word->nparts; i++) {
+        if (word->parts[i].type == PART_COMMAND) {
+            if (outputs == NULL) {
+                outputs = (char**)arenaAlloc(&lineArena, word->nparts * sizeof(char*));
+                lengths = (size_t*)arenaAlloc(&lineArena, word->nparts * sizeof(size_t));
+            }
+            outputs[i] = substituteCommand(&word->parts[i], &lengths[i]);
+        }
+    }
+
+    size_t out = 0;
+    for (int i = 0; i < word->nparts; i++) {
+        const WordPart* part = &word->parts[i];
+        if (part->type == PART_COMMAND) {
+            out = appendExpansion(out, outputs[i], lengths[i]);
+        } else if (part->type == PART_TEXT) {
+            out = appendExpansion(out, part->text, part->len);
+        } else if (part->type == PART_STATUS) {
+            char status[16];
+            out = appendExpansion(out, status, snprintf(status, sizeof(status), "%d", last_exit_status));
+        } else {
+            const char* value = searchInHashTable(part->text);
+            if (value != NULL) {
+                out = appendExpansion(out, value, strlen(value));
+            }
+        }
+    }
+    return arenaStrndup(&lineArena, out ? expandBuffer : "", out);
+}
+
+/*
+  Function: expandPipeline
+
+  Description:
+  Builds the argument lists of every stage of a parsed pipeline.
+
+  Parameters:
+  - pipeline: The parsed pipeline.
+  - stages: Receives a NULL-terminated array of NULL-terminated argument lists, one per stage.
+            Everything is allocated from the line arena, so the parsed pipeline is left untouched.
+
+  Returns:
+  The number of stages, or 0 if a stage has no arguments left after expansion.
+
+  Notes:
+  - The arguments of each word are gathered with expandArguments(): an unquoted word that expands to an
+    empty string is dropped, a quoted one is kept as an empty argument, and a lone unquoted "$(...)"
+    gives one argument per field of its output.
+*/
+int expandPipeline(const Pipeline* pipeline, char**** stages) {
+    int count = pipeline->nstages;
+    int empty = 0;
+    traceEvent('B', "expand", NULL);
+    *stages = (char***)arenaAlloc(&lineArena, (count + 1) * sizeof(char**));
+    (*stages)[count] = NULL;
+
+    for (int i = 0; i < count; i++) {
+        const Stage* stage = &pipeline->stages[i];
+        size_t base = expandArgCount;
+        for (int j = 0; j < stage->nwords; j++) {
+            expandArguments(&stage->words[j]);
+        }
+        int n = expandArgCount - base;
+        char** parsed = (char**)arenaAlloc(&lineArena, (n + 1) * sizeof(char*));
+        memcpy(parsed, expandArgs + base, n * sizeof(char*));
+        parsed[n] = NULL;
+        expandArgCount = base;
+        (*stages)[i] = parsed;
+        empty |= n == 0;
+    }
+    traceEvent('E', "expand", NULL);
+
+    if (empty) {
+        if (count > 1) {
+            fprintf(stderr, "Invalid syntax: empty pipeline stage\n");
+        }
+        return 0;
+    }
+    return count;
+}
+
+/*
+  Function: growScratch
+
+  Description:
+  Makes room for one more element in one of the parser's scratch arrays, doubling it when it is full.
+
+  Parameters:
+  - array: The array.
+  - cap: Its capacity in elements, updated when it grows.
+  - count: The number of elements in use.
+  - size: The size of one element.
+
+  Returns:
+  The array, which may have moved.
+*/
+void* growScratch(void* array, size_t* cap, size_t count, size_t size) {
+    if (count < *cap) {
+        return array;
+    }
+    size_t grown = *cap ? *cap * 2 : 64;
+    void* moved = realloc(array, grown * size);
+    if (!moved) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    *cap = grown;
+    return moved;
+}
+
+// Adds a part to the word being scanned. Its text is copied into the parse arena.
+void pushPart(int type, const char* text, size_t len) {
+    parseParts = (WordPart*)growScratch(parseParts, &parsePartCap, parsePartCount, sizeof(WordPart));
+    WordPart* part = &parseParts[parsePartCount++];
+    part->type = type;
+    part->text = arenaStrndup(&parseArena, len ? text : "", len);
+    part->len = len;
+    part->commands = NULL;
+    part->ncommands = 0;
+}
+
+// Adds a token covering the source text from 'start' to 'end'
+Token* pushToken(int type, const char* start, const char* end) {
+    parseTokens = (Token*)growScratch(parseTokens, &parseTokenCap, parseTokenCount, sizeof(Token));
+    Token* token = &parseTokens[parseTokenCount++];
+    token->type = type;
+    token->word.parts = NULL;
+    token->word.nparts = 0;
+    token->word.quoted = 0;
+    token->word.glob = 0;
+    token->start = start;
+    token->end = end;
+    return token;
+}
+
+// Returns 1 if only blanks are left before the end of the line, a ',', a ';' or a "&&&"
+int isPipelineEnd(const char* c, const char* end) {
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r')) {
+        c++;
+    }
+    return c == end || *c == ',' || *c == ';' || (end - c >= 3 && memcmp(c, "&&&", 3) == 0);
+}
+
+// Returns 1 if an unquoted word ends at 'c'
+int isWordEnd(const char* c, const char* end) {
+    switch (*c) {
+    case ' ':
+    case '\t':
+    case '\r':
+    case '|':
+    case ',':
+    case ';':
+        return 1;
+    case '&':
+        return end - c >= 3 && memcmp(c, "&&&", 3) == 0;
+    case '#':
+        return isPipelineEnd(c + 1, end);
+    case ')':
+        return parseFanoutGroup;
+    default:
+        return 0;
+    }
+}
+
+/*
+  Function: findSubstitutionEnd
+
+  Description:
+  Finds the ')' closing a command substitution.
+
+  Parameters:
+  - c: The first character after "$(".
+  - end: The end of the line.
+
+  Returns:
+  A pointer to the closing ')', or NULL if there is none.
+
+  Notes:
+  Quotes inside the substitution are its own, and a ')' inside them does not close it.
+  Nested substitutions and the "( ... )" of a fan-out are skipped whole, and a backslash always
+  skips the next character.
+*/
+const char* findSubstitutionEnd(const char* c, const char* end) {
+    int inQuote = 0;
+    while (c < end) {
+        if (*c == '\\' && c + 1 < end) {
+            c += 2;
+        } else if (*c == '"') {
+            inQuote = !inQuote;
+            c++;
+        } else if (*c == '$' && c + 1 < end && c[1] == '(') {
+            c = findSubstitutionEnd(c + 2, end);
+            if (c == NULL) {
+                return NULL;
+            }
+            c++;
+        } else if (*c == '|' && !inQuote && c + 1 < end && c[1] == '>') {
+            // A fan-out group: its ')' does not close the substitution
+            c += 2;
+            while (c < end && (*c == ' ' || *c == '\t' || *c == '\r')) {
+                c++;
+            }
+            if (c < end && *c == '(') {
+                c = findSubstitutionEnd(c + 1, end);
+                if (c == NULL) {
+                    return NULL;
+                }
+                c++;
+            }
+        } else if (*c == ')' && !inQuote) {
+            return c;
+        } else {
+            c++;
+        }
+    }
+    return NULL;
+}
+
+/*
+  Function: scanWord
+
+  Description:
+  Scans one word and adds it to the token list.
+
+  Parameters:
+  - c: The first character of the word.
+  - end: The end of the line.
+
+  Returns:
+  A pointer just past the word, or NULL (after printing an error) if a quote is not closed.
+
+  Notes:
+  - Quoted sections can appear anywhere in a word: a"b c"d is the single argument "ab cd".
+  - Inside quotes, \", \\ and \$ stand for the character itself; other backslashes are kept.
+    Outside quotes, the same goes for \, \; \| \# \* \? \[ and "\ ".
+  - An unquoted '*', '?' or '[' makes the word a pattern for expandGlob(). In a pattern, every literal
+    '*', '?', '[' or '\' (quoted, escaped, or a kept backslash) is stored escaped with a '\'. Words that
+    turn out not to be patterns have those escapes removed once the word is complete.
+  - "$NAME", "${NAME}" and "$?" become variable parts, inside quotes or not. A name is a letter or '_'
+    followed by letters, digits or '_'. A '$' that does not start a reference is kept as is.
+  - "$(...)" becomes a command substitution part, inside quotes or not. Its text is parsed right away
+    with parseSubstitution(), so the commands are part of the tree and never parsed again.
+  - Literal text is gathered in runs, so plain characters are copied once per run rather than one by one.
+*/
+const char* scanWord(const char* c, const char* end) {
+    const char* start = c;
+    const char* run = c; // literal characters not copied yet
+    size_t firstPart = parsePartCount;
+    size_t textLen = 0; // literal text gathered in expandBuffer since the last part
+    int inQuote = 0;
+    int quoted = 0;
+    int glob = 0;
+    int escaped = 0; // literal glob characters were stored escaped
+
+    while (c < end && (inQuote || !isWordEnd(c, end))) {
+        if (*c != '"' && *c != '\\' && *c != '$' && (!inQuote || (*c != '*' && *c != '?' && *c != '['))) {
+            glob |= *c == '*' || *c == '?' || *c == '[';
+            c++;
+            continue;
+        }
+        textLen = appendExpansion(textLen, run, c - run);
+
+        if (*c == '"') {
+            inQuote = !inQuote;
+            quoted = 1;
+            c++;
+        } else if (*c == '\\' || *c != '$') {
+            // A quoted glob character, an escaped character or a backslash kept as is
+            if (*c == '\\' && c + 1 < end && c[1] != '\0' && strchr(inQuote ? "\"\\$" : "\"\\$,;|# *?[", c[1]) != NULL) {
+                c++; // Drop the backslash
+            }
+            if (*c == '*' || *c == '?' || *c == '[' || *c == '\\') {
+                textLen = appendExpansion(textLen, "\\", 1);
+                escaped = 1;
+            }
+            textLen = appendExpansion(textLen, c, 1);
+            c++;
+        } else if (c + 1 < end && c[1] == '(') {
+            const char* close = findSubstitutionEnd(c + 2, end);
+            if (close == NULL) {
+                fprintf(stderr, "Invalid syntax: unterminated \"$(\"\n");
+                return NULL;
+            }
+            if (textLen > 0) {
+                pushPart(PART_TEXT, expandBuffer, textLen);
+                textLen = 0;
+            }
+            if (parseSubstitution(c + 2, close - (c + 2)) < 0) {
+                return NULL;
+            }
+            c = close + 1;
+        } else {
+            const char* name = c + 1;
+            int braced = name < end && *name == '{';
+            name += braced;
+            const char* nameEnd = name;
+            if (!braced && nameEnd < end && *nameEnd == '?') {
+                nameEnd++;
+            } else if (nameEnd < end && (isalpha((unsigned char)*nameEnd) || *nameEnd == '_')) {
+                while (nameEnd < end && (isalnum((unsigned char)*nameEnd) || *nameEnd == '_')) {
+                    nameEnd++;
+                }
+            }
+
+            if (nameEnd == name || (braced && (nameEnd == end || *nameEnd != '}'))) {
+                textLen = appendExpansion(textLen, "$", 1); // Not a variable reference
+                c++;
+            } else {
+                if (textLen > 0) {
+                    pushPart(PART_TEXT, expandBuffer, textLen);
+                    textLen = 0;
+                }
+                pushPart(*name == '?' ? PART_STATUS : PART_VAR, name, nameEnd - name);
+                c = nameEnd + braced;
+            }
+        }
+        run = c;
+    }
+    textLen = appendExpansion(textLen, run, c - run);
+
+    if (inQuote) {
+        fprintf(stderr, "Invalid syntax: unterminated quote\n");
+        return NULL;
+    }
+    if (textLen > 0 || parsePartCount == firstPart) {
+        pushPart(PART_TEXT, expandBuffer, textLen);
+    }
+
+    // Move the parts out of the scratch array into the parse arena
+    Token* token = pushToken(TOKEN_WORD, start, c);
+    token->word.nparts = parsePartCount - firstPart;
+    token->word.parts = (WordPart*)arenaAlloc(&parseArena, token->word.nparts * sizeof(WordPart));
+    memcpy(token->word.parts, parseParts + firstPart, token->word.nparts * sizeof(WordPart));
+    token->word.quoted = quoted;
+    token->word.glob = glob;
+    parsePartCount = firstPart;
+    if (escaped && !glob) {
+        for (int i = 0; i < token->word.nparts; i++) {
+            WordPart* part = &token->word.parts[i];
+            if (part->type == PART_TEXT) {
+                part->len = globUnescape((char*)part->text);
+            }
+        }
+    }
+    return c;
+}
+
+/*
+  Function: tokenizeLine
+
+  Description:
+  Splits a command line into words and operators, in a single pass.
+
+  Parameters:
+  - src: The command line. It is not modified and does not need to be null-terminated.
+  - len: The length of the command line.
+
+  Returns:
+  0 on success, -1 on a syntax error (an error has been printed).
+
+  Notes:
+  - The tokens are appended to 'parseTokens', after those of any line whose substitution is being
+    tokenized. Word parts are already in the parse arena.
+  - Unquoted ',' or ';' separates commands, "&&&" separates parallel pipelines and '|' separates
+    pipeline stages. Blanks separate words.
+  - An unquoted '#' that is the last character of a pipeline marks it for the background.
+  - "|>" must be followed by '(' and opens a fan-out group, closed by ')'. Inside it, ',' and ';'
+    separate the consumers instead of commands, and ')' ends a word. Groups do not nest.
+*/
+int tokenizeLine(const char* src, size_t len) {
+    const char* c = src;
+    const char* end = src + len;
+    int outerGroup = parseFanoutGroup; // A substitution inside a group has its own syntax
+    parseFanoutGroup = 0;
+
+    while (c < end) {
+        if (*c == ' ' || *c == '\t' || *c == '\r') {
+            c++;
+        } else if (*c == '|' && c + 1 < end && c[1] == '>') {
+            const char* open = c + 2;
+            while (open < end && (*open == ' ' || *open == '\t' || *open == '\r')) {
+                open++;
+            }
+            if (parseFanoutGroup || open == end || *open != '(') {
+                fprintf(stderr, parseFanoutGroup ? "Invalid syntax: \"|>\" inside a fan-out\n"
+                                                 : "Invalid syntax: expected \"(\" after \"|>\"\n");
+                parseFanoutGroup = outerGroup;
+                return -1;
+            }
+            pushToken(TOKEN_FANOUT, c, open + 1);
+            parseFanoutGroup = 1;
+            c = open + 1;
+        } else if (*c == ')' && parseFanoutGroup) {
+            pushToken(TOKEN_FANOUT_END, c, c + 1);
+            parseFanoutGroup = 0;
+            c++;
+        } else if (*c == '|') {
+            pushToken(TOKEN_PIPE, c, c + 1);
+            c++;
+        } else if (*c == ',' || *c == ';') {
+            pushToken(parseFanoutGroup ? TOKEN_BRANCH : TOKEN_SEQUENCE, c, c + 1);
+            c++;
+        } else if (end - c >= 3 && memcmp(c, "&&&", 3) == 0) {
+            pushToken(TOKEN_PARALLEL, c, c + 3);
+            c += 3;
+        } else if (*c == '#' && isPipelineEnd(c + 1, end)) {
+            pushToken(TOKEN_BACKGROUND, c, c + 1);
+            c++;
+        } else if ((c = scanWord(c, end)) == NULL) {
+            parseFanoutGroup = outerGroup;
+            return -1;
+        }
+    }
+    int unclosed = parseFanoutGroup;
+    parseFanoutGroup = outerGroup;
+    if (unclosed) {
+        fprintf(stderr, "Invalid syntax: expected \")\" to close \"|>\"\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 1 if a token is the unquoted word 'keyword'
+int isKeyword(const Token* token, const char* keyword) {
+    return token->type == TOKEN_WORD && token->word.nparts == 1 && !token->word.quoted &&
+           token->word.parts[0].type == PART_TEXT && strcmp(token->word.parts[0].text, keyword) == 0;
+}
+
+/*
+  Function: buildPipeline
+
+  Description:
+  Lays out a pipeline from its tokens in the parse arena.
+
+  Parameters:
+  - tokens: The tokens of the pipeline, up to the next "&&&", ',' or the end of the line.
+  - count: The number of tokens.
+  - pipeline: The pipeline to fill in.
+
+  Returns:
+  0 on success, -1 on a syntax error (an error has been printed).
+
+  Notes:
+  A "|> ( ... )" group becomes the branches of the pipeline, one pipeline per consumer. Only a '#'
+  may follow the ')', and the consumers themselves cannot run in the background.
+*/
+int buildPipeline(const Token* tokens, size_t count, Pipeline* pipeline) {
+    pipeline->background = count > 0 && tokens[count - 1].type == TOKEN_BACKGROUND;
+    if (pipeline->background) {
+        count--;
+    }
+    pipeline->branches = NULL;
+    pipeline->nbranches = 0;
+
+    for (size_t f = 0; f < count; f++) {
+        if (tokens[f].type != TOKEN_FANOUT) {
+            continue;
+        }
+        if (tokens[count - 1].type != TOKEN_FANOUT_END) {
+            fprintf(stderr, "Invalid syntax: expected the end of the command after the \")\" of \"|>\"\n");
+            return -1;
+        }
+        pipeline->nbranches = 1;
+        for (size_t i = f + 1; i < count - 1; i++) {
+            pipeline->nbranches += tokens[i].type == TOKEN_BRANCH;
+        }
+        pipeline->branches = (Pipeline*)arenaAlloc(&parseArena, pipeline->nbranches * sizeof(Pipeline));
+        size_t first = f + 1;
+        int n = 0;
+        for (size_t i = f + 1; i < count; i++) {
+            if (tokens[i].type == TOKEN_BRANCH || i == count - 1) {
+                Pipeline* branch = &pipeline->branches[n++];
+                if (buildPipeline(tokens + first, i - first, branch) < 0) {
+                    return -1;
+                }
+                if (branch->background) {
+                    fprintf(stderr, "Invalid syntax: a fan-out consumer cannot run in the background\n");
+                    return -1;
+                }
+                first = i + 1;
+            }
+        }
+        count = f; // The producer
+        break;
+    }
+    pipeline->nstages = 1;
+    for (size_t i = 0; i < count; i++) {
+        pipeline->nstages += tokens[i].type == TOKEN_PIPE;
+    }
+    pipeline->stages = (Stage*)arenaAlloc(&parseArena, pipeline->nstages * sizeof(Stage));
+
+    size_t i = 0;
+    for (int s = 0; s < pipeline->nstages; s++) {
+        size_t first = i;
+        while (i < count && tokens[i].type == TOKEN_WORD) {
+            i++;
+        }
+        Stage* stage = &pipeline->stages[s];
+        stage->nwords = i - first;
+        if (stage->nwords == 0) {
+            fprintf(stderr, pipeline->nstages > 1 ? "Invalid syntax: empty pipeline stage\n"
+                                                  : "Invalid syntax: empty command\n");
+            return -1;
+        }
+        stage->words = (Word*)arenaAlloc(&parseArena, stage->nwords * sizeof(Word));
+        for (int w = 0; w < stage->nwords; w++) {
+            stage->words[w] = tokens[first + w].word;
+        }
+        i++; // Skip the '|'
+    }
+    return 0;
+}
+
+/*
+  Function: buildCommand
+
+  Description:
+  Lays out the pipelines of one command from its tokens in the parse arena.
+
+  Parameters:
+  - tokens: The tokens of the command, up to the next ',' or the end of the list. There is at least one.
+  - count: The number of tokens.
+  - command: The command to fill in.
+
+  Returns:
+  0 on success, -1 on a syntax error (an error has been printed).
+*/
+int buildCommand(const Token* tokens, size_t count, Command* command) {
+    int fanout = 0;
+    command->npipelines = 1;
+    for (size_t i = 0; i < count; i++) {
+        command->npipelines += tokens[i].type == TOKEN_PARALLEL;
+        fanout |= tokens[i].type == TOKEN_FANOUT;
+    }
+    if (fanout && command->npipelines > 1) {
+        fprintf(stderr, "Invalid syntax: \"|>\" cannot be combined with \"&&&\"\n");
+        return -1;
+    }
+    command->pipelines = (Pipeline*)arenaAlloc(&parseArena, command->npipelines * sizeof(Pipeline));
+
+    size_t first = 0;
+    int n = 0;
+    for (size_t i = 0; i <= count; i++) {
+        if (i == count || tokens[i].type == TOKEN_PARALLEL) {
+            if (buildPipeline(tokens + first, i - first, &command->pipelines[n++]) < 0) {
+                return -1;
+            }
+            first = i + 1;
+        }
+    }
+    return 0;
+}
 
-    Return:
-    - Returns 0 on success.
-    - Returns 1 if there is a failure in reading input.
+int parseCommands(size_t* pos, const char* closer, Command** commands, int* ncommands);
 
-    Details:
-    1. The function prints a prompt to indicate that it is ready to receive input.
-    2. It uses fgets() to read a line of input from stdin into the provided string buffer.
-    3. If fgets() returns NULL, it indicates a failure in reading input, and an error message is printed.
-    4. It removes the newline character ('\n') from the end of the input string if present.
-*/
-int takeInput(char* str) {
-    printPrompt(); // Print prompt for user input
-    if (fgets(str, MAXCOM, stdin) == NULL) { // Read input from stdin
-        printf("Failed to read input\n"); // Print error message if reading fails
-        return 1; // Return failure
-    }
-    size_t len = strlen(str); // Calculate length of input string
-    if (len > 0 && str[len - 1] == '\n'){ // Check if newline character exists at the end of input
-        str[len - 1] = '\0'; // Remove newline character by replacing it with null terminator
+// Prints a syntax error about the token at 'pos', or the end of the line
+int syntaxError(size_t pos, const char* expected) {
+    if (pos < parseTokenCount) {
+        const Token* token = &parseTokens[pos];
+        fprintf(stderr, "Invalid syntax: expected %s before \"%.*s\"\n",
+                expected, (int)(token->end - token->start), token->start);
+    } else {
+        fprintf(stderr, "Invalid syntax: expected %s at the end of the line\n", expected);
     }
-    return 0; // Return success
+    return -1;
 }
 
 /*
-    Function: execArgs
+  Function: parseLoop
 
-    Description:
-    This function executes a command with arguments passed as an array of strings.
-    It optionally supports input and output redirection and can run the command in the background.
+  Description:
+  Parses a "for" or "repeat" loop starting at its keyword.
 
-    Parameters:
-    - parsed: A pointer to an array of strings representing the command and its arguments.
-    - background: An integer flag indicating whether the command should run in the background (1) or not (0).
+  Parameters:
+  - pos: The position of the "for" or "repeat" token, advanced past the closing "done" or "}".
+  - command: The command to fill in.
 
-    Return:
-    None
+  Returns:
+  0 on success, -1 on a syntax error (an error has been printed).
 
-    Details:
-    1. The function forks a new process to execute the command.
-    2. In the child process:
-       a. It checks for input and output redirection symbols ("<" and ">") in the parsed command.
-       b. If input redirection is detected, it opens the specified file and redirects standard input to it.
-       c. If output redirection is detected, it opens the specified file and redirects standard output to it.
-       d. It then attempts to execute the command using execvp().
-       e. If execvp fails, it prints an error message and exits the child process with a failure status.
-    3. In the parent process:
-       a. If the command is not set to run in the background:
-          - It waits for the child process to finish.
-          - It retrieves the exit status of the child process.
-          - It stores the exit status in the global variable 'last_exit_status'.
+  Notes:
+  - "for NAME in WORDS; do BODY; done": the words end at the next ',' or ';'. The body may start
+    right after "do", and "done" must start a command.
+  - "repeat COUNT { BODY }": "{" and "}" are separate words. "}" closes the block wherever it appears.
+  - Bodies are lists of commands, loops included, parsed once with parseCommands().
 */
-void execArgs(char** parsed, int background) {
-    pid_t pid = fork();
-    if (pid == -1) {
-        printf("Failed to fork child\n");
-        return;
-    } else if (pid == 0) {
-        // Redirect standard input and output if necessary
-        for (int i = 0; parsed[i] != NULL; i++) {
-            if (strcmp(parsed[i], "<") == 0) {
-                // Input redirection
-                int fd = open(parsed[i+1], O_RDONLY);
-                if (fd < 0) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-                parsed[i] = NULL;
-                parsed[i+1] = NULL;
-                break; // Stop processing further
-            } else if (strcmp(parsed[i], ">") == 0) {
-                // Output redirection
-                int fd = open(parsed[i+1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
-                if (fd < 0) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-                parsed[i] = NULL;
-                parsed[i+1] = NULL;
-                break; // Stop processing further
+int parseLoop(size_t* pos, Command* command) {
+    Loop* loop = (Loop*)arenaAlloc(&parseArena, sizeof(Loop));
+    memset(loop, 0, sizeof(Loop));
+    command->loop = loop;
+    command->pipelines = NULL;
+    command->npipelines = 0;
+    const Token* tokens = parseTokens;
+    size_t i = *pos;
+    const char* closer;
+
+    if (isKeyword(&tokens[i++], "for")) {
+        const WordPart* name = i < parseTokenCount && tokens[i].type == TOKEN_WORD && !tokens[i].word.quoted &&
+                               tokens[i].word.nparts == 1 ? &tokens[i].word.parts[0] : NULL;
+        if (name == NULL || name->type != PART_TEXT || !(isalpha((unsigned char)name->text[0]) || name->text[0] == '_')) {
+            return syntaxError(i, "a variable name after \"for\"");
+        }
+        for (const char* c = name->text; *c != '\0'; c++) {
+            if (!isalnum((unsigned char)*c) && *c != '_') {
+                return syntaxError(i, "a variable name after \"for\"");
             }
         }
-
-        if (execvp(parsed[0], parsed) < 0) {
-            printf("Could not execute command\n");
-            exit(EXIT_FAILURE); // If execvp fails, child process exits with failure status
+        loop->var = name->text;
+        i++;
+        if (i >= parseTokenCount || !isKeyword(&tokens[i], "in")) {
+            return syntaxError(i, "\"in\"");
+        }
+        size_t first = ++i;
+        while (i < parseTokenCount && tokens[i].type == TOKEN_WORD) {
+            i++;
+        }
+        loop->nwords = i - first;
+        loop->words = (Word*)arenaAlloc(&parseArena, loop->nwords * sizeof(Word));
+        for (int w = 0; w < loop->nwords; w++) {
+            loop->words[w] = tokens[first + w].word;
+        }
+        while (i < parseTokenCount && tokens[i].type == TOKEN_SEQUENCE) {
+            i++;
+        }
+        if (i >= parseTokenCount || !isKeyword(&tokens[i], "do")) {
+            return syntaxError(i, "\"do\"");
         }
+        closer = "done";
     } else {
-        if (!background) {
-            int status;
-            waitpid(pid, &status, 0);
-            if (WIFEXITED(status)) {
-                last_exit_status = WEXITSTATUS(status); // Store exit code
-            }
+        if (i >= parseTokenCount || tokens[i].type != TOKEN_WORD) {
+            return syntaxError(i, "a count after \"repeat\"");
+        }
+        loop->nwords = 1;
+        loop->words = (Word*)arenaAlloc(&parseArena, sizeof(Word));
+        loop->words[0] = tokens[i++].word;
+        if (i >= parseTokenCount || !isKeyword(&tokens[i], "{")) {
+            return syntaxError(i, "\"{\"");
         }
+        closer = "}";
     }
-}
-
-/* Function: parseEnvVars
-Description: This function parses environment variables from the array of parsed arguments and inserts them into a hash table. Each environment variable is expected to be in the form "name=value" within the parsed array. The function iterates through the array, identifying environment variables by locating the "=" separator. It then separates the name and value, inserts them into the hash table, and modifies the parsed array by setting the "=" element to NULL to indicate the end of each environment variable. 
-This prevents the separator from being treated as a separate argument in later processing.
 
- Parameters:
- - parsed: A pointer to an array of strings representing the parsed arguments, where environment variables are expected to be in the format "name=value".
- Returns: None */
-void parseEnvVars(char** parsed) {
-    for (int i = 1; parsed[i] != NULL; i++) {
-        if (strcmp(parsed[i], "=") == 0) {
-            // Separate name and value
-            parsed[i] = NULL;
-            char* name = parsed[i - 1];
-            char* value = parsed[i + 1];
-            insertIntoHashTable(name, value);
-        }
+    i++; // Skip "do" or "{"
+    if (parseCommands(&i, closer, &loop->body, &loop->nbody) < 0) {
+        return -1;
     }
+    *pos = i + 1; // Skip the closer
+    return 0;
 }
 
-
 /*
-  Function: setEnvVar
+  Function: parseCommands
 
   Description:
-  Sets environment variables by parsing and extracting name-value pairs from the given command arguments.
-  The function ensures correct syntax and removes quotes around the value if present.
+  Parses a list of commands separated by ',' or ';', up to the end of the line or a closing keyword.
 
   Parameters:
-  - parsed: An array of strings representing the command and its arguments, where parsed[1] contains the name-value pair.
+  - pos: The position of the first token, advanced to the closing keyword or the end of the line.
+  - closer: The keyword that ends the list ("done" or "}"), or NULL for the whole line.
+  - commands: Receives the commands, allocated from the parse arena.
+  - ncommands: Receives the number of commands.
 
   Returns:
-  Void. Sets the environment variable if the syntax is valid.
+  0 on success, -1 on a syntax error (an error has been printed).
 
   Notes:
-  - Parses the name-value pair from the command arguments.
-  - Checks for valid syntax; if not, prints an error message and returns.
-  - Separates the name and value, and removes quotes from the value if present.
-  - Calls insertIntoHashTable() function to set the environment variable.
+  - Commands are gathered on 'parseCommandStack' and copied out once the list is complete. A nested
+    loop body is parsed and popped before the loop itself is pushed, so one stack serves every level.
+  - "time", "for" and "repeat" are keywords at the start of a command. "do", "done", "{" and "}"
+    anywhere else than where a loop expects them are syntax errors.
+  - Empty commands, such as the one after a trailing ',' or a lone '#', are left out.
 */
-void setEnvVar(char** parsed) {
-    if (parsed[1] == NULL) {
-        fprintf(stderr, "Invalid syntax for set command\n");
-        return;
-    }
+int parseCommands(size_t* pos, const char* closer, Command** commands, int* ncommands) {
+    const Token* tokens = parseTokens;
+    size_t base = parseCommandCount;
+    size_t i = *pos;
+    int brace = closer != NULL && strcmp(closer, "}") == 0;
 
-    // Separate name and value
-    char* assignment = parsed[1];
-    char* equal_sign = strchr(assignment, '=');
-    if (equal_sign == NULL) {
-        fprintf(stderr, "Invalid syntax for set command\n");
-        return;
-    }
+    for (;;) {
+        while (i < parseTokenCount && tokens[i].type == TOKEN_SEQUENCE) {
+            i++;
+        }
+        if (i >= parseTokenCount) {
+            if (closer != NULL) {
+                parseCommandCount = base;
+                return syntaxError(i, closer[0] == '}' ? "\"}\"" : "\"done\"");
+            }
+            break;
+        }
+        if (closer != NULL && isKeyword(&tokens[i], closer)) {
+            break;
+        }
 
-    *equal_sign = '\0'; // Separate name and value
-    char* name = assignment;
-    char* value = equal_sign + 1;
+        Command command;
+        memset(&command, 0, sizeof(Command));
+        command.timed = isKeyword(&tokens[i], "time") && i + 1 < parseTokenCount && tokens[i + 1].type == TOKEN_WORD;
+        i += command.timed;
+        size_t first = i;
+        int failed;
 
-    // Remove quotes if present
-    if (value[0] == '"' && value[strlen(value) - 1] == '"') {
-        value[strlen(value) - 1] = '\0';
-        value++;
+        if (isKeyword(&tokens[i], "for") || isKeyword(&tokens[i], "repeat")) {
+            failed = parseLoop(&i, &command) < 0;
+            if (!failed && i < parseTokenCount && tokens[i].type != TOKEN_SEQUENCE &&
+                !(brace && isKeyword(&tokens[i], "}"))) {
+                failed = syntaxError(i, "',' or ';' after the loop") < 0;
+            }
+        } else if (isKeyword(&tokens[i], "do") || isKeyword(&tokens[i], "done") ||
+                   isKeyword(&tokens[i], "{") || isKeyword(&tokens[i], "}")) {
+            fprintf(stderr, "Invalid syntax: unexpected \"%s\"\n", tokens[i].word.parts[0].text);
+            failed = 1;
+        } else {
+            while (i < parseTokenCount && tokens[i].type != TOKEN_SEQUENCE && !(brace && isKeyword(&tokens[i], "}"))) {
+                i++;
+            }
+            if (i - first == 1 && tokens[first].type == TOKEN_BACKGROUND) {
+                continue; // A lone '#'
+            }
+            failed = buildCommand(tokens + first, i - first, &command) < 0;
+        }
+        if (failed) {
+            parseCommandCount = base;
+            return -1;
+        }
+        command.text = arenaStrndup(&parseArena, tokens[first].start, tokens[i - 1].end - tokens[first].start);
+
+        parseCommandStack = (Command*)growScratch(parseCommandStack, &parseCommandCap, parseCommandCount, sizeof(Command));
+        parseCommandStack[parseCommandCount++] = command;
     }
 
-    insertIntoHashTable(name, value);
+    *ncommands = parseCommandCount - base;
+    *commands = (Command*)arenaAlloc(&parseArena, *ncommands * sizeof(Command));
+    memcpy(*commands, parseCommandStack + base, *ncommands * sizeof(Command));
+    parseCommandCount = base;
+    *pos = i;
+    return 0;
 }
 
 /*
-  Function: getEnvVar
+  Function: parseSubstitution
 
   Description:
-  Retrieves the value of an environment variable specified by the given name.
-  If the name is '?', prints the last exit status.
-  If the variable is found, prints its value; otherwise, prints a message indicating the variable was not found.
+  Parses the text of a command substitution and adds it to the word being scanned as a PART_COMMAND part.
 
   Parameters:
-  - parsed: An array of strings representing the command and its arguments, where parsed[1] contains the variable name.
+  - src: The text between "$(" and ")".
+  - len: The length of the text.
 
   Returns:
-  Void. Prints the value of the variable or an appropriate message.
+  0 on success, -1 on a syntax error (an error has been printed).
 
   Notes:
-  - Retrieves the name of the environment variable from the command arguments.
-  - If the name is '?', prints the last exit status.
-  - Searches for the variable in the hash table using searchInHashTable() function.
-  - If the variable is found, prints its value; otherwise, prints a message indicating the variable was not found.
+  It runs in the middle of tokenizing the outer line. The inner tokens are appended after the outer
+  ones and parsed on their own, then dropped, so the scratch arrays serve every level of nesting.
 */
-void getEnvVar(char** parsed) {
-    char* name = parsed[1];
-    char* value;
-    if (strcmp(name, "?") == 0) {
-        printf("%d\n", last_exit_status); // Print last exit status
-    } else {
-        value = searchInHashTable(name);
-        if (value != NULL) {
-            printf("%s\n", value);
-        } else {
-            printf("Variable not found\n"); // Print message if variable not found
-        }
+int parseSubstitution(const char* src, size_t len) {
+    size_t index = parsePartCount;
+    size_t base = parseTokenCount;
+    size_t pos = base;
+    Command* commands;
+    int ncommands;
+    pushPart(PART_COMMAND, src, len);
+    int result = tokenizeLine(src, len);
+    if (result == 0) {
+        result = parseCommands(&pos, NULL, &commands, &ncommands);
+    }
+    parseTokenCount = base;
+    if (result < 0) {
+        return -1;
     }
+    parseParts[index].commands = commands;
+    parseParts[index].ncommands = ncommands;
+    return 0;
 }
 
 /*
-  Function: execArgsPiped
+  Function: parseLine
 
   Description:
-  Executes two commands in a piped manner. The output of the first command becomes the input of the second command.
+  Parses a command line into a CommandLine allocated from the parse arena.
 
   Parameters:
-  - parsed: An array of strings representing the first command and its arguments.
-  - parsedpipe: An array of strings representing the second command and its arguments.
+  - src: The command line. It is not modified and does not need to be null-terminated.
+  - len: The length of the command line.
 
   Returns:
-  Void. Executes the commands in a piped manner.
+  The parsed line, or NULL on a syntax error (an error has been printed).
 
   Notes:
-  - Uses fork() and execvp() to execute the commands.
-  - Creates a pipe using pipe() system call.
-  - Redirects stdout of the first command to the write end of the pipe and stdin of the second command to the read end of the pipe.
-  - Waits for both child processes to complete before returning.
+  - The result holds its own copy of every piece of text, so it can be executed any number of times.
+    Variables are looked up by expandPipeline() each time it runs.
 */
-void execArgsPiped(char** parsed, char** parsedpipe) {
-    int pipefd[2];
-    pid_t p1, p2;
-
-    // Create the pipe
-    if (pipe(pipefd) < 0) { 
-        printf("Pipe could not be initialized\n");
-        return;
+CommandLine* parseLine(const char* src, size_t len) {
+    parseTokenCount = 0;
+    parsePartCount = 0;
+    if (tokenizeLine(src, len) < 0) {
+        return NULL;
     }
 
-    // Fork the first child process
-    p1 = fork();
-    if (p1 < 0) {
-        printf("Could not fork\n");
-        return;
+    CommandLine* line = (CommandLine*)arenaAlloc(&parseArena, sizeof(CommandLine));
+    memset(line, 0, sizeof(CommandLine));
+    size_t pos = 0;
+    if (parseCommands(&pos, NULL, &line->commands, &line->ncommands) < 0) {
+        return NULL;
     }
+    return line;
+}
 
-    if (p1 == 0) {
-        close(pipefd[0]); // Close the read end of the pipe
-        dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to the write end of the pipe
-        close(pipefd[1]); // Close the write end of the pipe
+// Drops every cached parsed line and the memory holding them
+void flushParseCache() {
+    memset(parseCache, 0, sizeof(parseCache));
+    parse_cache_entries = 0;
+    arenaReset(&parseArena);
+}
 
-        // Execute the first command
-        if (execvp(parsed[0], parsed) < 0) {
-            printf("Could not execute command 1\n");
-            exit(0);
-        }
-    } else {
-      // Parent process
-        p2 = fork(); // Fork the second child process
+/*
+  Function: lookupParsedLine
 
-        if (p2 < 0) {
-            printf("Could not fork\n");
-            return;
-        }
+  Description:
+  Returns the parsed form of a command line, parsing it only if the same text has not been parsed before.
 
-        if (p2 == 0) {
-            close(pipefd[1]); // Close the write end of the pipe
-            dup2(pipefd[0], STDIN_FILENO); // Redirect stdin to the read end of the pipe
-            close(pipefd[0]); // Close the read end of the pipe
+  Parameters:
+  - src: The command line. It does not need to be null-terminated.
+  - len: The length of the command line.
 
-            // Execute the second command
-            if (execvp(parsedpipe[0], parsedpipe) < 0) {
-                printf("Could not execute command 2\n");
-                exit(0);
-            }
-        } else {
-          // Parent process
-            close(pipefd[0]); // Close the read end of the pipe
-            close(pipefd[1]); // Close the write end of the pipe
-            wait(NULL); // Wait for the first child process to complete
-            wait(NULL); // Wait for the second child process to complete
+  Returns:
+  The parsed line, or NULL on a syntax error (an error has been printed).
+
+  Notes:
+  - Entries are keyed by the FNV-1a hash of the text and compared in full, so a hit is exact.
+  - When the cache holds PARSE_CACHE_SIZE lines or the parse arena grows past PARSE_CACHE_LIMIT,
+    the whole cache is dropped before the next line is parsed. Chains stay short and a script of
+    unique lines keeps reusing the same memory. Nothing else frees parsed lines, so one stays valid until the next lookup.
+  - Lines with syntax errors are not cached, so the error is reported every time.
+*/
+CommandLine* lookupParsedLine(const char* src, size_t len) {
+    unsigned int hash = hashBytes(src, len);
+    CommandLine** bucket = &parseCache[hash & (PARSE_CACHE_SIZE - 1)];
+    for (CommandLine* line = *bucket; line != NULL; line = line->next) {
+        if (line->hash == hash && line->len == len && memcmp(line->source, src, len) == 0) {
+            parse_cache_hits++;
+            return line;
         }
     }
+
+    parse_cache_misses++;
+    if (parse_cache_entries >= PARSE_CACHE_SIZE || parseArena.bytes > PARSE_CACHE_LIMIT) {
+        flushParseCache();
+    }
+    traceEvent('B', "parse", NULL);
+    CommandLine* line = parseLine(src, len);
+    traceEvent('E', "parse", NULL);
+    if (line == NULL) {
+        return NULL;
+    }
+    line->source = arenaStrndup(&parseArena, src, len);
+    line->len = len;
+    line->hash = hash;
+    line->next = *bucket;
+    *bucket = line;
+    parse_cache_entries++;
+    return line;
 }
 
 /*
-  Function: changeDirectory
+  Function: initLaunchMode
 
   Description:
-  Changes the current working directory to the directory specified in the command arguments.
+  Selects the engine used to start external commands from the FLASH_LAUNCH environment variable.
+  "spawn" selects posix_spawn(), "fork" selects fork() + execvp() and "zygote" starts the zygote
+  launcher. When the variable is unset, the build-time default FLASH_DEFAULT_LAUNCH is kept.
+  If the zygote cannot be started, fork() is used.
 
-  Parameters:
-  - parsed: An array of strings representing the command and its arguments, where parsed[1] contains the directory to change to.
-
-  Returns:
-  Void. Changes the current working directory.
+  Parameters: None
 
-  Notes:
-  - Checks if the expected argument for "cd" command is provided.
-  - Uses chdir() system call to change the current working directory.
-  - Prints an error message if chdir() fails.
+  Returns: None
 */
-void changeDirectory(char** parsed) {
-    // `parsed[1]` should be the directory to change to
-    if (parsed[1] == NULL) {
-        fprintf(stderr, "Expected argument to \"cd\"\n");
+void initLaunchMode() {
+    char* mode = getenv("FLASH_LAUNCH");
+    if (mode == NULL || *mode == '\0') {
+        // Keep the default
+    } else if (strcmp(mode, "spawn") == 0) {
+        launch_mode = LAUNCH_SPAWN;
+    } else if (strcmp(mode, "fork") == 0) {
+        launch_mode = LAUNCH_FORK;
+    } else if (strcmp(mode, "zygote") == 0) {
+        launch_mode = LAUNCH_ZYGOTE;
     } else {
-        if (chdir(parsed[1]) != 0) {
-            perror("chdir failed");
-        }
+        fprintf(stderr, "Unknown FLASH_LAUNCH mode \"%s\", expected \"spawn\", \"fork\" or \"zygote\"\n", mode);
+    }
+    if (launch_mode == LAUNCH_ZYGOTE && startZygote() < 0) {
+        launch_mode = LAUNCH_FORK;
     }
 }
 
+/*
+  Function: initTimeLog
+
+  Description:
+  Opens the per-command timing log named by the FLASH_TIMELOG environment variable, if set.
+  Lines are appended, one per command, in the format described in reportUsage().
+
+  Parameters: None
+
+  Returns: None
+*/
+void initTimeLog() {
+    char* path = getenv("FLASH_TIMELOG");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0 || (time_log = fdopen(fd, "a")) == NULL) {
+        perror(path);
+        return;
+    }
+    setvbuf(time_log, NULL, _IOLBF, 0); // One write per command, so nothing is lost on a crash
+}
 
 /*
-  Function: execCommandSeq
+  Function: initTrace
 
   Description:
-  Executes a sequence of commands provided as a single input string. 
-  Supports commands separated by ',' and handles piped commands.
+  Starts the execution trace if FLASH_TRACE names a file.
 
-  Parameters:
-  - inputString: The input string containing the sequence of commands to execute.
+  Parameters: None
 
-  Returns:
-  Void. Executes the sequence of commands.
+  Returns: None
 
   Notes:
-  - Parses the input string into individual commands separated by ','.
-  - Processes each command using processString() function.
-  - Executes each command or piped commands accordingly.
+  - The file is truncated and holds one JSON array of Chrome trace events, which chrome://tracing
+    and Perfetto load as is. Each command is a "command" span holding "parse", "expand", "builtin",
+    "spawn" and "wait" spans, and "exec-failure" events.
+  - Events are buffered and written in TRACE_BUFFER_SIZE blocks, and the rest at exit.
 */
-void execCommandSeq(char* inputString) {
-    char* command;
-    char* rest = inputString;
-    char* parsedArgs[MAXLIST] = {NULL}; // Initialize parsedArgs array with NULL pointers
-    char* parsedArgsPiped[MAXLIST] = {NULL}; // Initialize parsedArgsPiped array with NULL pointers
-    int background = 0;
+void initTrace() {
+    char* path = getenv("FLASH_TRACE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+    if (trace_fd < 0) {
+        perror(path);
+        return;
+    }
+    traceBuffer = (char*)malloc(TRACE_BUFFER_SIZE);
+    if (!traceBuffer) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    trace_pid = getpid();
+    if (write(trace_fd, "[\n", 2) < 0) { // Written now, ahead of the blocks of forked subshells
+        perror(path);
+    }
+    atexit(finishTrace);
+}
 
-    while ((command = strsep(&rest, ",")) != NULL) {
-        int execFlag = processString(command, parsedArgs, parsedArgsPiped, &background);
+/*
+  Function: initEnvironment
 
-        if (execFlag == 1) { // No pipe
-            if (strcmp(parsedArgs[0], "cd") == 0) {
-                changeDirectory(parsedArgs);
-            } else {
-                execArgs(parsedArgs, background);
-            }
-        } else if (execFlag == 2) { // Piped commands
-            parseSpace(command, parsedArgs);
-            execArgsPiped(parsedArgs, parsedArgsPiped);
+  Description:
+  Imports the environment flash was started with into the variable table, with every variable exported,
+  so children see it unchanged and "$HOME" or "get PATH" work without a "set" first.
+
+  Parameters: None
+
+  Returns: None
+*/
+void initEnvironment() {
+    for (char** env = environ; *env != NULL; env++) {
+        char* equal_sign = strchr(*env, '=');
+        if (equal_sign == NULL || equal_sign == *env) {
+            continue;
+        }
+        char* name = strndup(*env, equal_sign - *env);
+        if (!name) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
         }
+        insertIntoHashTable(name, equal_sign + 1);
+        exportVariable(name, 1);
+        free(name);
     }
 }
 
 /*
-Function: parseSpace
+  Function: executeLine
 
-Description:
-Processes a given input string, separating it into individual tokens based on spaces or commas.
-Handles quoted strings, allowing spaces within quotes to be considered as part of the token.
-Allocates memory for each token and copies it into the parsed array.
+  Description:
+  Executes one command line and releases everything that was allocated for it.
+  Background jobs that exited in the meantime are reaped first.
 
-Parameters:
-- str: The input string to be processed.
-- parsed: An array of strings to store the parsed tokens.
+  Parameters:
+  - line: The command line. It is not modified and does not need to be null-terminated.
+  - len: The length of the command line.
 
-Returns: None
+  Returns: None
 
-Notes:
-- Handles quoted strings enclosed within double quotes.
-- Supports escaping within quoted strings using backslashes.
-- Each token is copied into the parsed array after memory allocation.
-- The last element of the parsed array is set to NULL to indicate the end.
+  Notes:
+  - The line is parsed through the parse cache, so a line seen before is not parsed again.
+  - A line with a syntax error sets 'last_exit_status' to 2.
 */
-void parseSpace(char* str, char** parsed) {
-    int i = 0;
-    int in_quote = 0;
+void executeLine(const char* line, size_t len) {
+    reapJobs(); // Collect background jobs that exited since the last line
+    CommandLine* parsed = lookupParsedLine(line, len);
+    if (parsed != NULL) {
+        execCommandSeq(parsed->commands, parsed->ncommands);
+    } else {
+        last_exit_status = 2;
+    }
+    if (arena_stats) {
+        fprintf(stderr, "arena: %zu allocations, %zu bytes\n", lineArena.allocations, lineArena.bytes);
+    }
+    arenaReset(&lineArena); // Everything parsed from this line is released at once
+    clearGlobCache();
+}
 
-    while (*str != '\0') {
-        // Skip leading spaces
-        while (*str == ' ')
-            str++;
+/*
+  Function: executeBuffer
 
-        // Break if end of string is reached
-        if (*str == '\0')
-            break;
+  Description:
+  Executes every line of a buffer holding a script, without printing any prompt.
 
-        // Find the end of the current token
-        char* end = str;
-        if (*end == '"') {
-            // Handle quoted string
-            end++; // Move past the opening quote
-            in_quote = 1;
-        }
-        while (*end != '\0' && ((*end != ' ' && *end != ',') || in_quote)) {
-            if (*end == '"' && *(end - 1) != '\\') {
-                in_quote = 0; // End of quoted string
-            }
-            end++;
-        }
+  Parameters:
+  - data: The script text. It is not modified and does not need to be null-terminated.
+  - len: The length of the script text.
 
-        // Allocate memory for the token and copy it
-        parsed[i] = (char*)malloc((end - str + 1) * sizeof(char));
-        if (parsed[i] == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(EXIT_FAILURE);
-        }
+  Returns: None
 
-        // Copy token without quotes
-        if (*str == '"') {
-            str++; // Move past the opening quote
-            strncpy(parsed[i], str, end - str - 1); // Exclude the closing quote
-            parsed[i][end - str - 1] = '\0';
-        } else {
-            strncpy(parsed[i], str, end - str);
-            parsed[i][end - str] = '\0';
-        }
-        i++;
+  Notes:
+  - Lines are parsed straight from the buffer, so they can be of any length.
+  - A first line starting with "#!" is skipped, so scripts can be made executable.
+*/
+void executeBuffer(const char* data, size_t len) {
+    const char* end = data + len;
+    const char* line = data;
 
-        // Move to the next token
-        str = end;
+    if (len >= 2 && data[0] == '#' && data[1] == '!') {
+        const char* newline = memchr(data, '\n', len);
+        line = newline ? newline + 1 : end;
     }
 
-    // Set the last element of the parsed array to NULL to indicate the end
-    parsed[i] = NULL;
+    while (line < end) {
+        const char* newline = memchr(line, '\n', end - line);
+        const char* lineEnd = newline ? newline : end;
+        executeLine(line, lineEnd - line);
+        line = lineEnd + 1;
+    }
 }
 
 /*
-  Function: processString
+  Function: executeScript
 
   Description:
-  Processes a given input string, separating it into individual commands and parsing their arguments.
-  Handles piped commands and checks for special commands like 'exit', 'set', and 'get'.
+  Runs a script file non-interactively.
 
   Parameters:
-  - str: The input string to be processed.
-  - parsed: An array of strings to store the arguments of the command.
-  - parsedpipe: An array of strings to store the arguments of the piped command (if present).
-  - background: A pointer to an integer indicating whether the command should be executed in the background.
+  - path: The path of the script file.
 
   Returns:
-  An integer indicating the type of command:
-  - 0 if no command to execute (empty input or 'exit' command).
-  - 1 if a single command to execute.
-  - 2 if piped commands to execute.
+  0 on success, or -1 if the file could not be opened (an error has been printed).
 
   Notes:
-  - Checks for special commands like 'exit', 'set', and 'get'.
-  - Handles background execution indicated by '#' at the end of the command.
-  - Splits piped commands and parses their arguments.
+  - Regular files are mapped with mmap() and executed straight from the mapping.
+  - Other files (pipes, character devices) are read through a large stdio buffer with getline().
+  - In both cases a first line starting with "#!" is skipped.
 */
-int processString(char* str, char** parsed, char** parsedpipe, int* background) {
-    if (str == NULL || *str == '\0') {
-        // No input provided, return 0 to indicate no command to execute
-        return 0;
+int executeScript(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
     }
 
-    char* strpiped[2];
-    int piped = 0;
-
-    // Check for background execution
-    int len = strlen(str);
-    if (len > 0 && str[len - 1] == '#') {
-        *background = 1;
-        str[len - 1] = '\0'; // Remove '#' from command
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        executeBuffer(data, st.st_size);
+        munmap(data, st.st_size);
+        return 0;
     }
 
-    // Check if the command is 'exit'
-    if (strcmp(str, "exit") == 0) {
-        exit(0); // Exit the shell
+    FILE* file = fdopen(fd, "r");
+    if (file == NULL) {
+        perror("fdopen");
+        close(fd);
+        return -1;
     }
-
-    // Split command into piped parts
-    char* pipeSeparator = strstr(str, "|");
-    if (pipeSeparator != NULL) {
-        piped = 1;
-        *pipeSeparator = '\0'; // Replace underscore with null terminator
-        strpiped[0] = str;
-        strpiped[1] = pipeSeparator + 1; // Move to the next character after underscore
-        parseSpace(strpiped[0], parsed);
-        parseSpace(strpiped[1], parsedpipe);
-    } else {
-        parseSpace(str, parsed);
+    setvbuf(file, NULL, _IOFBF, INPUT_BUFFER_SIZE);
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int first = 1;
+    while ((len = getline(&line, &cap, file)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (first && strncmp(line, "#!", 2) == 0) {
+            first = 0;
+            continue; // Skip the interpreter line
+        }
+        first = 0;
+        executeLine(line, len);
     }
+    free(line);
+    fclose(file);
+    return 0;
+}
 
-    if (strncmp(parsed[0], "set", 3) == 0) {
-        setEnvVar(parsed);
-        return 0;
-    } else if (strncmp(parsed[0], "get", 3) == 0) {
-        getEnvVar(parsed);
-        return 0;
+// Main function
+int main(int argc, char** argv) {
+    initLaunchMode();
+    initBuiltins();
+    initEnvironment();
+    initJobs();
+    arena_stats = getenv("FLASH_ARENA_STATS") != NULL;
+    initTimeLog();
+    initTrace();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    parallel_limit = cpus > 0 ? (int)cpus : 1;
+
+    int arg = 1;
+    if (arg + 1 < argc && strcmp(argv[arg], "-j") == 0) {
+        // flash -j N: run at most N "&&&" commands at once
+        parallel_limit = atoi(argv[arg + 1]);
+        if (parallel_limit < 1) {
+            fprintf(stderr, "%s: -j expects a positive number\n", argv[0]);
+            return 2;
+        }
+        arg += 2;
     }
 
-    return piped ? 2 : 1;
-}
+    if (arg < argc && strcmp(argv[arg], "-c") == 0) {
+        // flash -c 'command line'
+        if (arg + 1 >= argc) {
+            fprintf(stderr, "Usage: %s [-j N] [-c command | script]\n", argv[0]);
+            return 2;
+        }
+        executeBuffer(argv[arg + 1], strlen(argv[arg + 1]));
+        return last_exit_status;
+    } else if (arg < argc) {
+        // flash script.fsh
+        if (executeScript(argv[arg]) < 0) {
+            return 127;
+        }
+        return last_exit_status;
+    }
 
-// Main function
-int main() {
-    char inputString[MAXCOM];
-    while (1) {
-        if (takeInput(inputString)) continue;
-        execCommandSeq(inputString);
+    interactive = isatty(STDIN_FILENO);
+    if (!interactive) {
+        setvbuf(stdin, NULL, _IOFBF, INPUT_BUFFER_SIZE);
     }
-    return 0;
-}
\ No newline at end of file
+    if (interactive) {
+        initHistory(1);
+    }
+    char* inputString;
+    while ((inputString = takeInput()) != NULL) {
+        if (interactive) {
+            if ((inputString = expandHistory(inputString)) == NULL) {
+                continue;
+            }
+            addHistory(inputString);
+        }
+        executeLine(inputString, strlen(inputString));
+    }
+    return last_exit_status;
+}
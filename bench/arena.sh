@@ -0,0 +1,29 @@
+#!/bin/sh
+# Runs a long script through flash and samples its resident set size, to
+# show that per-line memory is recycled and RSS stays flat.
+# Usage: bench/arena.sh [lines] [sample_interval_seconds]
+FLASH=${FLASH:-./flash}
+N=${1:-1000000}
+INTERVAL=${2:-1}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+# Builtins only, so the run measures the shell rather than process launches
+awk -v n="$N" 'BEGIN {
+    print "set V=value"
+    for (i = 0; i < n; i++)
+        printf "get V \"line %d with a quoted argument\" a b c d e f, hash -d nothing%d, get V\n", i, i
+    print "exit"
+}' > "$SCRIPT"
+
+"$FLASH" < "$SCRIPT" > /dev/null &
+PID=$!
+printf "seconds\trss_kb\n"
+t=0
+while kill -0 "$PID" 2> /dev/null; do
+    rss=$(awk '/^VmRSS/ { print $2 }' "/proc/$PID/status" 2> /dev/null)
+    [ -n "$rss" ] && printf "%d\t%s\n" "$t" "$rss"
+    sleep "$INTERVAL"
+    t=$((t + INTERVAL))
+done
+wait "$PID"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs a command over a list too long for one exec. "direct" passes the whole
+# list and fails with E2BIG, "batch" splits it into ARG_MAX-sized batches on
+# one core, and "parallel" runs the same batches on every core. Each item
+# costs a little CPU in the command, so the parallel run scales with cores.
+# Usage: bench/batch.sh [items]
+FLASH=${FLASH:-./flash}
+N=${1:-1000000}
+JOBS=$(nproc)
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+WORK='for f; do case \$f in *9) ;; esac; done'
+run() {
+    echo "$2" > "$SCRIPT"
+    start=$(date +%s.%N)
+    "$FLASH" "$SCRIPT" > /dev/null 2>&1
+    status=$?
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$N" -v mode="$1" -v status="$status" '{ printf "%s\t%d\t%.3f\t%d\n", mode, n, $2 - $1, status }'
+}
+
+printf "mode\titems\tseconds\texit\n"
+run direct "sh -c \"$WORK\" sh \$(seq $N), exit \$?"
+run batch "batch -j 1 sh -c \"$WORK\" sh -- \$(seq $N), exit \$?"
+run parallel "batch -j $JOBS sh -c \"$WORK\" sh -- \$(seq $N), exit \$?"
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Commands per second for script lines running `echo` as a builtin inside the
+# shell and as the external /bin/echo, which costs a process launch per line.
+# Usage: bench/builtin.sh [lines]
+FLASH=${FLASH:-./flash}
+N=${1:-100000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    awk -v n="$N" -v cmd="$1" 'BEGIN { for (i = 0; i < n; i++) printf "%s hello %d\n", cmd, i }' > "$SCRIPT"
+    start=$(date +%s.%N)
+    "$FLASH" "$SCRIPT" > /dev/null 2>&1
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$N" -v mode="$2" '{ t = $2 - $1; printf "%s\t%d\t%.3f\t%.0f\n", mode, n, t, n / t }'
+}
+
+printf "mode\tcommands\tseconds\tcommands/s\n"
+run echo builtin
+run /bin/echo external
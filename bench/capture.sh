@@ -0,0 +1,27 @@
+#!/bin/sh
+# Starts many background jobs that all write at once and waits for them. Their
+# output is captured by the shell's single epoll loop into per-job ring
+# buffers; the report shows the run time, the captured throughput, and the
+# shell's thread count and peak RSS, which should not grow with the jobs.
+# Usage: bench/capture.sh [jobs] [lines_per_job]
+FLASH=${FLASH:-./flash}
+N=${1:-200}
+LINES=${2:-100000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+awk -v n="$N" -v lines="$LINES" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "seq %d #\n", lines
+    print "wait"
+    # The last job still holds the tail of its output
+    printf "dump %d | tail -1\n", n
+    # Run grep with flash as its parent, so it reads flash'"'"'s own status
+    print "sh -c \"grep -E \\\"Threads|VmHWM\\\" /proc/\\$PPID/status\""
+}' > "$SCRIPT"
+
+BYTES=$(seq "$LINES" | wc -c)
+start=$(date +%s.%N)
+"$FLASH" "$SCRIPT"
+end=$(date +%s.%N)
+echo "$N $BYTES $start $end" | awk '{ t = $4 - $3; printf "jobs %d, %.3f s, %.1f MB captured, %.1f MB/s\n", $1, t, $1 * $2 / 1e6, $1 * $2 / 1e6 / t }'
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Moves a large file with the cat, tee and cp builtins and with coreutils.
+# "file" copies to a file, "pipe" copies into a pipe read by wc -c and "tee"
+# copies a pipe to a file and to /dev/null. Each case runs one command under
+# flash, once with the builtin and once with the external program named by
+# its full path, and reports GB/s.
+# Usage: bench/cat.sh [size], with a size as accepted by head -c (default 2G)
+FLASH=$(realpath "${FLASH:-./flash}")
+SIZE=${1:-2G}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/flash-cat.XXXXXX")
+SCRIPT=$(mktemp)
+trap 'rm -rf "$DIR" "$SCRIPT"' EXIT
+
+head -c "$SIZE" /dev/zero > "$DIR/in"
+BYTES=$(stat -c %s "$DIR/in")
+
+run() {
+    echo "$3" > "$SCRIPT"
+    rm -f "$DIR/out"
+    start=$(date +%s.%N)
+    (cd "$DIR" && "$FLASH" "$SCRIPT" > /dev/null)
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v b="$BYTES" -v mode="$1" -v prog="$2" \
+        '{ printf "%s\t%s\t%d\t%.3f\t%.2f\n", mode, prog, b, $2 - $1, b / ($2 - $1) / 1e9 }'
+}
+
+printf "mode\tprogram\tbytes\tseconds\tGB/s\n"
+run file builtin 'cat in > out'
+run file coreutils "$(command -v cat) in > out"
+run pipe builtin 'cat in | wc -c'
+run pipe coreutils "$(command -v cat) in | wc -c"
+run cp builtin 'cp in out'
+run cp coreutils "$(command -v cp) in out"
+run tee builtin 'cat in | tee out > /dev/null'
+run tee coreutils "$(command -v cat) in | $(command -v tee) out > /dev/null"
@@ -0,0 +1,94 @@
+/*
+    Command completion latency microbenchmark.
+
+    Fills a temporary directory with executables, puts it on PATH ahead of /usr/bin and /bin, and
+    completes random two-letter prefixes with completeCommand(), the function Tab calls. It prints:
+    - build: the first completion, which lists every PATH directory and sorts the index.
+    - p50/p99: later completions, each of which stats the PATH directories and searches the index.
+    - refresh: the completion right after a program is added, which lists that one directory again.
+    FLASH.c is included directly so the benchmark runs the same code as the shell.
+
+    Build and run: make bench/complete && ./bench/complete [executables] [completions]
+*/
+#define main flash_main
+#include "../FLASH.c"
+#undef main
+
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double* samples, int count, double p) {
+    return samples[(int)(p * (count - 1))];
+}
+
+int main(int argc, char** argv) {
+    int executables = argc > 1 ? atoi(argv[1]) : 20000;
+    int completions = argc > 2 ? atoi(argv[2]) : 10000;
+    char dir[] = "/tmp/flash-complete-XXXXXX";
+    char path[PATH_MAX];
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    for (int i = 0; i < executables; i++) {
+        snprintf(path, sizeof(path), "%s/%c%c-tool-%d", dir, 'a' + i % 26, 'a' + i / 26 % 26, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+        if (fd < 0) {
+            perror(path);
+            return 1;
+        }
+        close(fd);
+    }
+
+    initEnvironment();
+    snprintf(path, sizeof(path), "%s:/usr/bin:/bin", dir);
+    insertIntoHashTable("PATH", path);
+
+    double t0 = now();
+    size_t found = completeCommand("", 0);
+    double build = (now() - t0) * 1e6;
+
+    double* samples = (double*)malloc(completions * sizeof(double));
+    srand(1);
+    for (int i = 0; i < completions; i++) {
+        char prefix[3] = {'a' + rand() % 26, 'a' + rand() % 26, '\0'};
+        t0 = now();
+        completeCommand(prefix, 2);
+        samples[i] = (now() - t0) * 1e6;
+    }
+    qsort(samples, completions, sizeof(double), compareDoubles);
+
+    snprintf(path, sizeof(path), "%s/zz-new-tool", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+    close(fd);
+    t0 = now();
+    size_t added = completeCommand("zz-new", 6);
+    double refresh = (now() - t0) * 1e6;
+
+    printf("executables\tbuild_us\tp50_us\tp99_us\trefresh_us\n");
+    printf("%zu\t%.0f\t%.1f\t%.1f\t%.0f\n", found, build, percentile(samples, completions, 0.5),
+           percentile(samples, completions, 0.99), refresh);
+
+    for (size_t i = 0; i < execIndex.ndirs; i++) {
+        if (strcmp(execIndex.dirs[i].path, dir) == 0) {
+            for (size_t j = 0; j < execIndex.dirs[i].count; j++) {
+                snprintf(path, sizeof(path), "%s/%s", dir, execIndex.dirs[i].names[j]);
+                unlink(path);
+            }
+        }
+    }
+    rmdir(dir);
+    free(samples);
+    return added == 1 ? 0 : 1;
+}
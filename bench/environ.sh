@@ -0,0 +1,33 @@
+#!/bin/sh
+# Launches per second with 1k exported variables. "cached" reuses the child
+# environment built once, "rebuilt" changes an exported variable before every
+# launch so the environment is rebuilt each time, and "empty" starts from an
+# empty environment for reference.
+# Usage: bench/environ.sh [launches] [exported_vars]
+FLASH=${FLASH:-./flash}
+N=${1:-2000}
+VARS=${2:-1000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    awk -v n="$N" -v vars="$VARS" -v mode="$1" 'BEGIN {
+        if (mode != "empty")
+            for (i = 0; i < vars; i++)
+                printf "export V%d=value_of_exported_variable_%d\n", i, i
+        for (i = 0; i < n; i++) {
+            if (mode == "rebuilt")
+                printf "set V0=%d, ", i
+            print "/bin/true"
+        }
+    }' > "$SCRIPT"
+    start=$(date +%s.%N)
+    env -i "$FLASH" "$SCRIPT" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$N" -v mode="$1" '{ t = $2 - $1; printf "%s\t%d\t%.3f\t%.0f\n", mode, n, t, n / t }'
+}
+
+printf "mode\tlaunches\tseconds\tlaunches/s\n"
+run empty
+run cached
+run rebuilt
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Feeds one stream to three consumers. "fanout" runs the producer once with
+# "|>", "rerun" runs it once per consumer and "file" writes it to a file that
+# each consumer then reads. The producer is seq, whose cost grows with the
+# stream, and the consumers are wc -l, cksum and grep -c.
+# Usage: bench/fanout.sh [lines]
+FLASH=$(realpath "${FLASH:-./flash}")
+N=${1:-50000000}
+DIR=$(mktemp -d)
+SCRIPT=$(mktemp)
+trap 'rm -rf "$DIR" "$SCRIPT"' EXIT
+
+BYTES=$(seq "$N" | wc -c)
+
+run() {
+    echo "$2" > "$SCRIPT"
+    start=$(date +%s.%N)
+    (cd "$DIR" && "$FLASH" "$SCRIPT" > /dev/null)
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v b="$BYTES" -v mode="$1" \
+        '{ printf "%s\t%d\t%.3f\t%.1f\n", mode, b, $2 - $1, b / ($2 - $1) / 1e6 }'
+}
+
+printf "mode\tbytes\tseconds\tMB/s\n"
+run fanout "seq $N |> (wc -l, cksum, grep -c 9)"
+run rerun "seq $N | wc -l, seq $N | cksum, seq $N | grep -c 9"
+run file "seq $N > stream, wc -l < stream, cksum < stream, grep -c 9 < stream"
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Expands patterns over a directory of many files. "one" matches a single
+# pattern, "cached" matches four patterns in one command, which read the
+# directory once, and "uncached" runs the four patterns as four commands,
+# which read it four times. "bash" runs the same four patterns for comparison.
+# Usage: bench/glob.sh [files]
+FLASH=$(realpath "${FLASH:-./flash}")
+N=${1:-500000}
+DIR=$(mktemp -d)
+SCRIPT=$(mktemp)
+trap 'rm -rf "$DIR" "$SCRIPT"' EXIT
+
+(cd "$DIR" && seq "$N" | sed 's/.*/file&.log/' | xargs touch)
+
+run() {
+    echo "$2" > "$SCRIPT"
+    start=$(date +%s.%N)
+    (cd "$DIR" && "$FLASH" "$SCRIPT" > /dev/null)
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$N" -v mode="$1" '{ printf "%s\t%d\t%.3f\n", mode, n, $2 - $1 }'
+}
+
+printf "mode\tfiles\tseconds\n"
+run one 'echo file*1.log'
+run cached 'echo file*1.log file*2.log file*3.log file*4.log'
+run uncached 'echo file*1.log, echo file*2.log, echo file*3.log, echo file*4.log'
+if command -v bash > /dev/null; then
+    echo 'echo file*1.log file*2.log file*3.log file*4.log' > "$SCRIPT"
+    start=$(date +%s.%N)
+    (cd "$DIR" && bash "$SCRIPT" > /dev/null)
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$N" '{ printf "bash\t%d\t%.3f\n", n, $2 - $1 }'
+fi
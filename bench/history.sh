@@ -0,0 +1,26 @@
+#!/bin/sh
+# History load and search times over a large history file. "load" splits
+# the default 16 MB window into entries, "full" loads the whole file,
+# "search" builds the trigram index and runs one substring search, and
+# "search x100" shows the cost of each further search.
+# Usage: bench/history.sh [entries]
+FLASH=${FLASH:-./flash}
+N=${1:-2000000}
+HISTORY_FILE=$(mktemp)
+trap 'rm -f "$HISTORY_FILE"' EXIT
+
+seq "$N" | awk '{ printf "gcc -O2 -c src/module%d.c -o build/module%d.o && ./run --case %d\n", $1 % 5000, $1 % 5000, $1 }' > "$HISTORY_FILE"
+echo "echo needle-in-the-haystack" >> "$HISTORY_FILE"
+
+run() {
+    start=$(date +%s.%N)
+    FLASH_HISTORY="$HISTORY_FILE" FLASH_HISTORY_LOAD=$3 "$FLASH" -c "$2" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$N" -v mode="$1" '{ printf "%s\t%d\t%.3f\n", mode, n, $2 - $1 }'
+}
+
+printf "mode\tentries\tseconds\n"
+run load 'history 1' 16777216
+run full 'history 1' 1073741824
+run search 'history -s needle' 16777216
+run "search x100" 'repeat 100 { history -s needle }' 16777216
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Launches many background jobs from one script and reports the run time and
+# the shell's peak RSS, which should stay bounded however many jobs are run.
+# Usage: bench/jobs.sh [jobs]
+FLASH=${FLASH:-./flash}
+N=${1:-20000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+awk -v n="$N" 'BEGIN {
+    for (i = 0; i < n; i++)
+        print "/bin/true #"
+    print "wait"
+}' > "$SCRIPT"
+# Run grep with flash as its parent, so it reads flash's own VmHWM
+echo 'sh -c "grep VmHWM /proc/\$PPID/status"' >> "$SCRIPT"
+
+start=$(date +%s.%N)
+"$FLASH" "$SCRIPT"
+end=$(date +%s.%N)
+echo "$N $start $end" | awk '{ t = $3 - $2; printf "jobs %d, %.3f s, %.0f jobs/s\n", $1, t, $1 / t }'
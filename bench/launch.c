@@ -0,0 +1,79 @@
+/*
+    Launch latency microbenchmark.
+
+    Starts /bin/true over and over with each launch engine and prints the 50th and 99th percentile of:
+    - start: the time launchCommand() blocks the shell before it gets the pid back.
+    - total: the time until the child has exited and been waited for.
+    The heap is first grown with touched ballast memory, which is what makes fork() slower as its
+    page tables are copied on every launch. The zygote is started before the ballast, as the shell
+    starts it before allocating anything. FLASH.c is included directly so the benchmark runs the
+    same launchCommand() the shell uses.
+
+    Build and run: make bench/launch && ./bench/launch [launches] [ballast_megabytes]
+*/
+#define main flash_main
+#include "../FLASH.c"
+#undef main
+
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double* samples, int count, double p) {
+    return samples[(int)(p * (count - 1))];
+}
+
+int main(int argc, char** argv) {
+    int launches = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t ballast = (argc > 2 ? atoi(argv[2]) : 512) * 1024UL * 1024UL;
+    const char* names[] = {"spawn", "fork", "zygote"};
+    int modes[] = {LAUNCH_SPAWN, LAUNCH_FORK, LAUNCH_ZYGOTE};
+
+    if (startZygote() < 0) {
+        return 1;
+    }
+    initEnvironment();
+    char* heap = (char*)malloc(ballast);
+    if (!heap) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    memset(heap, 1, ballast);
+
+    double* start = (double*)malloc(launches * sizeof(double));
+    double* total = (double*)malloc(launches * sizeof(double));
+    char* args[] = {"/bin/true", NULL};
+    printf("engine\tballast_MB\tlaunches\tstart_p50_us\tstart_p99_us\ttotal_p50_us\ttotal_p99_us\n");
+    for (int m = 0; m < 3; m++) {
+        launch_mode = modes[m];
+        for (int i = 0; i < launches; i++) {
+            int status;
+            double t0 = now();
+            pid_t pid = launchCommand(args, -1, -1, -1);
+            double t1 = now();
+            if (pid < 0 || waitChild(pid, &status) < 0) {
+                return 1;
+            }
+            start[i] = (t1 - t0) * 1e6;
+            total[i] = (now() - t0) * 1e6;
+            arenaReset(&lineArena);
+        }
+        qsort(start, launches, sizeof(double), compareDoubles);
+        qsort(total, launches, sizeof(double), compareDoubles);
+        printf("%s\t%zu\t%d\t%.1f\t%.1f\t%.1f\t%.1f\n", names[m], ballast >> 20, launches,
+               percentile(start, launches, 0.5), percentile(start, launches, 0.99),
+               percentile(total, launches, 0.5), percentile(total, launches, 0.99));
+    }
+    free(heap);
+    return 0;
+}
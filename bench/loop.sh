@@ -0,0 +1,33 @@
+#!/bin/sh
+# Microseconds per iteration of a builtin body run N times: "repeat" and "for"
+# run a body parsed once, "unrolled" is the same body written out N times so
+# every line goes through the parser (or its cache).
+# Usage: bench/loop.sh [iterations]
+FLASH=${FLASH:-./flash}
+N=${1:-100000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    awk -v n="$N" -v mode="$1" 'BEGIN {
+        if (mode == "repeat")
+            printf "repeat %d { set I=x, true }\n", n
+        else if (mode == "for") {
+            printf "for i in"
+            for (i = 0; i < n; i++)
+                printf " %d", i
+            print "; do set I=$i, true; done"
+        } else
+            for (i = 0; i < n; i++)
+                printf "set I=%d, true\n", i
+    }' > "$SCRIPT"
+    start=$(date +%s.%N)
+    "$FLASH" "$SCRIPT" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$N" -v mode="$1" '{ t = $2 - $1; printf "%s\t%d\t%.3f\t%.3f\n", mode, n, t, t * 1e6 / n }'
+}
+
+printf "mode\titerations\tseconds\tus/iteration\n"
+run repeat
+run for
+run unrolled
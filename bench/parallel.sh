@@ -0,0 +1,29 @@
+#!/bin/sh
+# Wall-clock time of a list of CPU-bound commands joined with "&&&", for
+# worker counts from 1 to the number of CPUs.
+# Usage: bench/parallel.sh [commands] [megabytes_per_command]
+FLASH=${FLASH:-./flash}
+CPUS=$(nproc)
+N=${1:-$((CPUS * 2))}
+MB=${2:-200}
+
+LINE=""
+i=0
+while [ "$i" -lt "$N" ]; do
+    [ -n "$LINE" ] && LINE="$LINE &&& "
+    LINE="${LINE}head -c ${MB}M /dev/zero | sha256sum"
+    i=$((i + 1))
+done
+
+printf "workers\tseconds\tspeedup\n"
+base=""
+j=1
+while [ "$j" -le "$CPUS" ]; do
+    start=$(date +%s.%N)
+    "$FLASH" -j "$j" -c "$LINE" > /dev/null
+    end=$(date +%s.%N)
+    t=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')
+    [ -z "$base" ] && base=$t
+    echo "$j $t $base" | awk '{ printf "%d\t%.3f\t%.2f\n", $1, $2, $3 / $2 }'
+    j=$((j + 1))
+done
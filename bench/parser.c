@@ -0,0 +1,87 @@
+/*
+    Parser throughput microbenchmark.
+
+    Builds a large synthetic script of varied command lines (quotes, variables, pipelines,
+    "&&&" lists, sequences) and measures:
+    - parse: parseLine() on every line, in MB/s and lines/s.
+    - cached: lookupParsedLine() over a small set of lines that repeat, as in loops or scripts
+      that run the same commands many times, where every lookup after the first is a cache hit.
+    FLASH.c is included directly so the benchmark runs the same parser the shell uses.
+
+    Build and run: make bench/parser && ./bench/parser [megabytes]
+*/
+#define main flash_main
+#include "../FLASH.c"
+#undef main
+
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* templates[] = {
+    "ls -l /usr/lib%d > /dev/null",
+    "echo \"value %d is $VALUE\" ${NAME}_suffix $?, set COUNT=%d",
+    "cat input%d.txt | grep -v \"^#\" | sort | uniq -c | sort -rn > out.txt",
+    "gzip -k part%d.log &&& gzip -k other.log &&& sort big.txt | uniq > big.uniq",
+    "printf \"%%s=%%05d\\n\" key %d, test $COUNT -lt 100, get PIPESTATUS",
+    "sleep %d #",
+};
+
+static void report(const char* what, size_t bytes, size_t lines, double seconds) {
+    printf("%-7s %10zu lines %8.1f MB %8.3f s %8.1f MB/s %12.0f lines/s\n",
+           what, lines, bytes / 1e6, seconds, bytes / 1e6 / seconds, lines / seconds);
+}
+
+int main(int argc, char** argv) {
+    size_t target = (argc > 1 ? atoi(argv[1]) : 64) * 1000000UL;
+    size_t ntemplates = sizeof(templates) / sizeof(templates[0]);
+    char* text = (char*)malloc(target + 256);
+    size_t len = 0;
+    size_t lines = 0;
+    while (len < target) {
+        len += sprintf(text + len, templates[lines % ntemplates], (int)lines, (int)lines);
+        text[len++] = '\n';
+        lines++;
+    }
+
+    // Uncached: every line goes through the tokenizer and the parser
+    double start = now();
+    for (const char* line = text; line < text + len; ) {
+        const char* newline = memchr(line, '\n', text + len - line);
+        if (parseLine(line, newline - line) == NULL) {
+            return 1;
+        }
+        if (parseArena.bytes > PARSE_CACHE_LIMIT) {
+            arenaReset(&parseArena);
+        }
+        line = newline + 1;
+    }
+    report("parse", len, lines, now() - start);
+    arenaReset(&parseArena);
+
+    // Cached: the first 1000 lines, looked up over and over
+    size_t distinct = 1000;
+    const char* end = text;
+    for (size_t i = 0; i < distinct; i++) {
+        end = (const char*)memchr(end, '\n', text + len - end) + 1;
+    }
+    size_t rounds = len / (end - text);
+    start = now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (const char* line = text; line < end; ) {
+            const char* newline = memchr(line, '\n', end - line);
+            if (lookupParsedLine(line, newline - line) == NULL) {
+                return 1;
+            }
+            line = newline + 1;
+        }
+    }
+    report("cached", rounds * (end - text), rounds * distinct, now() - start);
+    printf("cache: %lu hits, %lu misses\n", parse_cache_hits, parse_cache_misses);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Counts execve/stat calls made while running many short commands, with a
+# long PATH in front of the directory that holds them. Needs strace.
+# Usage: bench/pathcache.sh [commands] [extra_path_dirs]
+FLASH=${FLASH:-./flash}
+N=${1:-1000}
+DIRS=${2:-10}
+command -v strace > /dev/null || { echo "strace not found" >&2; exit 1; }
+
+SEARCH=""
+i=0
+while [ "$i" -lt "$DIRS" ]; do
+    SEARCH="$SEARCH/nonexistent/dir$i:"
+    i=$((i + 1))
+done
+SEARCH="$SEARCH$PATH"
+
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "sleep 0"; print "exit" }' > "$SCRIPT"
+
+for mode in spawn fork; do
+    echo "== FLASH_LAUNCH=$mode, $N commands, $DIRS extra PATH entries"
+    FLASH_LAUNCH=$mode PATH="$SEARCH" strace -f -c -e trace=execve,newfstatat,stat \
+        "$FLASH" < "$SCRIPT" 2>&1 > /dev/null | grep -E 'calls|execve|stat'
+done
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Pipeline throughput as the number of stages grows: head | cat x N | wc.
+# Usage: bench/pipeline.sh [max_stages] [megabytes]
+FLASH=${FLASH:-./flash}
+MAX=${1:-8}
+MB=${2:-256}
+
+printf "cat_stages\tseconds\tMB/s\n"
+n=0
+while [ "$n" -le "$MAX" ]; do
+    line="head -c ${MB}M /dev/zero"
+    i=1
+    while [ "$i" -le "$n" ]; do
+        line="$line | cat"
+        i=$((i + 1))
+    done
+    line="$line | wc -c > /dev/null"
+    start=$(date +%s.%N)
+    printf '%s\nexit\n' "$line" | "$FLASH" > /dev/null
+    end=$(date +%s.%N)
+    echo "$n $start $end $MB" | awk '{ t = $3 - $2; printf "%d\t%.3f\t%.1f\n", $1, t, $4 / t }'
+    n=$((n + 1))
+done
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Lines executed per second for a script run with `flash script` (mmap) and
+# with the same lines fed to the interactive read loop on stdin.
+# Usage: bench/script.sh [lines]
+FLASH=${FLASH:-./flash}
+N=${1:-100000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+# Builtin-only lines, so the numbers reflect line handling rather than process launches
+awk -v n="$N" 'BEGIN {
+    print "set V=value"
+    for (i = 0; i < n; i++)
+        printf "get V, hash -d missing%d\n", i
+}' > "$SCRIPT"
+
+run() {
+    start=$(date +%s.%N)
+    "$@" > /dev/null 2>&1
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$N" -v mode="$MODE" '{ t = $2 - $1; printf "%s\t%d\t%.3f\t%.0f\n", mode, n, t, n / t }'
+}
+
+printf "mode\tlines\tseconds\tlines/s\n"
+MODE=script run "$FLASH" "$SCRIPT"
+MODE=stdin run sh -c '"$0" < "$1"' "$FLASH" "$SCRIPT"
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Launches per second for each launch engine.
+# Usage: bench/spawn.sh [launches] [ballast_vars]
+# ballast_vars `set` lines are run first to grow the shell's heap, which is
+# what makes fork() slower as page tables get copied on every launch.
+FLASH=${FLASH:-./flash}
+N=${1:-2000}
+BALLAST=${2:-50000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+VALUE=$(head -c 200 /dev/zero | tr '\0' x)
+awk -v n="$BALLAST" -v v="$VALUE" 'BEGIN { for (i = 0; i < n; i++) printf "set B%d=%s\n", i, v }' > "$SCRIPT"
+WARM=$(mktemp)
+cp "$SCRIPT" "$WARM"
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "/bin/true"; print "exit" }' >> "$SCRIPT"
+echo exit >> "$WARM"
+
+printf "engine\tlaunches\tseconds\tlaunches/s\n"
+for mode in spawn fork; do
+    start=$(date +%s.%N)
+    FLASH_LAUNCH=$mode "$FLASH" < "$WARM" > /dev/null
+    mid=$(date +%s.%N)
+    FLASH_LAUNCH=$mode "$FLASH" < "$SCRIPT" > /dev/null
+    end=$(date +%s.%N)
+    # Subtract the time spent building the ballast
+    echo "$mode $N $start $mid $end" | awk '{ t = ($5 - $4) - ($4 - $3); printf "%s\t%d\t%.3f\t%.0f\n", $1, $2, t, $2 / t }'
+done
+rm -f "$WARM"
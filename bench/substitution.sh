@@ -0,0 +1,23 @@
+#!/bin/sh
+# Command substitutions per second. "builtin" runs $(echo) inside the shell
+# with no fork or pipe, "external" reads $(/bin/echo) through a pipe, and
+# "subshell" runs a sequence of commands in a forked copy of the shell.
+# Usage: bench/substitution.sh [builtin_runs] [other_runs]
+FLASH=${FLASH:-./flash}
+N=${1:-200000}
+M=${2:-2000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    echo "repeat $2 { set X=$3 }" > "$SCRIPT"
+    start=$(date +%s.%N)
+    "$FLASH" "$SCRIPT" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$2" -v mode="$1" '{ t = $2 - $1; printf "%s\t%d\t%.3f\t%.0f\n", mode, n, t, n / t }'
+}
+
+printf "mode\truns\tseconds\tsubstitutions/s\n"
+run builtin "$N" '$(echo hello)'
+run external "$M" '$(/bin/echo hello)'
+run subshell "$M" '$(echo hello, echo world)'
@@ -0,0 +1,346 @@
+/*
+    Regression benchmark suite, run by "make bench".
+
+    Runs the shell's hot paths on synthetic input and prints one JSON object per case with operations
+    per second, the 50th and 99th percentile latency of one operation, and the peak RSS:
+    - spawn: "/bin/true" through executeLine(), which ends in execArgs() and one launch.
+    - builtin: "true" through executeLine(): a parse cache hit and a builtin, no process.
+    - pipeline: "echo x" followed by 15 "/bin/cat" stages, through execArgsPiped().
+    - parse: parseLine() on varied lines with quotes, variables, pipelines and lists.
+    - huge-line: a 1 MB "echo" line of 100k words into /dev/null, parsed anew each time.
+    - set-get: setting and reading 100k variables in the variable table.
+    Operations too short to time one by one are timed in batches, and their latency is the batch
+    time divided by its size. Each case runs in a forked copy of the driver, so its peak RSS is its own.
+
+    Each case is run several times (-r, 5 by default) and the best value of each metric is kept,
+    for the baseline as for the comparison, so one slow run on a busy machine does not count.
+
+    With -b, the results are compared with a baseline written earlier by the suite. A case regresses
+    when its ops/s drop, or its p50 latency or peak RSS grow, by more than the threshold (-t, in
+    percent, 15 by default). The change must also be above a noise floor: LATENCY_SLACK_US per
+    operation for ops/s and p50, which keeps sub-microsecond cases from failing on timer jitter,
+    and RSS_SLACK_KB for peak RSS. The comparison is printed on stderr and the exit code is 1 on
+    any regression. A missing baseline file is not an error.
+    FLASH.c is included directly so the suite runs the same code as the shell.
+
+    Build and run: make bench, make bench-baseline, or
+    ./bench/suite [-b baseline.json] [-t percent] [-s scale] [-r runs]
+*/
+#define main flash_main
+#include "../FLASH.c"
+#undef main
+
+#include <math.h>
+#include <time.h>
+
+#define RSS_SLACK_KB 1024 // peak RSS growth below this is noise, whatever the threshold
+#define LATENCY_SLACK_US 0.1 // and so is a slowdown of less than this per operation
+
+typedef struct {
+    char name[16];
+    long ops;
+    double seconds;
+    double p50; // microseconds per operation
+    double p99;
+    long rss; // peak resident set size in KB
+}BenchResult;
+
+typedef struct {
+    const char* name;
+    int samples;
+    int batch; // operations timed together as one sample
+    void (*setup)();
+    void (*run)(int index);
+}BenchCase;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static char* text = NULL; // input built by the setup of a case
+static char** lines = NULL;
+static size_t nlines = 0;
+
+static void runLine(const char* line) {
+    executeLine(line, strlen(line));
+}
+
+static void runSpawn(int index) {
+    runLine("/bin/true");
+}
+
+static void runBuiltin(int index) {
+    runLine("true");
+}
+
+static void setupPipeline() {
+    text = (char*)malloc(512);
+    strcpy(text, "echo x");
+    for (int i = 0; i < 15; i++) {
+        strcat(text, " | /bin/cat");
+    }
+}
+
+static void runPipeline(int index) {
+    runLine(text);
+}
+
+static const char* templates[] = {
+    "ls -l /usr/lib%d > /dev/null",
+    "echo \"value %d is $VALUE\" ${NAME}_suffix $?, set COUNT=%d",
+    "cat input%d.txt | grep -v \"^#\" | sort | uniq -c | sort -rn > out.txt",
+    "gzip -k part%d.log &&& gzip -k other.log &&& sort big.txt | uniq > big.uniq",
+    "printf \"%%s=%%05d\\n\" key %d, test $COUNT -lt 100, get PIPESTATUS",
+    "for f in a%d b c; do wc -l $f, echo done; done",
+};
+
+static void setupParse() {
+    size_t ntemplates = sizeof(templates) / sizeof(templates[0]);
+    nlines = 10000;
+    lines = (char**)malloc(nlines * sizeof(char*));
+    for (size_t i = 0; i < nlines; i++) {
+        lines[i] = (char*)malloc(128);
+        snprintf(lines[i], 128, templates[i % ntemplates], (int)i, (int)i);
+    }
+}
+
+static void runParse(int index) {
+    const char* line = lines[index % nlines];
+    if (parseLine(line, strlen(line)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    if (parseArena.bytes > PARSE_CACHE_LIMIT) {
+        arenaReset(&parseArena);
+    }
+}
+
+static void setupHugeLine() {
+    size_t words = 100000;
+    text = (char*)malloc(words * 16 + 64);
+    size_t len = sprintf(text, "echo");
+    for (size_t i = 0; i < words; i++) {
+        len += sprintf(text + len, i % 10 == 0 ? " \"word %zu\"" : i % 10 == 5 ? " $HOME/%zu" : " w%zu", i);
+    }
+    strcpy(text + len, " > /dev/null");
+}
+
+static void runHugeLine(int index) {
+    flushParseCache(); // Parse it every time, not just the first
+    runLine(text);
+}
+
+static void setupSetGet() {
+    nlines = 100000;
+    lines = (char**)malloc(nlines * sizeof(char*));
+    for (size_t i = 0; i < nlines; i++) {
+        lines[i] = (char*)malloc(24);
+        snprintf(lines[i], 24, "VAR%zu", i);
+    }
+}
+
+static void runSetGet(int index) {
+    const char* name = lines[index % nlines];
+    insertIntoHashTable(name, "value");
+    if (searchInHashTable(name) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static BenchCase cases[] = {
+    {"spawn", 2000, 1, NULL, runSpawn},
+    {"builtin", 2000, 100, NULL, runBuiltin},
+    {"pipeline", 200, 1, setupPipeline, runPipeline},
+    {"parse", 1000, 100, setupParse, runParse},
+    {"huge-line", 30, 1, setupHugeLine, runHugeLine},
+    {"set-get", 1000, 1000, setupSetGet, runSetGet},
+};
+
+// Runs one case in a forked child, with the shell's output sent to /dev/null
+static int runCase(const BenchCase* bench, int scale, BenchResult* result) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+        close(fds[0]);
+        if (bench->setup) {
+            bench->setup();
+        }
+        int samples = bench->samples * scale;
+        double* latencies = (double*)malloc(samples * sizeof(double));
+        int op = 0;
+        double start = now();
+        for (int i = 0; i < samples; i++) {
+            double t0 = now();
+            for (int j = 0; j < bench->batch; j++) {
+                bench->run(op++);
+            }
+            latencies[i] = (now() - t0) * 1e6 / bench->batch;
+        }
+        memset(result, 0, sizeof(BenchResult));
+        result->seconds = now() - start;
+        result->ops = op;
+        qsort(latencies, samples, sizeof(double), compareDoubles);
+        result->p50 = latencies[(int)(0.5 * (samples - 1))];
+        result->p99 = latencies[(int)(0.99 * (samples - 1))];
+        _exit(write(fds[1], result, sizeof(BenchResult)) != sizeof(BenchResult));
+    }
+    close(fds[1]);
+    int ok = pid > 0 && readFully(fds[0], result, sizeof(BenchResult)) == 0;
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0 || !ok || status != 0) {
+        fprintf(stderr, "%s: case failed\n", bench->name);
+        return -1;
+    }
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+    result->rss = usage.ru_maxrss;
+    return 0;
+}
+
+// Keeps the best value of each metric over the runs of a case
+static void keepBest(BenchResult* best, const BenchResult* run, int first) {
+    if (first) {
+        *best = *run;
+        return;
+    }
+    if (run->ops / run->seconds > best->ops / best->seconds) {
+        best->ops = run->ops;
+        best->seconds = run->seconds;
+    }
+    best->p50 = run->p50 < best->p50 ? run->p50 : best->p50;
+    best->p99 = run->p99 < best->p99 ? run->p99 : best->p99;
+    best->rss = run->rss < best->rss ? run->rss : best->rss;
+}
+
+// Finds a case in a baseline written by printResult()
+static int findBaseline(const char* baseline, const char* name, BenchResult* result) {
+    char key[64];
+    snprintf(key, sizeof(key), "{\"name\": \"%s\",", name);
+    const char* line = baseline != NULL ? strstr(baseline, key) : NULL;
+    double rate;
+    if (line == NULL ||
+        sscanf(line + strlen(key), " \"ops\": %ld, \"ops_per_sec\": %lf, \"p50_us\": %lf, \"p99_us\": %lf, "
+               "\"peak_rss_kb\": %ld", &result->ops, &rate, &result->p50, &result->p99, &result->rss) != 5) {
+        return 0;
+    }
+    result->seconds = rate > 0 ? result->ops / rate : 0; // Keeps ops/seconds exactly the saved rate
+    return 1;
+}
+
+static void printResult(const BenchResult* result, int last) {
+    printf("    {\"name\": \"%s\", \"ops\": %ld, \"ops_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+           "\"peak_rss_kb\": %ld, \"seconds\": %.3f}%s\n", result->name, result->ops, result->ops / result->seconds,
+           result->p50, result->p99, result->rss, result->seconds, last ? "" : ",");
+}
+
+// Prints one metric of the comparison and returns 1 if it got worse by more than the threshold and
+// by more than 'slack' in absolute terms
+static int compareMetric(const char* name, const char* metric, double base, double value, int higherIsBetter,
+                         double threshold, double slack) {
+    double change = base > 0 ? (value - base) / base * 100 : 0;
+    int regressed = (higherIsBetter ? change < -threshold : change > threshold) && fabs(value - base) > slack;
+    fprintf(stderr, "%-10s %-12s %12.3f %12.3f %+8.1f%%%s\n", name, metric, base, value, change,
+            regressed ? "  REGRESSION" : "");
+    return regressed;
+}
+
+int main(int argc, char** argv) {
+    const char* baselinePath = NULL;
+    double threshold = 15;
+    int scale = 1;
+    int runs = 5;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-b") == 0) {
+            baselinePath = argv[i + 1];
+        } else if (strcmp(argv[i], "-t") == 0) {
+            threshold = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            scale = atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : 1;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            runs = atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : 1;
+        }
+    }
+
+    // Read the baseline first: "make bench" may be writing the new results over it
+    char* baseline = NULL;
+    if (baselinePath != NULL) {
+        FILE* file = fopen(baselinePath, "r");
+        if (file == NULL) {
+            fprintf(stderr, "No baseline at %s; run \"make bench-baseline\" to save one\n", baselinePath);
+        } else {
+            baseline = (char*)calloc(1, 1024 * 1024);
+            fread(baseline, 1, 1024 * 1024 - 1, file);
+            fclose(file);
+        }
+    }
+
+    initLaunchMode();
+    initBuiltins();
+    initEnvironment();
+    initJobs();
+    setenv("VALUE", "v", 1);
+
+    int ncases = sizeof(cases) / sizeof(cases[0]);
+    BenchResult* results = (BenchResult*)calloc(ncases, sizeof(BenchResult));
+    for (int i = 0; i < ncases; i++) {
+        for (int run = 0; run < runs; run++) {
+            BenchResult result;
+            if (runCase(&cases[i], scale, &result) < 0) {
+                return 1;
+            }
+            keepBest(&results[i], &result, run == 0);
+        }
+    }
+
+    printf("{\n  \"threshold_percent\": %.1f,\n  \"runs\": %d,\n  \"cases\": [\n", threshold, runs);
+    for (int i = 0; i < ncases; i++) {
+        printResult(&results[i], i == ncases - 1);
+    }
+    printf("  ]\n}\n");
+
+    if (baseline == NULL) {
+        return 0;
+    }
+    int regressions = 0;
+    fprintf(stderr, "%-10s %-12s %12s %12s %9s\n", "case", "metric", "baseline", "now", "change");
+    for (int i = 0; i < ncases; i++) {
+        const BenchResult* result = &results[i];
+        BenchResult base;
+        if (!findBaseline(baseline, result->name, &base)) {
+            fprintf(stderr, "%-10s not in the baseline\n", result->name);
+            continue;
+        }
+        // The latency floor as a rate: the drop in ops/s when each operation takes LATENCY_SLACK_US longer
+        double baseRate = base.ops / base.seconds;
+        double rateSlack = baseRate - 1e6 / (1e6 / baseRate + LATENCY_SLACK_US);
+        regressions += compareMetric(result->name, "ops/s", baseRate, result->ops / result->seconds, 1, threshold,
+                                     rateSlack);
+        regressions += compareMetric(result->name, "p50_us", base.p50, result->p50, 0, threshold,
+                                     LATENCY_SLACK_US);
+        regressions += compareMetric(result->name, "peak_rss_kb", base.rss, result->rss, 0, threshold,
+                                     RSS_SLACK_KB);
+    }
+    if (regressions > 0) {
+        fprintf(stderr, "%d metric(s) regressed by more than %.1f%%\n", regressions, threshold);
+        return 1;
+    }
+    fprintf(stderr, "No regression beyond %.1f%%\n", threshold);
+    return 0;
+}
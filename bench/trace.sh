@@ -0,0 +1,24 @@
+#!/bin/sh
+# Cost of the execution trace. Runs a loop of builtins with and without
+# FLASH_TRACE and divides the extra time by the number of events written.
+# Each iteration records a command, an expand and a builtin span.
+# Usage: bench/trace.sh [iterations]
+FLASH=${FLASH:-./flash}
+N=${1:-1000000}
+TRACE=$(mktemp)
+trap 'rm -f "$TRACE"' EXIT
+
+run() {
+    start=$(date +%s.%N)
+    env $1 "$FLASH" -c "repeat $N { true }"
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ print $2 - $1 }'
+}
+
+plain=$(run)
+traced=$(run FLASH_TRACE="$TRACE")
+events=$(grep -c '"ph"' "$TRACE")
+bytes=$(wc -c < "$TRACE")
+printf "mode\titerations\tseconds\n"
+printf "plain\t%d\t%.3f\ntraced\t%d\t%.3f\n" "$N" "$plain" "$N" "$traced"
+echo "$plain $traced $events $bytes" | awk '{ printf "%d events, %.1f MB, %.0f ns per event\n", $3, $4 / 1e6, ($2 - $1) * 1e9 / $3 }'
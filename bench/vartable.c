@@ -0,0 +1,76 @@
+/*
+    Variable table microbenchmark.
+
+    Measures set (insert), set (in-place update), get and unset operations per second
+    at 10, 10k and 1M variables. FLASH.c is included directly so the benchmark exercises
+    the same insertIntoHashTable/searchInHashTable/removeFromHashTable code the shell runs.
+
+    Build and run: make bench/vartable && ./bench/vartable
+*/
+#define main flash_main
+#include "../FLASH.c"
+#undef main
+
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* op, size_t vars, size_t ops, double seconds) {
+    printf("%-8s %8zu vars %10zu ops %8.3f s %12.0f ops/s\n", op, vars, ops, seconds, ops / seconds);
+}
+
+int main(int argc, char** argv) {
+    size_t sizes[] = {10, 10000, 1000000};
+    size_t minOps = 2000000; // small tables are cycled through until this many operations ran
+    char name[32];
+    char value[64];
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        size_t rounds = (minOps + n - 1) / n;
+        double start;
+
+        start = now();
+        for (size_t i = 0; i < n; i++) {
+            snprintf(name, sizeof(name), "VAR%zu", i);
+            snprintf(value, sizeof(value), "value-%zu", i);
+            insertIntoHashTable(name, value);
+        }
+        report("insert", n, n, now() - start);
+
+        start = now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < n; i++) {
+                snprintf(name, sizeof(name), "VAR%zu", i);
+                insertIntoHashTable(name, "updated");
+            }
+        }
+        report("update", n, rounds * n, now() - start);
+
+        size_t found = 0;
+        start = now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < n; i++) {
+                snprintf(name, sizeof(name), "VAR%zu", i);
+                found += searchInHashTable(name) != NULL;
+            }
+        }
+        report("get", n, rounds * n, now() - start);
+        if (found != rounds * n) {
+            fprintf(stderr, "lookup mismatch: %zu of %zu found\n", found, rounds * n);
+            return 1;
+        }
+
+        start = now();
+        for (size_t i = 0; i < n; i++) {
+            snprintf(name, sizeof(name), "VAR%zu", i);
+            removeFromHashTable(name);
+        }
+        report("unset", n, n, now() - start);
+    }
+    return 0;
+}